@@ -0,0 +1,55 @@
+#ifndef INC_COMBING_TABLES_H_
+#define INC_COMBING_TABLES_H_
+
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+#include "lcs_kernel.h"
+#include "monge_matrix.h"
+
+namespace LCS {
+namespace kernel {
+
+// Four-Russians combing for strings over at most 4 distinct characters, such as DNA.
+// The braid is combed in blocks of BLOCK x BLOCK cells. The strands leaving a block depend only on its
+// characters and on the relative order of the 2 BLOCK strands entering it, so they are looked up in a table
+// indexed by the characters and by one bit for every pair of entering strands. With 2 x 2 blocks the table
+// takes 16 KB, and the blocks of one row block share a slice of 1 KB; larger blocks would need tables
+// far beyond the caches. Rows and columns that do not fill a block are combed cell by cell.
+class CombingTables {
+public:
+    static const unsigned BLOCK = 2;
+
+    // Returns the tables, which are built on the first call.
+    static const CombingTables &get();
+
+    // Combs the braid of a and b and returns their LCS kernel, the same permutation as RecursiveLCS::kernel.
+    // Throws std::invalid_argument if more than 4 distinct characters occur in a and b.
+    matrix::Permutation comb(std::string_view a, std::string_view b) const;
+    // Throws std::invalid_argument if more than 4 distinct characters occur in a and b, so that they can not be
+    // combed with the tables. Callers that comb blocks of a and b check the whole strings first.
+    static void check_alphabet(std::string_view a, std::string_view b);
+private:
+    CombingTables();
+
+    // The exits of the strands of every block, by the characters of its rows, the order of its entering strands
+    // and the characters of its columns. An entry holds the entering strand that leaves at every exit in 2 bits:
+    // the bottoms of the block columns first, then the right ends of the block rows.
+    std::vector <std::uint8_t> table;
+};
+
+// Class that calculates the LCS kernel for two strings over at most 4 distinct characters with CombingTables.
+// This allows it to solve the semi-local LCS problem for two strings a and b in O(|a||b|) time,
+// combing about twice as fast as IterativeLCS.
+class TableLCS: public LCSKernel {
+public:
+    // Initialize the LCS kernel for strings a and b.
+    // Throws std::invalid_argument if more than 4 distinct characters occur in a and b.
+    TableLCS(std::string_view a, std::string_view b, Ownership ownership = Ownership::COPY);
+};
+
+}  // namespace kernel
+}  // namespace LCS
+
+#endif  // INC_COMBING_TABLES_H_
@@ -2,9 +2,17 @@
 #define INC_FIBONACCI_H_
 
 #include <string>
+#include <string_view>
 #include <iostream>
+#include <bitset>
+#include <functional>
+#include <limits>
+#include <map>
 #include <memory>
+#include <unordered_map>
 
+#include "kernel_file.h"
+#include "kernel_store.h"
 #include "lcs_kernel.h"
 #include "monge_matrix.h"
 
@@ -16,9 +24,15 @@ class GrammarCompressed;
 // Class that stores a context-free grammar for GC-string generation.
 class GrammarCompressedStorage {
 public:
-	unsigned final_rule; // The outer rule index for the rule that sets the whole string.
+	// The final rule of the grammar of the empty text, which has no rule for the whole string.
+	static constexpr unsigned NO_RULE = std::numeric_limits<unsigned>::max();
+
+	unsigned final_rule = NO_RULE; // The outer rule index for the rule that sets the whole string.
 	std::vector <GrammarCompressed> rules; // All rules in the grammar.
 
+	// Returns whether the grammar is for the empty text. It may still have rules, such as terminals.
+	bool empty() const { return final_rule == NO_RULE; }
+
 	void add_rule(const GrammarCompressed &rule) {
 		rules.push_back(rule);
 	}
@@ -33,8 +47,11 @@ public:
 	const char value;  // the alphabet value for base rules
 	unsigned int first_symbol;  // the index of the left rule for non-bases
 	unsigned int second_symbol;  // the index of the right rule for non-bases
+	// The number of repetitions of first_symbol for run-length rules, 0 for other rules.
+	// Run-length rules have second_symbol equal to first_symbol.
+	unsigned long long run_length;
 
-    GrammarCompressed(GrammarCompressedStorage &gc_storage): gc_storage(gc_storage), number(0), is_base(0), value(0), first_symbol(0), second_symbol(0) {}
+    GrammarCompressed(GrammarCompressedStorage &gc_storage): gc_storage(gc_storage), number(0), is_base(0), value(0), first_symbol(0), second_symbol(0), run_length(0) {}
 
 	explicit GrammarCompressed(GrammarCompressedStorage &gc_storage,
 		                       int number, char c): gc_storage(gc_storage),
@@ -42,14 +59,27 @@ public:
 													is_base(true),
 													value(c),
 													first_symbol(0),
-													second_symbol(0) {}
+													second_symbol(0),
+													run_length(0) {}
 	GrammarCompressed(GrammarCompressedStorage &gc_storage, int number, unsigned int first_symbol, unsigned int second_symbol):
 	    gc_storage(gc_storage),
 		number(number),
 		is_base(false),
 		value(0), 
 		first_symbol(first_symbol),
-		second_symbol(second_symbol) {}
+		second_symbol(second_symbol),
+		run_length(0) {}
+
+	// Returns the run-length rule for the rule with index symbol repeated k times.
+	static GrammarCompressed run(GrammarCompressedStorage &gc_storage, int number, unsigned int symbol,
+	                             unsigned long long k) {
+		GrammarCompressed rule(gc_storage, number, symbol, symbol);
+		rule.run_length = k;
+		return rule;
+	}
+
+	// Returns whether the current rule is a run-length rule.
+	bool is_run() const { return run_length != 0; }
 
 	// Returns the decompressed string for the grammar.
 	std::string decompress(const GrammarCompressedStorage &gcs) const {
@@ -58,15 +88,127 @@ public:
 		// } else {
 		// 	std::cout << "decompressing rule " << number << " " <<  first_symbol << " " <<  second_symbol << "\n";
 		// }
+		if (is_run()) {
+			std::string period = gcs.rules[first_symbol].decompress(gcs), result;
+			result.reserve(period.size() * run_length);
+			for (unsigned long long i = 0; i < run_length; ++i) {
+				result += period;
+			}
+			return result;
+		}
 		return is_base ? std::string(1, value) : gcs.rules[first_symbol].decompress(gcs) 
 		                                       + gcs.rules[second_symbol].decompress(gcs);
 	}
 };
 
-GrammarCompressedStorage LZ78(const std::string &s);
-GrammarCompressedStorage LZW(const std::string &s);
-GrammarCompressedStorage LZW2(const std::string &s);
-GrammarCompressedStorage LZWASCII(const std::string &s);
+// Joins a sequence of phrase rules into a single rule using a balanced binary tree
+// of concatenation rules, so that the depth of the grammar is O(log z) for z phrases.
+// Phrases are added one by one and merged like in a binary counter,
+// so only the right spine of the tree is kept between additions.
+// If collapse_runs is set, consecutive phrases whose expansions are powers of the same rule, such as the
+// phrases a, aa, aaa of LZ compressors over a run of a, are joined into a single run-length rule.
+// Every rule is then expected to refer to earlier rules only. The concatenation rules are added one phrase later.
+class BalancedConcatenation {
+public:
+    explicit BalancedConcatenation(GrammarCompressedStorage &gcs, bool collapse_runs = false):
+        gcs(gcs), collapse_runs(collapse_runs) {}
+
+    // Appends the phrase given by the rule index to the concatenation.
+    void add(unsigned rule);
+    // Returns whether no phrases have been added yet.
+    bool empty() const { return spine.empty() && !run_length; }
+    // Adds the remaining concatenation rules and returns the index of the rule for the whole concatenation.
+    // The concatenation must not be empty.
+    unsigned finish();
+    // Adds the rules for the whole concatenation so far and returns the index of its rule, like finish,
+    // but keeps the spine, so that later additions continue the same tree.
+    // Only the O(log z) rules joining the spine are added, and they are not reused by later calls.
+    unsigned fold();
+private:
+    // Adds the rule for the concatenation of the two rules and returns its index.
+    unsigned concatenate(unsigned first, unsigned second);
+    // Adds the phrase to the concatenation tree.
+    void add_leaf(unsigned rule);
+    // Adds the pending run to the concatenation tree.
+    void flush_run();
+    // Returns the rule whose power the expansion of the rule is, with its exponent.
+    // Only powers visible from the rule structure are found: a terminal is its own period, runs multiply
+    // the exponent of their period, and the halves of a concatenation must be powers of the same rule.
+    std::pair <unsigned, unsigned long long> power_of(unsigned rule);
+
+    GrammarCompressedStorage &gcs;
+    const bool collapse_runs;
+    // Roots of the complete subtrees of the concatenation tree with their heights, left to right.
+    std::vector <std::pair <unsigned, unsigned> > spine;
+    unsigned run_rule = 0;  // the period of the run at the end of the concatenation
+    unsigned long long run_length = 0;  // the number of its repetitions not yet in the spine
+    unsigned run_phrase = 0;  // the first phrase of the run, used as it is if the run has one phrase
+    unsigned run_phrases = 0;  // the number of phrases in the run
+    std::vector <std::pair <unsigned, unsigned long long> > powers;  // power_of for the rules seen so far
+    std::unordered_map <char, unsigned> terminals;  // the first rule of every terminal value seen so far
+};
+
+// What a full-ASCII LZW compressor does once its dictionary reaches 2^max_bits entries.
+enum class DictionaryPolicy {
+    freeze,  // keep using the dictionary without adding new entries
+    reset    // drop all non-terminal entries and start over, like compress's CLEAR code
+};
+
+// Streaming full-ASCII LZW compressor.
+// Symbols are pushed one at a time and the grammar is extended as soon as a phrase
+// is finished, so the plaintext never has to be held in memory.
+// The dictionary is bounded by 2^max_bits entries (terminals included), as in UNIX compress.
+// Throws std::invalid_argument if max_bits is not from 9 to 63: fewer bits leave no room past the terminals.
+class LZWStream {
+public:
+    explicit LZWStream(unsigned max_bits = 16, DictionaryPolicy policy = DictionaryPolicy::reset);
+
+    // Feeds the next symbol of the text to the compressor.
+    void push(char c);
+    // Feeds all symbols from first to last to the compressor.
+    template <class InputIt>
+    void push(InputIt first, InputIt last) {
+        for (; first != last; ++first) {
+            push(*first);
+        }
+    }
+    // Feeds all symbols from the stream to the compressor.
+    void push(std::istream &in);
+
+    // The grammar built so far. The phrase currently being matched is not a part of it yet.
+    const GrammarCompressedStorage &grammar() const { return gcs; }
+    // Finishes the last phrase and returns the grammar for the whole pushed text,
+    // an empty grammar if nothing was pushed yet. Later pushes continue the text.
+    // Every call only adds the rules for the right spine of the concatenation,
+    // so the grammar is append-only: the rules of earlier calls are never changed.
+    // The grammar is returned by reference, so that finishing after every chunk does not copy it.
+    const GrammarCompressedStorage &finish();
+
+    // The concatenation keeps a reference to the grammar, so the stream can not be copied.
+    LZWStream(const LZWStream &) = delete;
+    LZWStream &operator=(const LZWStream &) = delete;
+private:
+    GrammarCompressedStorage gcs;
+    // Maps (dictionary rule, next symbol) to the rule for their concatenation.
+    std::unordered_map <unsigned long long, unsigned> dictionary;
+    const unsigned long long max_entries;
+    const DictionaryPolicy policy;
+    bool has_phrase;  // is the current phrase non-empty
+    unsigned current_entry;  // the rule for the current phrase
+    BalancedConcatenation concatenation;  // the concatenation of all finished phrases
+};
+
+GrammarCompressedStorage LZ78(std::string_view s);
+GrammarCompressedStorage LZW(std::string_view s);
+// Full-ASCII LZW that resets its dictionary whenever it grows past 2^max_bits entries.
+GrammarCompressedStorage LZW2(std::string_view s, unsigned max_bits = 16);
+GrammarCompressedStorage LZW2(std::istream &in, unsigned max_bits = 16);
+// Full-ASCII LZW that freezes its dictionary once it has 2^max_bits entries.
+GrammarCompressedStorage LZWASCII(std::string_view s, unsigned max_bits = 16);
+GrammarCompressedStorage LZWASCII(std::istream &in, unsigned max_bits = 16);
+// Full-ASCII RePair: repeatedly replaces the most frequent pair of adjacent symbols with a new rule.
+// The remaining sequence is joined with a balanced concatenation. The empty string gives an empty grammar.
+GrammarCompressedStorage RePair(std::string_view s);
 std::string get_lz78_grammar_string(unsigned int number, unsigned int repeat_number = 0);
 std::string get_lzw_grammar_string(unsigned int number, unsigned int repeat_number = 0);
 std::string get_lz_grammar_string(unsigned int number);
@@ -74,24 +216,337 @@ std::string get_lz_grammar_string(unsigned int number);
 std::string get_uncompress_string(const std::string &file_name);
 GrammarCompressedStorage get_compress_string(const std::string &file_name);
 
-// Time agrep, delete later.
+// Rule counts of a grammar before and after normalization.
+struct NormalizationReport {
+    unsigned long long rules_before;
+    unsigned long long rules_after;
+};
+
+// Returns an equivalent grammar without rules unreachable from the final rule, where
+// structurally identical rules (same symbol, or same pair of normalized children) are merged.
+// Rules are numbered densely in topological order: children always precede their parents,
+// the final rule is the last one, and the number of every rule is its index plus one.
+// If report is not null, the rule counts before and after are written into it.
+GrammarCompressedStorage normalize(const GrammarCompressedStorage &gcs, NormalizationReport *report = nullptr);
+
+// Returns the indexes of all rules of the grammar in topological order: children precede their parents.
+std::vector <unsigned> topological_order(const GrammarCompressedStorage &gcs);
+
+// Karp-Rabin fingerprint of the string generated by a rule.
+// The hash base is drawn at random once per process, so collisions can not be prepared in advance,
+// and fingerprints are only comparable within one process.
+struct RuleFingerprint {
+    unsigned long long hash;  // the polynomial hash of the expansion modulo 2^61 - 1
+    unsigned long long power;  // the hash base to the power of the expansion length, modulo 2^61 - 1
+    unsigned long long length;  // the expansion length
+};
+
+// Calculates the fingerprints of all rules bottom-up in O(1) time per rule.
+std::vector <RuleFingerprint> fingerprint_rules(const GrammarCompressedStorage &gcs);
+
+// Groups rules that generate equal strings by their fingerprints.
+// Returns the representative for every rule: the first rule in topological order with the same expansion.
+// If verify is set, a rule only joins a group if its expansion is equal to that of the representative,
+// which rules out hash collisions. Rules with the same symbol, or with halves in the same groups, are equal
+// in O(1) time; other expansions are compared symbol by symbol in time proportional to their lengths.
+std::vector <unsigned> expansion_classes(const GrammarCompressedStorage &gcs, bool verify = true);
+
+// Whether the rules with equal expansions share one kernel, and how equal expansions are recognized.
+enum class ExpansionSharing {
+    NONE,  // every rule has its own kernel
+    VERIFIED,  // rules with equal fingerprints whose expansions are verified to be equal, see expansion_classes
+    // Rules with equal fingerprints only. Two different rules with colliding fingerprints would share a kernel
+    // and give a wrong lcs, with a probability of about (rules^2 * length) / 2^61.
+    UNVERIFIED,
+};
+
+// Set of the characters that occur in a string, indexed by their unsigned value.
+typedef std::bitset<256> AlphabetSignature;
+
+// Returns the alphabet signature of a string.
+AlphabetSignature alphabet_signature(std::string_view s);
+
+// Calculates the alphabet signatures of the expansions of all rules bottom-up in O(1) time per rule.
+std::vector <AlphabetSignature> alphabet_signatures(const GrammarCompressedStorage &gcs);
+
+// Returns the grammar of the string of number characters a: a single run-length rule over the terminal a,
+// next to terminals for all ASCII characters. Time agrep, delete later.
 GrammarCompressedStorage get_aaaa(unsigned long long number);
 
+// Builds a single grammar for many documents, with one root rule per document.
+// Structurally identical rules are merged within and across documents as in normalize,
+// so documents that share phrases share their rules.
+class GrammarCorpus {
+public:
+    // Adds a document given by a non-empty grammar and returns its index.
+    // Throws std::invalid_argument if the grammar is empty.
+    unsigned add(const GrammarCompressedStorage &document);
+    // Adds a non-empty plain document compressed with RePair and returns its index.
+    unsigned add(std::string_view document);
+    // Adds the document from a compressed file as read by get_compress_string and returns its index.
+    unsigned add_file(const std::string &file_name);
+
+    // The merged grammar. Its final rule is the root of the last added document.
+    const GrammarCompressedStorage &grammar() const { return gcs; }
+    // The root rules of the documents in the order they were added.
+    const std::vector <unsigned> &roots() const { return document_roots; }
+private:
+    GrammarCompressedStorage gcs;
+    std::vector <unsigned> document_roots;
+    std::vector <unsigned> terminal_rule;  // the rule for every character, if any
+    std::unordered_map <unsigned long long, unsigned> pair_rule;  // (first symbol, second symbol)
+    std::map <std::pair <unsigned, unsigned long long>, unsigned> run_rule;  // (symbol, run length)
+};
+
+// Solves the LCS problem for many plain patterns against a single grammar-compressed text.
+// The grammar is preprocessed once: only the rules reachable from the final rule are kept,
+// in topological order, with one rule per class of equal expansions unless sharing is ExpansionSharing::NONE.
+// Queries only read the engine and keep their scratch space in thread-local storage,
+// so they may be run concurrently from any number of threads.
+// An engine may also be built for several roots of one grammar, such as the documents of a corpus.
+// All roots are then evaluated together, and the text of the engine is the last root.
+class GCQueryEngine {
+public:
+    // Throws std::invalid_argument if t is empty.
+    explicit GCQueryEngine(const GrammarCompressedStorage &t,
+                           ExpansionSharing sharing = ExpansionSharing::VERIFIED);
+    // Initialize the engine for the given root rules of grammar t, which must not be empty.
+    // Throws std::invalid_argument if a root is GrammarCompressedStorage::NO_RULE.
+    GCQueryEngine(const GrammarCompressedStorage &t, const std::vector <unsigned> &root_rules,
+                  ExpansionSharing sharing = ExpansionSharing::VERIFIED);
+    // Initialize the engine for all documents of the corpus.
+    explicit GCQueryEngine(const GrammarCorpus &corpus, ExpansionSharing sharing = ExpansionSharing::VERIFIED);
+
+    // Returns the lcs for pattern p and the text.
+    // Kernel coordinates are stored in the narrowest integer type that fits them for the size of p.
+    // Rules that contain no characters of p share the no-match kernel, and a rule with
+    // such a half shares the kernel of its other half, so no products are calculated for them.
+    // The kernel of a rule is freed as soon as all rules that use it are calculated.
+    unsigned query(std::string_view p) const;
+    // Returns the lcs for pattern p and the text, and the memory use of the kernels of the query in stats.
+    unsigned query(std::string_view p, KernelStats &stats) const;
+    // Returns the lcs for pattern p and the text, where characters match if they are in the same class.
+    // The classes only change the pattern alphabet and the kernels of terminal rules, in O(|p|) time per terminal,
+    // so the text is not normalized.
+    unsigned query(std::string_view p, const kernel::CharClasses &classes) const;
+    // Returns the lcs for pattern p and the text, evaluating p in the given number of blocks,
+    // so that kernels carry at most twice as many strands as a block has characters.
+    // Blocks are joined along the pattern: the text positions where lcs(the earlier blocks, t[0:j + 1)) grows
+    // are the growth above the next block, which is swept over the text from left to right.
+    // Pieces of the text without growth above are passed through by sticky multiplication of their kernels,
+    // and the others are divided down to single characters, which finds the positions where the lcs grows.
+    // The kernels of up to threads blocks are calculated in parallel and kept for their sweeps,
+    // within the memory budget of each. With one block this is query.
+    unsigned query_split(std::string_view p, unsigned blocks = 2, unsigned threads = 1) const;
+    // Returns the lcs for the text of the pattern engine and the text, so that neither is decompressed.
+    // The kernel of a character is a cyclic shift over its positions in the pattern. It is calculated once
+    // per character, and the positions come from counts of the character per pattern rule, see occurrences.
+    // Throws std::length_error if the pattern is 2^32 characters long or longer.
+    unsigned query(const GCQueryEngine &pattern) const;
+    // Returns the lcs for pattern p and the text, keeping its kernels in cache_directory, in a file named
+    // by a hash of p and the grammar, which also keeps p to tell it apart from patterns with the same hash.
+    // A finished query is answered from the file without any products.
+    // Otherwise the kernels that are still needed are saved to the file after every checkpoint_interval rules,
+    // so that a query that was interrupted resumes from its last save. A damaged file is ignored.
+    unsigned query_cached(std::string_view p, const std::string &cache_directory,
+                          unsigned checkpoint_interval = 1 << 16) const;
+    // Returns a hash of the preprocessed grammar.
+    std::uint64_t content_hash() const;
+    // Returns the lcs for pattern p and the text of every root, in the order of the roots.
+    // The kernels of rules shared by several roots are calculated once.
+    std::vector <unsigned> query_all(std::string_view p) const;
+
+    // Limits the memory taken by the kernels of a query to about memory_budget bytes, spilling the rest
+    // to a memory-mapped file in spill_directory, see KernelStore. A budget of 0 removes the limit.
+    void set_memory_budget(std::size_t memory_budget, const std::string &spill_directory = "") {
+        this->memory_budget = memory_budget;
+        this->spill_directory = spill_directory;
+    }
+    // Keeps the kernels of a query bit-packed while they wait for the rules that use them, see PackedKernel.
+    // Takes several times less memory for kernels close to the identity, at the cost of unpacking them.
+    void set_kernel_packing(bool packing) { this->packing = packing; }
+
+    // Returns the length of the text.
+    unsigned long long text_length() const { return lengths[roots.back()]; }
+    // Returns the characters that occur in the text.
+    const AlphabetSignature &alphabet() const { return signatures[roots.back()]; }
+    // Returns the number of rules kept after preprocessing.
+    unsigned size() const { return nodes.size(); }
+private:
+    friend class GCSemiLocalKernel;
+    friend class GCIncrementalQuery;
+
+    // A preprocessed rule. Its halves are referenced by their indexes in nodes.
+    struct Node {
+        bool is_base;
+        char value;
+        unsigned first_symbol;
+        unsigned second_symbol;
+        unsigned long long run_length;
+    };
+
+    // Where and how often evaluate saves the kernels that are still needed, and the save it resumes from.
+    template <typename Index>
+    struct Checkpoint {
+        std::string file;
+        unsigned interval;
+        io::KernelArchive<Index> archive;  // with next 0 if there is nothing to resume from
+    };
+
+    // A pattern as seen by evaluate: its length, its alphabet and the sorted positions of a character in it.
+    struct Pattern {
+        unsigned size;
+        AlphabetSignature alphabet;
+        std::function <std::vector <unsigned>(char)> occurrences;
+    };
+    // Returns the pattern for a plain string, which must outlive it.
+    static Pattern plain_pattern(std::string_view p);
+    // Returns the pattern for a plain string whose characters match the characters of their classes.
+    // Its alphabet holds every character with a class that occurs in p.
+    static Pattern plain_pattern(std::string_view p, const kernel::CharClasses &classes);
+    // Returns the sorted positions of character c in the text, which must be shorter than 2^32.
+    // The occurrences of c are counted bottom-up over the rules, which places the positions of every rule
+    // in the result. Each rule is expanded once, at its leftmost occurrence, and its other occurrences
+    // and the copies of runs copy its positions, so the time is O(size() + number of positions).
+    // Throws std::length_error if the text is 2^32 characters long or longer.
+    std::vector <unsigned> occurrences(char c) const;
+
+    // Dispatches to query for the narrowest type of kernel coordinates that fits the pattern.
+    std::vector <unsigned> query(const Pattern &p, KernelStats *stats = nullptr) const;
+    // Returns the lcs for pattern p and the text of every root, storing kernel coordinates as Index.
+    // If stats is given, the memory use of the kernels is stored in it.
+    template <typename Index>
+    std::vector <unsigned> query(const Pattern &p, KernelStats *stats) const;
+    // Returns the compressed kernel for a pattern of size m and a character at the given positions in it.
+    template <typename Index>
+    static matrix::BasicPermutation<Index> calculate_char_kernel(unsigned m, const std::vector <unsigned> &positions);
+    // Returns the lcs for a pattern of size m and a text with the given compressed kernel.
+    template <typename Index>
+    static unsigned whole_lcs(const matrix::BasicPermutation<Index> &kernel, unsigned m);
+    // Calculates the compressed kernels for pattern p. The kernel of rule i is kept as kernel projected[i].
+    // If keep_kernels is set, the kernels of all rules are calculated and kept,
+    // otherwise only the kernels of the roots are kept after the calculation.
+    // If checkpoint is given, the calculation resumes from its archive and saves its progress.
+    template <typename Index>
+    void evaluate(const Pattern &p, std::vector <unsigned> &projected, std::vector <unsigned> &uses,
+                  KernelStore<Index> &kernels, bool keep_kernels, Checkpoint<Index> *checkpoint = nullptr) const;
+    template <typename Index>
+    unsigned query_cached(std::string_view p, const std::string &file, std::uint64_t key, unsigned interval) const;
+    template <typename Index>
+    unsigned query_split(std::string_view p, unsigned blocks, unsigned threads) const;
+    // Sweeps block p over the text with the kept kernels of evaluate, where the value above it grows
+    // at the sorted text positions tops. Returns lcs(the earlier blocks and p, t), and if steps is given,
+    // stores the sorted text positions j where lcs(the earlier blocks and p, t[0:j + 1)) grows in it.
+    template <typename Index>
+    unsigned sweep(const Pattern &p, const std::vector <unsigned> &projected, KernelStore<Index> &kernels,
+                   const std::vector <unsigned long long> &tops, std::vector <unsigned long long> *steps) const;
+
+    std::vector <Node> nodes;  // the rules in topological order
+    std::vector <unsigned> roots;  // the nodes of the root rules, the text of the engine is the last one
+    std::vector <unsigned long long> lengths;  // the expansion lengths of the rules
+    std::vector <AlphabetSignature> signatures;  // the alphabet signatures of the rules
+    std::size_t memory_budget = 0;  // the memory budget for kernels of a query in bytes, 0 if unlimited
+    std::string spill_directory;
+    bool packing = false;  // whether the kernels of a query are kept packed
+};
+
+// Class that solves the semi-local LCS problem for a plain string a and a grammar-compressed string b.
+// The kernels of all rules are kept. Queries for the whole of b are answered with a dominance counter
+// over the final kernel, and substrings of b are handled by concatenating the kernels
+// of the O(height) rules that cover them. Coordinates in b are 64-bit.
+class GCSemiLocalKernel {
+public:
+    // Initialize the LCS kernel for strings a and b. As for LCSKernel, a is copied unless ownership says otherwise.
+    GCSemiLocalKernel(std::string_view a, const GrammarCompressedStorage &b,
+                      ExpansionSharing sharing = ExpansionSharing::VERIFIED,
+                      kernel::Ownership ownership = kernel::Ownership::COPY);
+    // Initialize the LCS kernel for string a and the string b preprocessed by the engine, which is shared
+    // with the caller, so that one engine serves many kernels and queries without being copied.
+    GCSemiLocalKernel(std::string_view a, std::shared_ptr <const GCQueryEngine> engine,
+                      kernel::Ownership ownership = kernel::Ownership::COPY);
+    // Not copyable, since an owned a would be viewed by the copy.
+    GCSemiLocalKernel(const GCSemiLocalKernel &) = delete;
+    GCSemiLocalKernel &operator=(const GCSemiLocalKernel &) = delete;
+
+    // Returns the length of b.
+    unsigned long long text_length() const { return engine->text_length(); }
+
+    // The queries throw std::out_of_range for ranges that are reversed or reach past the end of a or b.
+    // Count the lcs of the whole string a and the substring of b from b_l to b_r.
+    unsigned lcs_whole_a(unsigned long long b_l, unsigned long long b_r) const;
+    // Count the lcs of the substring of a from a_l to a_r and the whole string b.
+    unsigned lcs_whole_b(unsigned a_l, unsigned a_r) const;
+    // Count the lcs for the suffix of a from a_l and the prefix of b until b_r.
+    unsigned lcs_suffix_a_prefix_b(unsigned a_l, unsigned long long b_r) const;
+    // Count the lcs for the prefix of a until a_r and the suffix of b from b_l.
+    unsigned lcs_prefix_a_suffix_b(unsigned a_r, unsigned long long b_l) const;
+private:
+    // Calculates the kernels of all rules and returns the dominance counter for the final one.
+    matrix::DominanceCounter evaluate();
+    // Returns the compressed kernel of the whole string b.
+    const matrix::Permutation &final_kernel() const;
+    // Returns the compressed kernel for the substring of b from b_l to b_r, b_l < b_r.
+    matrix::Permutation range_kernel(unsigned long long b_l, unsigned long long b_r) const;
+    // Count the lcs of the substring of a from a_l to a_r and the string with the given compressed kernel.
+    unsigned substring_lcs(const matrix::Permutation &kernel, unsigned a_l, unsigned a_r) const;
+
+    const std::string owned_a;  // the copy of a if the kernel owns it
+    const std::string_view a;
+    const std::shared_ptr <const GCQueryEngine> engine;
+    std::vector <unsigned> projected;  // the rules whose kernels are used for every rule
+    std::vector <matrix::Permutation> kernels;
+    const matrix::DominanceCounter whole_b;
+public:
+    const unsigned lcs;
+};
+
+// Keeps the lcs of a standing pattern and a growing grammar-compressed text. The grammar must only be appended to,
+// with every rule referring to earlier rules only, as the grammar of an LZWStream between calls of finish.
+// The kernels of all rules seen so far are kept, so an update only calculates the kernels of the rules added
+// since the previous one, and its cost is proportional to the new part of the grammar.
+class GCIncrementalQuery {
+public:
+    // The pattern is copied, as it is used by every update.
+    explicit GCIncrementalQuery(std::string_view p);
+
+    // Calculates the kernels of the rules added to t since the last update and returns the lcs of p and the text.
+    // Rules from earlier updates are not visited again, so an update takes time for the added rules only.
+    // The lcs with an empty grammar is 0. For a growing LZWStream, pass the grammar that finish returns.
+    unsigned update(const GrammarCompressedStorage &t);
+    // Returns the lcs of p and the text at the last update.
+    unsigned lcs() const { return last_lcs; }
+    // Returns the number of rules with calculated kernels.
+    unsigned size() const { return projected.size(); }
+private:
+    static constexpr unsigned NO_MATCH = std::numeric_limits<unsigned>::max();
+
+    const std::string p;
+    const AlphabetSignature pattern;
+    std::vector <unsigned> projected;  // the kernel of rule i is kept in kernels[projected[i]]
+    std::vector <char> matches;  // whether rule i contains characters of p
+    std::vector <matrix::Permutation> kernels;
+    unsigned no_match;  // the first rule without characters of p, NO_MATCH until there is one
+    unsigned last_lcs;
+};
+
 // Class that calculates the LCS kernel to solve the semi-local LCS problem
 // for a plain pattern and a grammar-compressed text.
+// For many patterns against one text, use GCQueryEngine directly.
 class GCKernel {
 public:
     // Initialize the LCS kernel for pattern p and text t.
-    GCKernel(const std::string &p, const GrammarCompressedStorage &t);
+    // A single kernel is calculated for all rules with equal expansions as sharing says.
+    // The kernels are kept within memory_budget bytes if it is not 0, see GCQueryEngine::set_memory_budget.
+    GCKernel(std::string_view p, const GrammarCompressedStorage &t,
+             ExpansionSharing sharing = ExpansionSharing::VERIFIED,
+             std::size_t memory_budget = 0);
+    // Initialize the LCS kernel for pattern p and text t, where characters match if they are in the same class.
+    GCKernel(std::string_view p, const GrammarCompressedStorage &t, const kernel::CharClasses &classes,
+             ExpansionSharing sharing = ExpansionSharing::VERIFIED);
+    // Initialize the LCS kernel for grammar-compressed pattern p and text t, decompressing neither.
+    GCKernel(const GrammarCompressedStorage &p, const GrammarCompressedStorage &t,
+             ExpansionSharing sharing = ExpansionSharing::VERIFIED);
     const unsigned lcs;
-private:
-	// Returns the lcs for pattern p and text t.
-    unsigned calculate_lcs(const std::string &p,  const GrammarCompressedStorage &t);
-    // Returns the compressed kernel for pattern p and character c.
-    matrix::Permutation calculate_char_kernel(const std::string &p, char c);
-	// Recursively calculates the compressed kernel for pattern p and text t.
-    void calculate_gc_kernel(std::vector<matrix::Permutation> &calculated,
-    						 				const std::string &p, const GrammarCompressedStorage &t, unsigned int index);
 };
 
 
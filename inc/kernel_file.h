@@ -0,0 +1,81 @@
+#ifndef INC_KERNEL_FILE_H_
+#define INC_KERNEL_FILE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "lcs_kernel.h"
+#include "monge_matrix.h"
+
+namespace LCS {
+namespace io {
+
+// Binary files for kernels. Every file starts with a header: the magic "LCSK", the format version,
+// the kind of its contents, the size of the payload and its FNV-1a checksum. The payload follows
+// in native byte order. Permutations keep their rows and cols as they are laid out in memory,
+// so they are copied out of a memory-mapped file without parsing.
+const std::uint32_t FORMAT_VERSION = 2;
+
+// Thrown when a kernel file can not be read or written, or is damaged.
+class KernelFileError: public std::runtime_error {
+public:
+    KernelFileError(const std::string &file, const std::string &what):
+        std::runtime_error(file + ": " + what) {}
+};
+
+// A file mapped into memory for reading.
+class MappedFile {
+public:
+    // Throws KernelFileError if the file can not be opened or mapped.
+    explicit MappedFile(const std::string &file);
+    ~MappedFile();
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    const char *data() const { return mapping; }
+    std::size_t size() const { return length; }
+private:
+    char *mapping = nullptr;
+    std::size_t length = 0;
+};
+
+// Returns the 64-bit FNV-1a hash of size bytes at data, continuing from hash.
+std::uint64_t content_hash(const void *data, std::size_t size, std::uint64_t hash = 14695981039346656037ull);
+
+// Saves and loads a permutation with the given index type.
+// The index type of a loaded permutation must be the one it was saved with.
+template <typename Index>
+void save_permutation(const std::string &file, const matrix::BasicPermutation<Index> &permutation);
+template <typename Index>
+matrix::BasicPermutation<Index> load_permutation(const std::string &file);
+
+// Saves and loads the strings and the kernel of an LCS kernel.
+// Loading rebuilds the kernel sums in O((|a| + |b|)^2) time instead of recalculating the kernel.
+void save_kernel(const std::string &file, const kernel::LCSKernel &kernel);
+kernel::LCSKernel load_kernel(const std::string &file);
+
+// The kernels of some of the rules of a grammar-compressed calculation, identified by a key and the pattern.
+// The kernels are kept as the records of gc::PackedKernel, so they are saved as they are stored.
+template <typename Index>
+struct KernelArchive {
+    std::uint64_t key = 0;  // a hash of the inputs of the calculation
+    std::string pattern;  // the pattern of the calculation, which tells apart patterns with the same key
+    std::uint64_t next = 0;  // the first rule whose kernel has not been calculated yet
+    std::vector <std::pair <unsigned, std::vector <char> > > kernels;  // rules and their packed kernels
+};
+
+// Saves the archive, so that the file is replaced at once: an interrupted save leaves the previous file.
+template <typename Index>
+void save_archive(const std::string &file, const KernelArchive<Index> &archive);
+// Loads the archive from the file. Returns false if the file does not exist.
+template <typename Index>
+bool load_archive(const std::string &file, KernelArchive<Index> &archive);
+
+}  // namespace io
+}  // namespace LCS
+
+#endif  // INC_KERNEL_FILE_H_
@@ -0,0 +1,173 @@
+#ifndef INC_KERNEL_STORE_H_
+#define INC_KERNEL_STORE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <set>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "monge_matrix.h"
+
+namespace LCS {
+namespace gc {
+
+// A file that is grown on demand and mapped into memory, holding kernels that were moved out of memory.
+// The file is removed as soon as it is created, so it disappears with the process.
+class SpillFile {
+public:
+    // The file is created in directory, or in $TMPDIR or /tmp if it is empty, when it is first written to.
+    explicit SpillFile(const std::string &directory = "");
+    ~SpillFile();
+    SpillFile(const SpillFile &) = delete;
+    SpillFile &operator=(const SpillFile &) = delete;
+
+    // Appends size bytes from data to the file and returns their offset in it.
+    // Throws std::runtime_error if the file can not be created or grown.
+    std::size_t write(const void *data, std::size_t size);
+    // Returns the bytes at the given offset of the file.
+    const char *read(std::size_t offset) const { return mapping + offset; }
+    // Discards the contents of the file, keeping it for later writes.
+    void clear() { used = 0; }
+    // Returns the number of bytes written since the last clear.
+    std::size_t size() const { return used; }
+private:
+    std::string directory;
+    int descriptor = -1;
+    char *mapping = nullptr;
+    std::size_t capacity = 0;  // the length of the file and the mapping
+    std::size_t used = 0;
+};
+
+// A kernel packed for storage. Compressed kernels have rows k..1 in row order and columns 1..k, so only
+// the differences between the column and the row of every element are kept, bit-packed with the width
+// of the largest one: kernels close to the identity take a few bits per element. Other kernels keep
+// both coordinates of their elements, bit-packed with the width of the largest one.
+// Instantiated for std::uint16_t, std::uint32_t and std::uint64_t.
+template <typename Index>
+class PackedKernel {
+public:
+    PackedKernel() {}
+    explicit PackedKernel(const matrix::BasicPermutation<Index> &kernel);
+
+    // Returns the unpacked kernel.
+    matrix::BasicPermutation<Index> unpack() const;
+    // Returns the number of bytes taken by the packed elements.
+    std::size_t bytes() const { return words.capacity() * sizeof(std::uint64_t); }
+
+    // Appends the packed kernel to out, in the layout read by read.
+    void write(std::vector <char> &out) const;
+    // Returns the packed kernel written at record.
+    static PackedKernel read(const char *record);
+    // Returns the packed kernel written at record, which holds size bytes, such as a record loaded from a file.
+    // Throws std::runtime_error if the record is not a packed kernel of size bytes.
+    static PackedKernel read(const char *record, std::size_t size);
+private:
+    std::uint64_t size = 0;  // the number of elements
+    bool dense = true;  // whether only the differences are kept
+    unsigned width = 0;  // the number of bits per value
+    std::vector <std::uint64_t> words;
+};
+
+// Memory use of the kernels of a calculation.
+struct KernelStats {
+    std::size_t peak_bytes = 0;  // the largest number of bytes taken by kernels in memory at once
+    std::size_t spilled = 0;  // the number of kernels written to the spill file
+};
+
+// Keeps the kernels of the rules of a grammar while they are still needed by the rules that use them.
+// Kernels are kept in memory within a memory budget. When it is exceeded, the kernels with the fewest
+// remaining uses, and among them the least recently used ones, are spilled to a memory-mapped file
+// and read back when they are needed again. Kernels never change once stored, so every kernel
+// is written to the file at most once. A budget of 0 keeps all kernels in memory.
+// Kernels are written to the file as PackedKernel. If packing is set, the kernels in memory are kept packed
+// as well, and only unpacked when they are read with get. The unpacked copies count towards the budget.
+// Instantiated for std::uint16_t, std::uint32_t and std::uint64_t.
+template <typename Index>
+class KernelStore {
+public:
+    // The number of kernels returned by get that stay usable at once, as for the two halves of a rule.
+    static constexpr unsigned PINNED = 2;
+
+    explicit KernelStore(std::size_t memory_budget = 0, const std::string &spill_directory = "",
+                         bool packing = false);
+
+    // Drops all kernels and prepares the store for n rules.
+    void reset(unsigned n);
+    // Sets the memory budget in bytes, the directory of the spill file and packing. Must be followed by reset.
+    void configure(std::size_t memory_budget, const std::string &spill_directory, bool packing = false);
+    // Stores the kernel of rule i, which will be released uses times before it is dropped.
+    void put(unsigned i, matrix::BasicPermutation<Index> &&kernel, unsigned uses);
+    // Returns the kernel of rule i, reading it back if it was spilled.
+    // The kernels of the last PINNED rules passed to get are not spilled, and their references stay valid
+    // until the next call of put or take, or until they are released for the last time.
+    const matrix::BasicPermutation<Index> &get(unsigned i);
+    // Consumes a use of the kernel of rule i. Returns true if it was the last one and the kernel is dropped.
+    bool release(unsigned i);
+    // Returns the number of uses left for the kernel of rule i, 0 if it is not stored.
+    unsigned uses_left(unsigned i) const { return uses[i]; }
+    // Returns the rules whose kernels are stored, in increasing order.
+    const std::set <unsigned> &live() const { return stored; }
+    // Appends the kernel of rule i to out in the layout of PackedKernel::write. Spilled and packed kernels
+    // are copied as they are stored, without reading them back into memory or unpacking them.
+    void write(unsigned i, std::vector <char> &out) const;
+    // Moves the kernel of rule i out of the store.
+    matrix::BasicPermutation<Index> take(unsigned i);
+
+    // Returns the number of bytes taken by the kernels in memory.
+    std::size_t resident_bytes() const { return resident; }
+    // Returns the number of kernels written to the spill file since the last reset.
+    std::size_t spilled() const { return stats.spilled; }
+    // Returns the peak memory use and the number of spilled kernels since the last reset.
+    const KernelStats &statistics() const { return stats; }
+private:
+    // The key that orders the kernels in memory for eviction.
+    typedef std::tuple <unsigned, unsigned long long, unsigned> Key;
+
+    static std::size_t bytes(const matrix::BasicPermutation<Index> &kernel);
+    // Returns the number of bytes taken by the kernel of rule i in memory.
+    std::size_t kernel_bytes(unsigned i) const { return packing ? packed[i].bytes() : bytes(kernels[i]); }
+    // Adds the kernel of rule i to the kernels in memory.
+    void add_resident(unsigned i);
+    // Drops the kernel of rule i from memory.
+    void drop(unsigned i);
+    Key key(unsigned i) const { return Key(uses[i], last_used[i], i); }
+    // Marks the kernel of rule i as just used.
+    void touch(unsigned i);
+    // Spills kernels until the memory budget is met.
+    void trim();
+    // Keeps the kernel of rule i in memory, unpinning the least recently pinned kernel if there are too many.
+    void pin(unsigned i);
+    // Returns the pinned kernels to eviction and drops their unpacked copies.
+    void unpin();
+
+    std::size_t memory_budget;
+    std::string spill_directory;
+    bool packing;
+    std::unique_ptr <SpillFile> file;  // created when the first kernel is spilled
+    std::vector <matrix::BasicPermutation<Index> > kernels;  // the kernels in memory if they are not packed
+    std::vector <PackedKernel<Index> > packed;  // the kernels in memory if they are packed
+    // The last PINNED rules passed to get since the last put or take, least recent first, whose kernels
+    // are not evicted, and the unpacked copies of their kernels if kernels are packed.
+    std::deque <unsigned> pinned;
+    std::deque <std::pair <unsigned, matrix::BasicPermutation<Index> > > unpacked;
+    std::vector <unsigned> uses;
+    std::set <unsigned> stored;  // the rules with uses left
+    std::vector <unsigned long long> last_used;
+    std::vector <std::size_t> offsets;  // the offset of a kernel in the file, or NOT_SPILLED
+    std::vector <char> in_memory;
+    std::set <Key> eviction;  // the kernels in memory, in eviction order
+    unsigned long long clock = 0;
+    std::size_t resident = 0;
+    KernelStats stats;
+
+    static constexpr std::size_t NOT_SPILLED = (std::size_t)-1;
+};
+
+}  // namespace gc
+}  // namespace LCS
+
+#endif  // INC_KERNEL_STORE_H_
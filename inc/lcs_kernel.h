@@ -1,19 +1,127 @@
 #ifndef INC_LCS_KERNEL_H_
 #define INC_LCS_KERNEL_H_
 
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
 #include "monge_matrix.h"
 
 namespace LCS {
 namespace kernel {
 
+// A read-only view of a sequence of symbols: characters, or the integer tokens of a tokenized text.
+// Like std::string_view, it does not own the symbols, which must outlive it.
+// The functions templated on Symbol are instantiated for char, std::uint8_t, std::uint16_t and std::uint32_t.
+template <typename Symbol>
+class SymbolSpan {
+public:
+    SymbolSpan(): first(nullptr), length(0) {}
+    SymbolSpan(const Symbol *data, std::size_t size): first(data), length(size) {}
+    // A view of a contiguous container of symbols, such as std::vector or std::basic_string.
+    template <typename Container, typename = decltype(std::declval<const Container &>().data())>
+    SymbolSpan(const Container &symbols): first(symbols.data()), length(symbols.size()) {}
+
+    const Symbol &operator[](std::size_t i) const { return first[i]; }
+    const Symbol *data() const { return first; }
+    std::size_t size() const { return length; }
+    bool empty() const { return length == 0; }
+    // Returns the view of count symbols from position, or of fewer if the sequence ends before.
+    SymbolSpan substr(std::size_t position, std::size_t count) const {
+        return SymbolSpan(first + position, std::min(count, length - position));
+    }
+private:
+    const Symbol *first;
+    std::size_t length;
+};
+
+// An equivalence of characters for matching: two characters match if they are in the same class.
+// Every character is in its own class by default. Kernels apply the classes where they compare characters,
+// so neither string has to be normalized, and the grammar-compressed kernels apply them to terminal rules only.
+class CharClasses {
+public:
+    CharClasses();
+    // Returns the classes where every ASCII letter matches its other case.
+    static CharClasses case_insensitive();
+    // Merges the classes of all the given characters into one, for example join("0123456789") for digits.
+    CharClasses &join(std::string_view characters);
+    // Returns the representative of the class of c.
+    unsigned char class_of(char c) const { return representative[(unsigned char)c]; }
+    // Returns whether x and y match.
+    bool operator()(char x, char y) const { return class_of(x) == class_of(y); }
+private:
+    std::array <unsigned char, 256> representative;
+};
+
 // Counts the lcs of two strings using the O(|a||b|) dynamic programming algorithm.
-unsigned dp_lcs(const std::string &a, const std::string &b);
+// Symbols match if match says so, which is an equivalence such as CharClasses.
+template <typename Symbol, typename Match = std::equal_to<Symbol> >
+unsigned dp_lcs(SymbolSpan<Symbol> a, SymbolSpan<Symbol> b, const Match &match = Match());
+inline unsigned dp_lcs(std::string_view a, std::string_view b) { return dp_lcs<char>(a, b); }
+inline unsigned dp_lcs(std::string_view a, std::string_view b, const CharClasses &classes) {
+    return dp_lcs<char>(a, b, classes);
+}
+
+// Returns one longest common subsequence of a and b as the pairs of matched positions in a and b, in increasing order.
+// Divide and conquer in the spirit of Hirschberg: the prefix of b matched to the first half of a is found by combing
+// the braids of both halves of a with b, so O(|a||b|) time and O(|a| + |b|) memory are used.
+// Independent subproblems are solved by up to threads threads.
+template <typename Symbol, typename Match = std::equal_to<Symbol> >
+std::vector <std::pair <unsigned, unsigned> > lcs_alignment(SymbolSpan<Symbol> a, SymbolSpan<Symbol> b,
+                                                            unsigned threads = 1, const Match &match = Match());
+inline std::vector <std::pair <unsigned, unsigned> > lcs_alignment(std::string_view a, std::string_view b,
+                                                                   unsigned threads = 1) {
+    return lcs_alignment<char>(a, b, threads);
+}
+inline std::vector <std::pair <unsigned, unsigned> > lcs_alignment(std::string_view a, std::string_view b,
+                                                                   const CharClasses &classes, unsigned threads = 1) {
+    return lcs_alignment<char>(a, b, threads, classes);
+}
+
+// Returns the LCS kernel of a and the concatenation b1 b2 from the kernels of a and b1 and of a and b2,
+// permutations of sizes |a| + |b1| and |a| + |b2|, where size is |a| + |b1| + |b2|.
+// As for a column split in RecursiveLCS, it is the sticky product of the first kernel
+// followed by an identity and the second kernel preceded by an identity.
+matrix::Permutation concat_kernels(const matrix::Permutation &first, const matrix::Permutation &second, unsigned size);
+
+class LCSKernel;
+
+// Whether an LCS kernel keeps its own copies of its strings or only views of them.
+// Kernels copy their strings by default, so that temporaries can be passed. A borrowed string
+// must outlive the kernel and stay unchanged, so only pass BORROW for buffers that do.
+enum class Ownership {
+    BORROW,
+    COPY,
+};
+
+// Returns the LCS kernel of a and the concatenation b1 b2 from the LCS kernels of a and b1 and of a and b2.
+// The result owns copies of a and b1 b2. Throws std::invalid_argument if the kernels are for different strings a.
+LCSKernel concat(const LCSKernel &first, const LCSKernel &second);
 
 // Class that calculates the LCS kernel to solve the semi-local LCS problem.
+// It holds char strings only. Kernels of token sequences are calculated as permutations by RecursiveLCS::kernel
+// and IterativeLCS::kernel on SymbolSpan, which the grammar-compressed code does not take either.
 class LCSKernel {
 public:
     // Initialize the LCS kernel for strings a and b.
-    LCSKernel(const std::string &a, const std::string &b, const matrix::MongeMatrix &kernel_sum);
+    LCSKernel(std::string_view a, std::string_view b, const matrix::MongeMatrix &kernel_sum,
+              Ownership ownership = Ownership::COPY);
+    // Initialize the LCS kernel for strings a and b from their kernel, a permutation of size |a| + |b|.
+    LCSKernel(std::string_view a, std::string_view b, const matrix::Permutation &kernel,
+              Ownership ownership = Ownership::COPY);
+    // A copy owns its strings if the original does, and borrows the same strings otherwise.
+    LCSKernel(const LCSKernel &other);
+    LCSKernel &operator=(const LCSKernel &) = delete;
+    std::string_view get_a() const { return a; }
+    std::string_view get_b() const { return b; }
+    // Returns the kernel as a permutation, recovered from the kernel sums in O((|a| + |b|)^2) time.
+    matrix::Permutation get_kernel() const;
     // Count the lcs of the whole string a and the substring of b from b_l to b_r.
     unsigned lcs_whole_a(unsigned b_l, unsigned b_r) const;
     // Count the lcs of the substring of a from a_l to a_r and the whole string b.
@@ -23,11 +131,20 @@ public:
     // Count the lcs for the prefix of a until a_r and the suffix of b from b_l.
     unsigned lcs_prefix_a_suffix_b(unsigned a_r, unsigned b_l) const;
 protected:
-    const std::string a;
-    const std::string b;
+    const Ownership ownership;
+    const std::string owned_a;  // the copies of a and b if the kernel owns them
+    const std::string owned_b;
+    const std::string_view a;
+    const std::string_view b;
     const matrix::MongeMatrix kernel_sum;
 };
 
+// How RecursiveLCS combs the braids of its smallest subproblems.
+enum class BaseCase {
+    COMBING,  // cell by cell
+    TABLES,   // in blocks looked up in CombingTables, for strings over at most 4 distinct characters
+};
+
 // Class that calculates the LCS kernel for two strings using the basic recursive algorithm.
 // This allows it to solve the semi-local LCS problem for two strings a and b in O(|a||b|) time.
 class RecursiveLCS: public LCSKernel {
@@ -35,31 +152,76 @@ public:
     // Initialize the LCS kernel for strings a and b.
     // Use the recursive algorithm.
     // If athe strings' summary length is less than recusion_base, use iterative combing.
-    RecursiveLCS(const std::string &a, const std::string &b, unsigned recursion_base = 5);
+    RecursiveLCS(std::string_view a, std::string_view b, unsigned recursion_base = 5,
+                 Ownership ownership = Ownership::COPY);
+    // Initialize the LCS kernel for strings a and b, where characters match if they are in the same class.
+    RecursiveLCS(std::string_view a, std::string_view b, const CharClasses &classes, unsigned recursion_base = 5,
+                 Ownership ownership = Ownership::COPY);
+    // Initialize the LCS kernel for strings a and b, combing the subproblems of summary length up to
+    // recursion_base as base_case says. With BaseCase::TABLES a large recursion_base such as 4096 pays off,
+    // and std::invalid_argument is thrown if more than 4 distinct characters occur in a and b.
+    RecursiveLCS(std::string_view a, std::string_view b, unsigned recursion_base, BaseCase base_case,
+                 Ownership ownership = Ownership::COPY);
+    // Count the LCS kernel for strings a and b as a permutation of size |a| + |b|, without its kernel sums.
+    // Symbols of any of the instantiated types are compared as integers, so token sequences need no encoding.
+    template <typename Symbol, typename Match = std::equal_to<Symbol> >
+    static matrix::Permutation kernel(SymbolSpan<Symbol> a, SymbolSpan<Symbol> b, unsigned recursion_base = 5,
+                                      const Match &match = Match());
+    static matrix::Permutation kernel(std::string_view a, std::string_view b, unsigned recursion_base = 5) {
+        return kernel<char>(a, b, recursion_base);
+    }
+    static matrix::Permutation kernel(std::string_view a, std::string_view b, const CharClasses &classes,
+                                      unsigned recursion_base = 5) {
+        return kernel<char>(a, b, recursion_base, classes);
+    }
+    static matrix::Permutation kernel(std::string_view a, std::string_view b, unsigned recursion_base,
+                                      BaseCase base_case);
 private:
     // Count the LCS kernel for two substrings of a and b recursively.
-    matrix::Permutation calculate_kernel(unsigned recursion_base,
-                                         const std::string &a, const std::string &b, 
-                                         unsigned a_l, unsigned a_r,
-                                         unsigned b_l, unsigned b_r);
+    // base_case(a_l, a_r, b_l, b_r) returns the kernel of the substrings if their summary length is small enough.
+    template <typename Base>
+    static matrix::Permutation calculate_kernel(unsigned recursion_base, const Base &base_case,
+                                                unsigned a_l, unsigned a_r,
+                                                unsigned b_l, unsigned b_r);
     // Count the LCS kernel for two substrings of a and b recursively using iterative combing.
-    matrix::Permutation calculate_recursion_base(const std::string &a, const std::string &b, 
-                                         unsigned a_l, unsigned a_r,
-                                         unsigned b_l, unsigned b_r);
+    template <typename Symbol, typename Match>
+    static matrix::Permutation calculate_recursion_base(SymbolSpan<Symbol> a, SymbolSpan<Symbol> b, const Match &match,
+                                                        unsigned a_l, unsigned a_r,
+                                                        unsigned b_l, unsigned b_r);
 };
 
 // Class that calculates the LCS kernel for two strings using iterative combing.
 // This allows it to solve the semi-local LCS problem for two strings a and b in O(|a||b|) time.
+// The braid is combed in square tiles of TILE x TILE cells, whose strands and characters fit in the L1 cache,
+// so the strands at the ends of the rows are passed through the cache once per row of tiles, not once per row.
 class IterativeLCS: public LCSKernel {
 public:
+    static const unsigned TILE = 1024;
+
     // Initialize the LCS kernel for strings a and b.
-    IterativeLCS(const std::string &a, const std::string &b);
+    IterativeLCS(std::string_view a, std::string_view b, Ownership ownership = Ownership::COPY);
+    // Initialize the LCS kernel for strings a and b, combing the tiles on up to threads threads.
+    IterativeLCS(std::string_view a, std::string_view b, unsigned threads, Ownership ownership = Ownership::COPY);
+    // Initialize the LCS kernel for strings a and b, where characters match if they are in the same class.
+    IterativeLCS(std::string_view a, std::string_view b, const CharClasses &classes,
+                 Ownership ownership = Ownership::COPY);
+    // Count the LCS kernel for strings a and b as a permutation of size |a| + |b|, without its kernel sums,
+    // combing the tiles on up to threads threads. The kernel does not depend on threads.
+    // Symbols of any of the instantiated types are compared as integers, as in RecursiveLCS::kernel.
+    template <typename Symbol>
+    static matrix::Permutation kernel(SymbolSpan<Symbol> a, SymbolSpan<Symbol> b, unsigned threads = 1);
+    static matrix::Permutation kernel(std::string_view a, std::string_view b, unsigned threads = 1) {
+        return kernel<char>(a, b, threads);
+    }
 private:
-    // Count the LCS kernel for two substrings of a and b using iterative combing.
-    matrix::MongeMatrix calculate_iterative_kernel(const std::string &a, const std::string &b);
+    // Count the LCS kernel for two strings using iterative combing.
+    // A tile needs the tiles to its left and above, so rows of tiles are combed by the threads in a wavefront.
+    // If a has fewer than threads rows of tiles, the tiles are made shorter so that every thread has a row.
+    template <typename Symbol, typename Match>
+    static matrix::Permutation calculate_iterative_kernel(SymbolSpan<Symbol> a, SymbolSpan<Symbol> b,
+                                                          const Match &match, unsigned threads);
 };
 
-
 }  // namespace kernel
 }  // namespace LCS
 
@@ -4,6 +4,7 @@
 #include <vector>
 #include <exception>
 #include <string>
+#include <cstdint>
 
 namespace LCS {
 namespace matrix {
@@ -52,7 +53,7 @@ private:
     // Stores a single element for each row: the corresponding non-zero column.
     std::vector <unsigned> matrix;
 
-    friend class Permutation;
+    template <typename Index> friend class BasicPermutation;
 
 public:
     // Basic subpermutation matrix constructor.
@@ -95,55 +96,82 @@ public:
 };
 
 // Utility class for storing a permutation as a list of pairs. 
-class Permutation {
+// The element indexes are stored as Index, so that short kernels take less memory.
+// Instantiated for std::uint16_t, std::uint32_t and std::uint64_t.
+template <typename Index>
+class BasicPermutation {
 public:
-    explicit Permutation(const std::vector <std::pair <unsigned, unsigned> > &permutation_vector,
-                         const std::vector <std::pair <unsigned, unsigned> > &rev_permutation_vector):
+    typedef std::pair <Index, Index> Element;
+
+    explicit BasicPermutation(const std::vector <Element> &permutation_vector,
+                              const std::vector <Element> &rev_permutation_vector):
                         rows(permutation_vector),
                         cols(rev_permutation_vector) {}
-    explicit Permutation(const std::vector<unsigned> &permutation);
-    explicit Permutation(const PermutationMatrix &m);
-    explicit Permutation() {}
+    explicit BasicPermutation(const std::vector<Index> &permutation);
+    explicit BasicPermutation(const PermutationMatrix &m);
+    explicit BasicPermutation() {}
 
     // Returns the amount of non-zero elements in the permutation.
-    unsigned get_nonzero_amount() const {return rows.size(); }
+    Index get_nonzero_amount() const {return rows.size(); }
     // Splits the permutation into two halves by their column values.
-    std::pair<Permutation, Permutation> split_col(unsigned split_value) const;
+    std::pair<BasicPermutation, BasicPermutation> split_col(Index split_value) const;
     // Splits the permutation into two halves by their row values.
-    std::pair<Permutation, Permutation> split_row(unsigned split_value) const;
+    std::pair<BasicPermutation, BasicPermutation> split_row(Index split_value) const;
     // Expands the permutation into a PermutationMatrix
     // with the necessary amount of rows and columns.
     PermutationMatrix expand(unsigned row_amount, unsigned col_amount) const;
 
     // The list of permutation pairs, sorted by row index in descending order.
-    std::vector <std::pair <unsigned, unsigned>> rows;
+    std::vector <Element> rows;
     // The list of permutation pairs, sorted by col index in ascending order.
-    std::vector <std::pair <unsigned, unsigned>> cols;
+    std::vector <Element> cols;
 
     // Sticky multiplication of two permutation.
     // O(n log n) using the Steady Ant algorithm, where n is the
     // amount of elements in the permutation vectors.
-    Permutation operator*(const Permutation &p) const;
+    BasicPermutation operator*(const BasicPermutation &p) const;
 
     // Adds an Id matrix to the beginning of the permutation
     // so the new amount of rows in it is new_rows.
     // All existing elements' indexes are incremented.
-    void grow_front(unsigned new_rows);
+    void grow_front(Index new_rows);
 
     // Adds an Id matrix to the beginning of the permutation
     // so the new amount of cols in it is new_cols.
     // All existing elements' indexes are left unchanged.
-    void grow_back(unsigned new_cols);
+    void grow_back(Index new_cols);
+};
+
+typedef BasicPermutation<unsigned> Permutation;
+
+// Answers dominance counting queries for the elements of a permutation.
+// Uses a merge sort tree: O(n log n) memory and preprocessing time,
+// O(log^2 n) time per query, where n is the amount of elements in the permutation.
+class DominanceCounter {
+public:
+    explicit DominanceCounter(const Permutation &p);
+
+    // Returns the amount of permutation elements (row, col) with row > x and col > y.
+    unsigned count(unsigned x, unsigned y) const;
+private:
+    // The element rows in ascending order.
+    std::vector <unsigned> sorted_rows;
+    // The merge sort tree over the element cols in the order of sorted_rows.
+    // Node v covers a segment of the elements and stores their cols in ascending order.
+    std::vector <std::vector <unsigned> > tree;
 };
 
 // Utility class for iterating over permutations in the Steady Ant algorithm.
+template <typename Index>
 class PermutationIterator {
 private:
-    const Permutation &permutation;
+    typedef typename BasicPermutation<Index>::Element Element;
+
+    const BasicPermutation<Index> &permutation;
     unsigned row_it;
     unsigned col_it;
 public:
-    explicit PermutationIterator(const Permutation &permutation): permutation(permutation),
+    explicit PermutationIterator(const BasicPermutation<Index> &permutation): permutation(permutation),
                                                                   row_it(0),
                                                                   col_it(0) {}
 
@@ -167,44 +195,45 @@ public:
     }
 
     // Returns the element the row iterator is pointing to.
-    std::pair <unsigned, unsigned> row_pair() const {
+    Element row_pair() const {
         return permutation.rows[row_it];
     }
     // Returns the element the col iterator is pointing to.
-    std::pair <unsigned, unsigned> col_pair() const {
+    Element col_pair() const {
         return permutation.cols[col_it];
     }
 
     // Returns the row of the element the row iterator is pointing to.
-    unsigned row() const {
+    Index row() const {
         return row_pair().first;
     }
     // Returns the col of the element the col iterator is pointing to.
-    unsigned col() const {
+    Index col() const {
         return col_pair().first;
     }
 
     // Returns the matching row of the element the col iterator is pointing to.
-    unsigned matching_row() const {
+    Index matching_row() const {
         return col_pair().second;
     }
     // Returns the matching col of the element the row iterator is pointing to.
-    unsigned matching_col() const {
+    Index matching_col() const {
         return row_pair().second;
     }
 };
 
 // Utility class encapsulating the main logic of the ant traversal for two permutations.
+template <typename Index>
 class SteadyAnt {
 private:
-    std::vector <std::pair <unsigned, unsigned>> good_elements_row;
-    std::vector <std::pair <unsigned, unsigned>> good_elements_col;
+    std::vector <typename BasicPermutation<Index>::Element> good_elements_row;
+    std::vector <typename BasicPermutation<Index>::Element> good_elements_col;
 
-    PermutationIterator low_it;  // ant-visible elements are lower-right
-    PermutationIterator high_it;  // ant-visible elements are upper-left
+    PermutationIterator<Index> low_it;  // ant-visible elements are lower-right
+    PermutationIterator<Index> high_it;  // ant-visible elements are upper-left
 
-    unsigned ant_row, ant_col;
-    unsigned min_row, max_col;
+    Index ant_row, ant_col;
+    Index min_row, max_col;
 
     // Returns true if the ant can be moved up to the next row with permutation elements.
     bool can_move_up() const;
@@ -218,16 +247,16 @@ private:
 
     // Returns the next interesting row (with permutation elements) for the ant,
     // or a fixed row smaller than all existing ones if all such rows have been visited.
-    unsigned get_next_row() const;
+    Index get_next_row() const;
     // Returns the next interesting column (with permutation elements) for the ant,
     // or a fixed col smaller than all existing ones if all such cols have been visited.
-    unsigned get_next_col() const;
+    Index get_next_col() const;
 public:
     // Initializes the steady ant traversal for a pair of r_low, r_high permutation matrices.
-    SteadyAnt(const Permutation &r_low, const Permutation &r_high);
+    SteadyAnt(const BasicPermutation<Index> &r_low, const BasicPermutation<Index> &r_high);
 
     // Does the main ant traversal and returns the fixed permutation product.
-    Permutation restore_correct_product();
+    BasicPermutation<Index> restore_correct_product();
 };
 
 // Explicitly stores a simple subunit-Monge matrix.
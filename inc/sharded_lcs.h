@@ -0,0 +1,27 @@
+#ifndef INC_SHARDED_LCS_H_
+#define INC_SHARDED_LCS_H_
+
+#include <string>
+#include <string_view>
+
+#include "lcs_kernel.h"
+#include "monge_matrix.h"
+
+namespace LCS {
+namespace kernel {
+
+// Calculates the LCS kernel of a and b, a permutation of size |a| + |b|, in separate worker processes,
+// so that no process needs the memory of the whole calculation. b is split into the given number of shards,
+// the kernel of a and every shard is calculated by RecursiveLCS::kernel in a worker, and neighbouring kernels
+// are merged by concat_kernels in a reduction tree, also in workers. At most workers processes run at once.
+// Kernels are passed between processes as kernel files in directory, or in a fresh directory under $TMPDIR
+// or /tmp if it is empty; they are removed afterwards. Workers are forked, so the calling process
+// should not have other threads running at the time.
+// Throws std::runtime_error if a worker can not be started or fails.
+matrix::Permutation sharded_kernel(std::string_view a, std::string_view b, unsigned shards,
+                                   unsigned workers = 1, const std::string &directory = "");
+
+}  // namespace kernel
+}  // namespace LCS
+
+#endif  // INC_SHARDED_LCS_H_
@@ -0,0 +1,39 @@
+#ifndef INC_SPARSE_LCS_H_
+#define INC_SPARSE_LCS_H_
+
+#include <string_view>
+
+#include "lcs_kernel.h"
+#include "monge_matrix.h"
+
+namespace LCS {
+namespace kernel {
+
+// Counts the lcs of a and b with the Hunt-Szymanski algorithm: the positions of every symbol in b are listed,
+// and only the r matching pairs are processed, each by a binary search, in O((r + |a| + |b|) log |b|) time.
+// Pays off when matches are rare, as for token alphabets or high-entropy data.
+template <typename Symbol>
+unsigned sparse_lcs(SymbolSpan<Symbol> a, SymbolSpan<Symbol> b);
+inline unsigned sparse_lcs(std::string_view a, std::string_view b) { return sparse_lcs<char>(a, b); }
+
+// Class that calculates the LCS kernel for two strings by the recursion of RecursiveLCS,
+// where blocks of a and b without matching pairs are not divided further: all their strands cross,
+// so their kernel is a cyclic shift. Matches are found in the occurrence lists of sparse_lcs.
+// The work is proportional to the blocks that contain matches, so sparse matches make it fast.
+class SparseLCS: public LCSKernel {
+public:
+    // Initialize the LCS kernel for strings a and b.
+    SparseLCS(std::string_view a, std::string_view b, unsigned recursion_base = 5,
+              Ownership ownership = Ownership::COPY);
+    // Count the LCS kernel for strings a and b as a permutation of size |a| + |b|, as RecursiveLCS::kernel.
+    template <typename Symbol>
+    static matrix::Permutation kernel(SymbolSpan<Symbol> a, SymbolSpan<Symbol> b, unsigned recursion_base = 5);
+    static matrix::Permutation kernel(std::string_view a, std::string_view b, unsigned recursion_base = 5) {
+        return kernel<char>(a, b, recursion_base);
+    }
+};
+
+}  // namespace kernel
+}  // namespace LCS
+
+#endif  // INC_SPARSE_LCS_H_
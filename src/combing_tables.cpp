@@ -0,0 +1,198 @@
+#include "combing_tables.h"
+
+#include <algorithm>
+#include <array>
+#include <numeric>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+namespace LCS {
+namespace kernel {
+
+namespace {
+
+const unsigned STRANDS = 2 * CombingTables::BLOCK;  // the strands entering and leaving a block
+const unsigned PAIRS = STRANDS * (STRANDS - 1) / 2;  // the pairs of strands entering a block
+const unsigned ROW_SYMBOLS = 1u << (2 * CombingTables::BLOCK);  // the characters of a block row or column, 2 bits each
+
+// Returns the order of the strands entering a block as one bit for every pair: whether the first strand is greater.
+unsigned order_of(const unsigned *strands) {
+    unsigned order = 0, bit = 0;
+    for (unsigned k = 0; k < STRANDS; ++k) {
+        for (unsigned l = k + 1; l < STRANDS; ++l) {
+            order |= unsigned(strands[k] > strands[l]) << bit++;
+        }
+    }
+    return order;
+}
+
+// Returns the codes 0..3 of the characters of a and b in the order they occur, and -1 for other characters.
+// Throws std::invalid_argument if more than 4 distinct characters occur in a and b.
+std::array <int, 256> character_codes(std::string_view a, std::string_view b) {
+    std::array <int, 256> code;
+    code.fill(-1);
+    int codes = 0;
+    for (std::string_view s: {a, b}) {
+        for (char c: s) {
+            if (code[(unsigned char)c] == -1) {
+                if (codes == 4) {
+                    throw std::invalid_argument("combing tables need strings over at most 4 distinct characters");
+                }
+                code[(unsigned char)c] = codes++;
+            }
+        }
+    }
+    return code;
+}
+
+}  // namespace
+
+const CombingTables &CombingTables::get() {
+    static const CombingTables tables;
+    return tables;
+}
+
+CombingTables::CombingTables(): table(ROW_SYMBOLS << PAIRS << (2 * BLOCK)) {
+    // The strands entering the block are numbered by their ranks: the rows first, then the columns.
+    // Orders that are not transitive do not occur, and their entries are left empty.
+    std::array <unsigned, STRANDS> ranks;
+    std::iota(ranks.begin(), ranks.end(), 0);
+    do {
+        unsigned order = order_of(ranks.data());
+        std::array <unsigned, STRANDS> entry_of;
+        for (unsigned k = 0; k < STRANDS; ++k) {
+            entry_of[ranks[k]] = k;
+        }
+        for (unsigned a_symbols = 0; a_symbols < ROW_SYMBOLS; ++a_symbols) {
+            for (unsigned b_symbols = 0; b_symbols < ROW_SYMBOLS; ++b_symbols) {
+                std::array <unsigned, STRANDS> strands = ranks;
+                for (unsigned i = 0; i < BLOCK; ++i) {
+                    for (unsigned j = 0; j < BLOCK; ++j) {
+                        bool match = ((a_symbols >> (2 * i)) & 3) == ((b_symbols >> (2 * j)) & 3);
+                        if (match || strands[i] > strands[BLOCK + j]) {
+                            std::swap(strands[i], strands[BLOCK + j]);
+                        }
+                    }
+                }
+                // The exits are the bottoms of the columns, then the right ends of the rows.
+                std::uint8_t exits = 0;
+                for (unsigned k = 0; k < BLOCK; ++k) {
+                    exits |= entry_of[strands[BLOCK + k]] << (2 * k);
+                    exits |= entry_of[strands[k]] << (2 * (BLOCK + k));
+                }
+                table[((a_symbols << PAIRS | order) << (2 * BLOCK)) | b_symbols] = exits;
+            }
+        }
+    } while (std::next_permutation(ranks.begin(), ranks.end()));
+}
+
+void CombingTables::check_alphabet(std::string_view a, std::string_view b) {
+    character_codes(a, b);
+}
+
+matrix::Permutation CombingTables::comb(std::string_view a, std::string_view b) const {
+    std::array <int, 256> code = character_codes(a, b);
+
+    unsigned m = a.size(), n = b.size(), blocks = n / BLOCK;
+    std::vector <unsigned> last_row(n); //  The index of the braid strand at the end of row i.
+    std::vector <unsigned> last_col(m); //  The index of the braid strand at the end of col i.
+    std::iota(last_row.begin(), last_row.end(), m);
+    for (unsigned i = 0; i < m; ++i) {
+        last_col[i] = m - i - 1;
+    }
+    // The characters of b in every block of columns.
+    std::vector <unsigned> b_symbols(blocks);
+    for (unsigned k = 0; k < blocks; ++k) {
+        for (unsigned j = 0; j < BLOCK; ++j) {
+            b_symbols[k] |= code[(unsigned char)b[k * BLOCK + j]] << (2 * j);
+        }
+    }
+    // Comb cell by cell where the blocks do not reach.
+    auto comb_cell = [&](unsigned i, unsigned &strand, unsigned j) {
+        if (a[i] == b[j] || strand > last_row[j]) {
+            std::swap(strand, last_row[j]);  // uncross the two strands
+        }
+    };
+
+    // The strands of the rows of a row block and its slice of the table: its blocks share the characters of a.
+    struct RowBlock {
+        const std::uint8_t *slice;
+        unsigned strands[STRANDS];
+    };
+    auto start = [&](RowBlock &row, unsigned i) {
+        unsigned a_symbols = 0;
+        for (unsigned k = 0; k < BLOCK; ++k) {
+            a_symbols |= code[(unsigned char)a[i + k]] << (2 * k);
+        }
+        row.slice = &table[a_symbols << PAIRS << (2 * BLOCK)];
+        std::copy(last_col.begin() + i, last_col.begin() + i + BLOCK, row.strands);
+    };
+    auto comb_block = [&](RowBlock &row, unsigned k) {
+        unsigned *top = &last_row[k * BLOCK];
+        std::copy(top, top + BLOCK, row.strands + BLOCK);
+        unsigned exits = row.slice[order_of(row.strands) << (2 * BLOCK) | b_symbols[k]];
+        unsigned entering[STRANDS];
+        std::copy(row.strands, row.strands + STRANDS, entering);
+        for (unsigned l = 0; l < BLOCK; ++l) {
+            top[l] = entering[(exits >> (2 * l)) & 3];
+            row.strands[l] = entering[(exits >> (2 * (BLOCK + l))) & 3];
+        }
+    };
+    auto finish = [&](RowBlock &row, unsigned i) {
+        for (unsigned k = 0; k < BLOCK; ++k) {
+            for (unsigned j = blocks * BLOCK; j < n; ++j) {
+                comb_cell(i + k, row.strands[k], j);
+            }
+            last_col[i + k] = row.strands[k];
+        }
+    };
+
+    // Every block depends on the one before it, so two row blocks are combed at once, the lower one block behind,
+    // and the lookups of one overlap those of the other.
+    unsigned i = 0;
+    for (; i + 2 * BLOCK <= m; i += 2 * BLOCK) {
+        RowBlock upper, lower;
+        start(upper, i);
+        start(lower, i + BLOCK);
+        for (unsigned k = 0; k <= blocks; ++k) {
+            if (k < blocks) {
+                comb_block(upper, k);
+            }
+            if (k > 0) {
+                comb_block(lower, k - 1);
+            }
+        }
+        finish(upper, i);
+        finish(lower, i + BLOCK);
+    }
+    for (; i + BLOCK <= m; i += BLOCK) {
+        RowBlock row;
+        start(row, i);
+        for (unsigned k = 0; k < blocks; ++k) {
+            comb_block(row, k);
+        }
+        finish(row, i);
+    }
+    for (; i < m; ++i) {
+        for (unsigned j = 0; j < n; ++j) {
+            comb_cell(i, last_col[i], j);
+        }
+    }
+
+    // Restore the kernel permutation from the braid.
+    std::vector <unsigned> result(m + n);
+    for (unsigned k = 0; k < m; ++k) {
+        result[last_col[k]] = m + n - k;
+    }
+    for (unsigned k = 0; k < n; ++k) {
+        result[last_row[k]] = k + 1;
+    }
+    return matrix::Permutation{result};
+}
+
+TableLCS::TableLCS(std::string_view a, std::string_view b, Ownership ownership):
+    LCSKernel(a, b, CombingTables::get().comb(a, b), ownership) {}
+
+}  // namespace kernel
+}  // namespace LCS
@@ -5,8 +5,16 @@
 #include <sstream>
 #include <vector>
 #include <algorithm>
+#include <thread>
+#include <deque>
 #include <unordered_map>
+#include <map>
 #include <numeric>
+#include <iterator>
+#include <limits>
+#include <random>
+#include <stdexcept>
+#include <cstdio>
 
 namespace LCS {
 namespace gc {
@@ -74,13 +82,96 @@ std::string get_lz_grammar_string(unsigned int number) {
     return result;
 }
 
+unsigned BalancedConcatenation::concatenate(unsigned first, unsigned second) {
+    unsigned index = gcs.rules.size();
+    gcs.add_rule(GrammarCompressed(gcs, index + 1, first, second));
+    return index;
+}
+
+void BalancedConcatenation::add(unsigned rule) {
+    if (!collapse_runs) {
+        add_leaf(rule);
+        return;
+    }
+    std::pair <unsigned, unsigned long long> power = power_of(rule);
+    if (run_length && power.first == run_rule) {
+        run_length += power.second;
+        ++run_phrases;
+        return;
+    }
+    flush_run();
+    run_rule = power.first;
+    run_length = power.second;
+    run_phrase = rule;
+    run_phrases = 1;
+}
+
+std::pair <unsigned, unsigned long long> BalancedConcatenation::power_of(unsigned rule) {
+    // Rules only refer to earlier rules, so the powers are found in index order.
+    while (powers.size() <= rule) {
+        unsigned index = powers.size();
+        const GrammarCompressed &current = gcs.rules[index];
+        std::pair <unsigned, unsigned long long> power = {index, 1};
+        if (current.is_base) {
+            // LZ78 adds a terminal rule per phrase, so equal terminals are identified by their first rule.
+            power.first = terminals.emplace(current.value, index).first->second;
+        } else if (current.is_run()) {
+            power = {powers[current.first_symbol].first, powers[current.first_symbol].second * current.run_length};
+        } else if (!current.is_base && powers[current.first_symbol].first == powers[current.second_symbol].first) {
+            power = {powers[current.first_symbol].first,
+                     powers[current.first_symbol].second + powers[current.second_symbol].second};
+        }
+        powers.push_back(power);
+    }
+    return powers[rule];
+}
+
+void BalancedConcatenation::flush_run() {
+    if (!run_length) {
+        return;
+    }
+    unsigned rule = run_phrase;
+    if (run_phrases > 1) {
+        rule = gcs.rules.size();
+        gcs.add_rule(GrammarCompressed::run(gcs, rule + 1, run_rule, run_length));
+    }
+    run_length = 0;
+    add_leaf(rule);
+}
+
+void BalancedConcatenation::add_leaf(unsigned rule) {
+    spine.push_back({rule, 0});
+    // Merge complete subtrees of equal height, like carrying in a binary counter.
+    while (spine.size() > 1 && spine[spine.size() - 2].second == spine.back().second) {
+        auto right = spine.back();
+        spine.pop_back();
+        spine.back() = {concatenate(spine.back().first, right.first), right.second + 1};
+    }
+}
+
+unsigned BalancedConcatenation::finish() {
+    unsigned result = fold();
+    spine.clear();
+    return result;
+}
+
+unsigned BalancedConcatenation::fold() {
+    flush_run();
+    // The spine heights are strictly decreasing, so folding it from the right keeps the depth logarithmic.
+    unsigned result = spine.back().first;
+    for (unsigned i = spine.size() - 1; i > 0; --i) {
+        result = concatenate(spine[i - 1].first, result);
+    }
+    return result;
+}
+
 // Compress the string s with alphabet characters 'A'-'Z' using LZ78 compression.
-GrammarCompressedStorage LZ78(const std::string &s) {
+GrammarCompressedStorage LZ78(std::string_view s) {
     GrammarCompressedStorage gcs = GrammarCompressedStorage();
     std::vector <unsigned int> gcs_index(1);
     int current_entry = 0;  // The entry corresponding to the current buffer.
     std::vector <std::vector <int>> next_entry(1, std::vector <int> (ALPHABET_SIZE + 1, 0));
-    int last_string_entry = 0;  // The last entry corresponding to the piece of a string.
+    BalancedConcatenation concatenation(gcs, true);  // The concatenation of all dictionary strings.
     for (unsigned int i = 0; i < s.size(); ++i) {
         // int c = s[i] - 'A';
         int c;
@@ -100,7 +191,7 @@ GrammarCompressedStorage LZ78(const std::string &s) {
             int dict_char = gcs_index.size();
             int dict_entry = dict_char;
             gcs_index.push_back(gcs.rules.size());
-            gcs.add_rule(GrammarCompressed(gcs, dict_char, s[i]));
+            gcs.add_rule(GrammarCompressed(gcs, gcs.rules.size() + 1, s[i]));
             next_entry.push_back(std::vector <int> (ALPHABET_SIZE + 1, 0));
 
             // Add the new string (current_entry + c) to the dictionary.
@@ -109,30 +200,21 @@ GrammarCompressedStorage LZ78(const std::string &s) {
             } else {  // A previous non-empty entry existed.
                 dict_entry = gcs_index.size();
                 gcs_index.push_back(gcs.rules.size());
-                gcs.add_rule(GrammarCompressed(gcs, dict_entry, gcs_index[current_entry], gcs_index[dict_char]));
+                gcs.add_rule(GrammarCompressed(gcs, gcs.rules.size() + 1, gcs_index[current_entry], gcs_index[dict_char]));
                 next_entry.push_back(std::vector <int> (ALPHABET_SIZE + 1, 0));
                 next_entry[current_entry][c] = dict_entry;
                 current_entry = 0;
             }
 
-            // Concatenate two dictionary strings, if necessary.
-            if (!last_string_entry) {
-                last_string_entry = dict_entry;
-            } else {
-                int string_entry = gcs_index.size();
-                gcs_index.push_back(gcs.rules.size());
-                gcs.add_rule(GrammarCompressed(gcs, string_entry, gcs_index[last_string_entry], gcs_index[dict_entry]));
-                next_entry.resize(next_entry.size() + 1);
-                last_string_entry = string_entry;
-            }
+            concatenation.add(gcs_index[dict_entry]);
         }
     }
-    gcs.final_rule = gcs_index[last_string_entry];
+    gcs.final_rule = concatenation.finish();
     return gcs;
 }
 
 // Compress the string s with alphabet characters 'A'-'Z' using LZW compression.
-GrammarCompressedStorage LZW(const std::string &s) {
+GrammarCompressedStorage LZW(std::string_view s) {
     GrammarCompressedStorage gcs = GrammarCompressedStorage();
     std::vector <unsigned int> gcs_index(1);
     int current_entry = 0;  // The entry corresponding to the current buffer.
@@ -143,7 +225,7 @@ GrammarCompressedStorage LZW(const std::string &s) {
         gcs_index.push_back(gcs.rules.size());
         gcs.add_rule(GrammarCompressed(gcs, i + 1, (char)('A' + i)));
     }
-    int last_string_entry = 0;  // The last entry corresponding to the piece of a string.
+    BalancedConcatenation concatenation(gcs, true);  // The concatenation of all dictionary strings.
     for (unsigned int i = 0; i < s.size(); ++i) {
         int c;
         // Fix for A-Z and a-z alphabets. TODO unify?
@@ -161,68 +243,255 @@ GrammarCompressedStorage LZW(const std::string &s) {
             // Add the new string (current_entry + c) to the dictionary.
             int dict_char = c + 1, dict_entry = gcs_index.size();
             gcs_index.push_back(gcs.rules.size());
-            gcs.add_rule(GrammarCompressed(gcs, dict_entry, gcs_index[current_entry], gcs_index[dict_char]));
+            gcs.add_rule(GrammarCompressed(gcs, gcs.rules.size() + 1, gcs_index[current_entry], gcs_index[dict_char]));
             next_entry.push_back(std::vector <int> (ALPHABET_SIZE + 1, 0));
             next_entry[current_entry][c] = dict_entry;
             current_entry = 0;
 
-            // Concatenate two dictionary strings, if necessary.
-            if (!last_string_entry) {
-                last_string_entry = dict_entry;
-            } else {
-                int string_entry = gcs_index.size();
-                gcs_index.push_back(gcs.rules.size());
-                gcs.add_rule(GrammarCompressed(gcs, string_entry, gcs_index[last_string_entry], gcs_index[dict_entry]));
-                next_entry.resize(next_entry.size() + 1);
-                last_string_entry = string_entry;
+            concatenation.add(gcs_index[dict_entry]);
+        }
+    }
+    gcs.final_rule = concatenation.finish();
+    return gcs;
+}
+
+namespace {
+
+// Returns the size of a dictionary of max_bits bits, which must leave room past the 256 terminals.
+unsigned long long dictionary_size(unsigned max_bits) {
+    if (max_bits < 9 || max_bits > 63) {
+        throw std::invalid_argument("LZW dictionaries take from 9 to 63 bits, got " + std::to_string(max_bits));
+    }
+    return 1ull << max_bits;
+}
+
+}  // namespace
+
+LZWStream::LZWStream(unsigned max_bits, DictionaryPolicy policy): max_entries(dictionary_size(max_bits)),
+                                                                  policy(policy),
+                                                                  has_phrase(false),
+                                                                  current_entry(0),
+                                                                  concatenation(gcs, true) {
+    // Initialize LZW alphabet: the rule for symbol c has index c.
+    for (unsigned int i = 0; i < ASCII_SIZE; ++i) {
+        gcs.add_rule(GrammarCompressed(gcs, i + 1, (char)i));
+    }
+}
+
+void LZWStream::push(char c) {
+    unsigned int symbol = intify(c);
+    if (!has_phrase) {
+        current_entry = symbol;
+        has_phrase = true;
+        return;
+    }
+    unsigned long long key = ((unsigned long long)current_entry << 8) | symbol;
+    auto next_entry = dictionary.find(key);
+    if (next_entry != dictionary.end()) {
+        // If current prefix + c is in the dictionary.
+        current_entry = next_entry->second;
+        return;
+    }
+    concatenation.add(current_entry);
+    if (ASCII_SIZE + dictionary.size() < max_entries) {
+        // Add the new string (current_entry + c) to the dictionary.
+        dictionary[key] = gcs.rules.size();
+        gcs.add_rule(GrammarCompressed(gcs, gcs.rules.size() + 1, current_entry, symbol));
+    } else if (policy == DictionaryPolicy::reset) {
+        // The rules stay in the grammar, only the phrases become unreachable for matching.
+        dictionary.clear();
+    }
+    current_entry = symbol;
+}
+
+void LZWStream::push(std::istream &in) {
+    push(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+}
+
+const GrammarCompressedStorage &LZWStream::finish() {
+    if (has_phrase) {
+        concatenation.add(current_entry);
+        has_phrase = false;
+    }
+    if (concatenation.empty()) {
+        return gcs;
+    }
+    gcs.final_rule = concatenation.fold();
+    return gcs;
+}
+
+// Compress the string s with the full ASCII alphabet using LZW compression with dictionary resets.
+GrammarCompressedStorage LZW2(std::string_view s, unsigned max_bits) {
+    LZWStream stream(max_bits, DictionaryPolicy::reset);
+    stream.push(s.begin(), s.end());
+    return stream.finish();
+}
+
+GrammarCompressedStorage LZW2(std::istream &in, unsigned max_bits) {
+    LZWStream stream(max_bits, DictionaryPolicy::reset);
+    stream.push(in);
+    return stream.finish();
+}
+
+// Compress the string s with the full ASCII alphabet using LZW compression with a frozen dictionary.
+GrammarCompressedStorage LZWASCII(std::string_view s, unsigned max_bits) {
+    LZWStream stream(max_bits, DictionaryPolicy::freeze);
+    stream.push(s.begin(), s.end());
+    return stream.finish();
+}
+
+GrammarCompressedStorage LZWASCII(std::istream &in, unsigned max_bits) {
+    LZWStream stream(max_bits, DictionaryPolicy::freeze);
+    stream.push(in);
+    return stream.finish();
+}
+
+// Compress the string s with the full ASCII alphabet using RePair compression.
+// The sequence is kept as a doubly linked list, and pairs are kept in buckets by their frequency.
+// The frequency of a new pair never exceeds the frequency of the pair being replaced, so
+// the bucket pointer only moves down and the bookkeeping takes linear time in total.
+// Frequencies and occurrence lists are updated lazily: stale entries are skipped when they are met.
+GrammarCompressedStorage RePair(std::string_view s) {
+    GrammarCompressedStorage gcs = GrammarCompressedStorage();
+    if (s.empty()) {
+        return gcs;
+    }
+    const unsigned deleted = std::numeric_limits<unsigned>::max();
+    const int none = -1;
+    // Add terminal rules for the symbols of s only.
+    std::vector <unsigned> terminal(ASCII_SIZE, deleted);
+    std::vector <unsigned> sequence(s.size());
+    for (unsigned i = 0; i < s.size(); ++i) {
+        int c = intify(s[i]);
+        if (terminal[c] == deleted) {
+            terminal[c] = gcs.rules.size();
+            gcs.add_rule(GrammarCompressed(gcs, gcs.rules.size() + 1, s[i]));
+        }
+        sequence[i] = terminal[c];
+    }
+    std::vector <int> prev(s.size()), next(s.size());
+    for (unsigned i = 0; i < s.size(); ++i) {
+        prev[i] = (int)i - 1;
+        next[i] = i + 1 < s.size() ? (int)i + 1 : none;
+    }
+
+    struct PairRecord {
+        long long count = 0;
+        std::vector <unsigned> occurrences;  // positions of the left symbol, possibly stale
+    };
+    auto pair_key = [](unsigned first, unsigned second) {
+        return ((unsigned long long)first << 32) | second;
+    };
+    std::unordered_map <unsigned long long, PairRecord> pairs;
+    for (unsigned i = 0; i + 1 < s.size(); ++i) {
+        // Overlapping occurrences in runs like "aaa" are only counted once.
+        if (i > 0 && sequence[i - 1] == sequence[i] && sequence[i] == sequence[i + 1]) {
+            const auto &run = pairs[pair_key(sequence[i], sequence[i])];
+            if (!run.occurrences.empty() && run.occurrences.back() == i - 1) {
+                continue;
+            }
+        }
+        auto &record = pairs[pair_key(sequence[i], sequence[i + 1])];
+        record.count++;
+        record.occurrences.push_back(i);
+    }
+    std::vector <std::vector <unsigned long long> > buckets(s.size() + 1);
+    for (const auto &pair: pairs) {
+        if (pair.second.count > 1) {
+            buckets[pair.second.count].push_back(pair.first);
+        }
+    }
+
+    std::vector <unsigned long long> touched;
+    auto decrement = [&](unsigned long long key) {
+        auto record = pairs.find(key);
+        if (record != pairs.end() && record->second.count > 0) {
+            record->second.count--;
+        }
+    };
+    auto increment = [&](unsigned long long key, unsigned position) {
+        auto &record = pairs[key];
+        record.count++;
+        record.occurrences.push_back(position);
+        touched.push_back(key);
+    };
+    for (unsigned long long frequency = s.size(); frequency > 1; ) {
+        if (buckets[frequency].empty()) {
+            --frequency;
+            continue;
+        }
+        unsigned long long key = buckets[frequency].back();
+        buckets[frequency].pop_back();
+        auto found = pairs.find(key);
+        if (found == pairs.end() || found->second.count < 2) {
+            continue;
+        }
+        if ((unsigned long long)found->second.count != frequency) {
+            // The entry is stale: the pair has become rarer since it was added to the bucket.
+            buckets[found->second.count].push_back(key);
+            continue;
+        }
+        unsigned first = key >> 32, second = key & 0xffffffffu;
+        unsigned rule = gcs.rules.size();
+        gcs.add_rule(GrammarCompressed(gcs, rule + 1, first, second));
+        std::vector <unsigned> occurrences = std::move(found->second.occurrences);
+        pairs.erase(found);
+        for (unsigned position: occurrences) {
+            int right = next[position];
+            if (sequence[position] != first || right == none || sequence[right] != second) {
+                continue;
+            }
+            int left = prev[position], after = next[right];
+            if (left != none && pair_key(sequence[left], first) != key) {
+                decrement(pair_key(sequence[left], first));
+            }
+            if (after != none && pair_key(second, sequence[after]) != key) {
+                decrement(pair_key(second, sequence[after]));
+            }
+            sequence[position] = rule;
+            sequence[right] = deleted;
+            next[position] = after;
+            if (after != none) {
+                prev[after] = position;
+            }
+            if (left != none) {
+                increment(pair_key(sequence[left], rule), left);
+            }
+            if (after != none) {
+                increment(pair_key(rule, sequence[after]), position);
             }
         }
+        pairs.erase(key);
+        for (auto new_key: touched) {
+            auto new_pair = pairs.find(new_key);
+            if (new_pair != pairs.end() && new_pair->second.count > 1) {
+                buckets[new_pair->second.count].push_back(new_key);
+            }
+        }
+        touched.clear();
+    }
+
+    // The first symbol is never deleted, as replacements only delete the right symbol of a pair.
+    BalancedConcatenation concatenation(gcs, true);
+    for (int position = 0; position != none; position = next[position]) {
+        concatenation.add(sequence[position]);
     }
-    gcs.final_rule = gcs_index[last_string_entry];
+    gcs.final_rule = concatenation.finish();
     return gcs;
 }
 
 
 GrammarCompressedStorage get_aaaa(unsigned long long number) {
     GrammarCompressedStorage gcs = GrammarCompressedStorage();
-    std::vector <unsigned long long> gcs_index(1);
-    unsigned long long current_entry = 0;  // The entry corresponding to the current buffer.
-    std::vector <unsigned long long> next_entry(ASCII_SIZE + 1, 0);
-    // Initialize LZW alphabet.
-    next_entry[0] = 'a' + 1;
     for (unsigned int i = 0; i < ASCII_SIZE; ++i) {
-        gcs_index.push_back(gcs.rules.size());
         gcs.add_rule(GrammarCompressed(gcs, i + 1, i));
     }
-    unsigned long long last_string_entry = 0;  // The last entry corresponding to the piece of a string.
-    for (unsigned long long i = 0; i < number; ++i) {
-        // int c = 'a';
-        if (next_entry[current_entry] != 0 && i + 1 != number) {
-            // If current prefix + c is in the dictionary, and the string has not ended.
-            current_entry = next_entry[current_entry];
-        } else {
-            // Add the new string (current_entry + c) to the dictionary.
-            // int dict_char = c + 1;
-            int dict_entry = gcs_index.size();
-            gcs_index.push_back(gcs.rules.size());
-            gcs.add_rule(GrammarCompressed(gcs, dict_entry, gcs_index[current_entry], 'a'));
-            next_entry.push_back(0);
-            next_entry[current_entry] = dict_entry;
-            current_entry = 0;
-
-            // Concatenate two dictionary strings, if necessary.
-            if (!last_string_entry) {
-                last_string_entry = dict_entry;
-            } else {
-                int string_entry = gcs_index.size();
-                gcs_index.push_back(gcs.rules.size());
-                gcs.add_rule(GrammarCompressed(gcs, string_entry, gcs_index[last_string_entry], gcs_index[dict_entry]));
-                next_entry.resize(next_entry.size() + 1);
-                last_string_entry = string_entry;
-            }
-        }
+    if (number == 1) {
+        gcs.final_rule = 'a';
+    } else if (number > 1) {
+        gcs.final_rule = gcs.rules.size();
+        gcs.add_rule(GrammarCompressed::run(gcs, gcs.rules.size() + 1, 'a', number));
     }
-    gcs.final_rule = gcs_index[last_string_entry];
     return gcs;
 }
   
@@ -394,8 +663,8 @@ GrammarCompressedStorage get_compress_string(const std::string &file_name) {
     buf >>= bits;
 
     unsigned int left = 16 - bits;
-    std::vector <unsigned int> fin_list;
-    fin_list.push_back(fin + 1);
+    BalancedConcatenation concatenation(gcs, true);  // The concatenation of all decoded phrases.
+    concatenation.add(fin);
 
     unsigned int mark = 3, nxt = 5;
     while (nxt < inlen) {
@@ -494,60 +763,334 @@ GrammarCompressedStorage get_compress_string(const std::string &file_name) {
 
           
             unsigned int myind = gcs_index.back() + add_fin;
-            fin_list.push_back(myind);
+            concatenation.add(myind);
         }
         prev = temp;
     }
-    unsigned int last_fin_rule = gcs_index[fin_list[0]];
-    for (unsigned int i = 1; i < fin_list.size(); ++i) {
-        gcs_index.push_back(gcs.rules.size());
-        gcs.add_rule(GrammarCompressed(gcs, gcs_index.back() + 1, last_fin_rule, fin_list[i]));
-        last_fin_rule = gcs_index.back();
+    gcs.final_rule = concatenation.finish();
+    return gcs;
+}
+
+unsigned GrammarCorpus::add(const GrammarCompressedStorage &document) {
+    if (document.empty()) {
+        throw std::invalid_argument("can not add an empty grammar to a corpus");
+    }
+    const unsigned none = std::numeric_limits<unsigned>::max();
+    terminal_rule.resize(ASCII_SIZE, none);
+    std::vector <unsigned> new_index(document.rules.size(), none);
+    // Iterative post-order traversal, so that deep grammars do not overflow the stack.
+    std::vector <unsigned> stack(1, document.final_rule);
+    while (!stack.empty()) {
+        unsigned index = stack.back();
+        if (new_index[index] != none) {
+            stack.pop_back();
+            continue;
+        }
+        const GrammarCompressed &rule = document.rules[index];
+        if (rule.is_base) {
+            stack.pop_back();
+            unsigned &merged = terminal_rule[intify(rule.value)];
+            if (merged == none) {
+                merged = gcs.rules.size();
+                gcs.add_rule(GrammarCompressed(gcs, gcs.rules.size() + 1, rule.value));
+            }
+            new_index[index] = merged;
+            continue;
+        }
+        bool children_ready = true;
+        if (new_index[rule.second_symbol] == none) {
+            stack.push_back(rule.second_symbol);
+            children_ready = false;
+        }
+        if (new_index[rule.first_symbol] == none) {
+            stack.push_back(rule.first_symbol);
+            children_ready = false;
+        }
+        if (!children_ready) {
+            continue;
+        }
+        stack.pop_back();
+        unsigned first = new_index[rule.first_symbol], second = new_index[rule.second_symbol];
+        if (rule.is_run()) {
+            auto inserted = run_rule.insert({{first, rule.run_length}, (unsigned)gcs.rules.size()});
+            if (inserted.second) {
+                gcs.add_rule(GrammarCompressed::run(gcs, gcs.rules.size() + 1, first, rule.run_length));
+            }
+            new_index[index] = inserted.first->second;
+            continue;
+        }
+        auto inserted = pair_rule.insert({((unsigned long long)first << 32) | second, gcs.rules.size()});
+        if (inserted.second) {
+            gcs.add_rule(GrammarCompressed(gcs, gcs.rules.size() + 1, first, second));
+        }
+        new_index[index] = inserted.first->second;
     }
+    gcs.final_rule = new_index[document.final_rule];
+    document_roots.push_back(gcs.final_rule);
+    return document_roots.size() - 1;
+}
 
-    gcs.final_rule = last_fin_rule;
-    return gcs;
+unsigned GrammarCorpus::add(std::string_view document) {
+    return add(RePair(document));
+}
+
+unsigned GrammarCorpus::add_file(const std::string &file_name) {
+    return add(get_compress_string(file_name));
+}
+
+GrammarCompressedStorage normalize(const GrammarCompressedStorage &gcs, NormalizationReport *report) {
+    GrammarCompressedStorage result = GrammarCompressedStorage();
+    if (report) {
+        report->rules_before = gcs.rules.size();
+        report->rules_after = 0;
+    }
+    if (gcs.empty()) {
+        return result;
+    }
+    // A corpus of one document. Its final rule is finished last, and it can not be a duplicate of an earlier rule.
+    GrammarCorpus corpus;
+    corpus.add(gcs);
+    if (report) {
+        report->rules_after = corpus.grammar().rules.size();
+    }
+    return corpus.grammar();
+}
+
+std::vector <unsigned> topological_order(const GrammarCompressedStorage &gcs) {
+    std::vector <unsigned> order;
+    order.reserve(gcs.rules.size());
+    std::vector <char> visited(gcs.rules.size(), 0);  // 0 - new, 1 - children pushed, 2 - done
+    std::vector <unsigned> stack;
+    for (unsigned root = 0; root < gcs.rules.size(); ++root) {
+        stack.push_back(root);
+        while (!stack.empty()) {
+            unsigned index = stack.back();
+            if (visited[index] == 2) {
+                stack.pop_back();
+            } else if (visited[index] == 1 || gcs.rules[index].is_base) {
+                stack.pop_back();
+                visited[index] = 2;
+                order.push_back(index);
+            } else {
+                visited[index] = 1;
+                stack.push_back(gcs.rules[index].second_symbol);
+                stack.push_back(gcs.rules[index].first_symbol);
+            }
+        }
+    }
+    return order;
+}
+
+namespace {
+
+const unsigned long long FINGERPRINT_MOD = (1ull << 61) - 1;
+
+// Returns the base of the fingerprints of this process, drawn at random on the first call.
+unsigned long long fingerprint_base() {
+    static const unsigned long long base = []() {
+        std::random_device device;
+        std::mt19937_64 generator(((unsigned long long)device() << 32) ^ device());
+        return std::uniform_int_distribution<unsigned long long>(1ull << 32, FINGERPRINT_MOD - 1)(generator);
+    }();
+    return base;
+}
+
+// Multiplies two numbers modulo 2^61 - 1.
+unsigned long long multiply_mod(unsigned long long a, unsigned long long b) {
+    __extension__ typedef unsigned __int128 uint128;
+    uint128 product = (uint128)a * b;
+    unsigned long long result = (unsigned long long)(product & FINGERPRINT_MOD) +
+                                (unsigned long long)(product >> 61);
+    return result >= FINGERPRINT_MOD ? result - FINGERPRINT_MOD : result;
+}
+
+// Returns the fingerprint of the concatenation of two strings.
+RuleFingerprint concatenate_fingerprints(const RuleFingerprint &first, const RuleFingerprint &second) {
+    unsigned long long hash = multiply_mod(first.hash, second.power) + second.hash;
+    return {hash >= FINGERPRINT_MOD ? hash - FINGERPRINT_MOD : hash,
+            multiply_mod(first.power, second.power),
+            first.length + second.length};
+}
+
+// Returns the fingerprint of a string repeated k > 0 times using O(log k) concatenations.
+RuleFingerprint repeat_fingerprint(RuleFingerprint base, unsigned long long k) {
+    RuleFingerprint result = base;
+    for (--k; k; k >>= 1) {
+        if (k & 1) {
+            result = concatenate_fingerprints(result, base);
+        }
+        if (k > 1) {
+            base = concatenate_fingerprints(base, base);
+        }
+    }
+    return result;
+}
+
+// Iterates over the expansion of a rule symbol by symbol in O(depth) memory.
+class ExpansionIterator {
+public:
+    ExpansionIterator(const GrammarCompressedStorage &gcs, unsigned index): gcs(gcs), stack(1, {index, 1}) {
+        descend();
+    }
+    bool has_ended() const { return stack.empty(); }
+    char value() const { return gcs.rules[stack.back().first].value; }
+    void next() {
+        if (--stack.back().second == 0) {
+            stack.pop_back();
+        }
+        descend();
+    }
+private:
+    // Moves down to the leftmost terminal of the rule on the top of the stack.
+    void descend() {
+        while (!stack.empty() && !gcs.rules[stack.back().first].is_base) {
+            const GrammarCompressed &rule = gcs.rules[stack.back().first];
+            if (stack.back().second > 1) {
+                --stack.back().second;
+                stack.push_back({stack.back().first, 1});
+            } else if (rule.is_run()) {
+                stack.back() = {rule.first_symbol, rule.run_length};
+            } else {
+                stack.back() = {rule.second_symbol, 1};
+                stack.push_back({rule.first_symbol, 1});
+            }
+        }
+    }
+    const GrammarCompressedStorage &gcs;
+    // Rules with the number of their expansions left to iterate over.
+    std::vector <std::pair <unsigned, unsigned long long> > stack;
+};
+
+// Returns whether two rules have the same symbol, or halves with the same representatives,
+// which makes their expansions equal without comparing them.
+bool same_structure(const GrammarCompressedStorage &gcs, const std::vector <unsigned> &representative,
+                    unsigned first, unsigned second) {
+    const GrammarCompressed &x = gcs.rules[first], &y = gcs.rules[second];
+    if (x.is_base || y.is_base) {
+        return x.is_base && y.is_base && x.value == y.value;
+    }
+    return x.run_length == y.run_length &&
+           representative[x.first_symbol] == representative[y.first_symbol] &&
+           representative[x.second_symbol] == representative[y.second_symbol];
+}
+
+// Compares the expansions of two rules symbol by symbol.
+bool equal_expansions(const GrammarCompressedStorage &gcs, unsigned first, unsigned second) {
+    ExpansionIterator first_it(gcs, first), second_it(gcs, second);
+    for (; !first_it.has_ended() && !second_it.has_ended(); first_it.next(), second_it.next()) {
+        if (first_it.value() != second_it.value()) {
+            return false;
+        }
+    }
+    return first_it.has_ended() && second_it.has_ended();
+}
+
+}  // namespace
+
+std::vector <RuleFingerprint> fingerprint_rules(const GrammarCompressedStorage &gcs) {
+    std::vector <RuleFingerprint> fingerprints(gcs.rules.size());
+    const unsigned long long base = fingerprint_base();
+    for (unsigned index: topological_order(gcs)) {
+        const GrammarCompressed &rule = gcs.rules[index];
+        if (rule.is_base) {
+            fingerprints[index] = {(unsigned long long)intify(rule.value) + 1, base, 1};
+        } else {
+            fingerprints[index] = rule.is_run() ?
+                                  repeat_fingerprint(fingerprints[rule.first_symbol], rule.run_length) :
+                                  concatenate_fingerprints(fingerprints[rule.first_symbol],
+                                                           fingerprints[rule.second_symbol]);
+        }
+    }
+    return fingerprints;
+}
+
+std::vector <unsigned> expansion_classes(const GrammarCompressedStorage &gcs, bool verify) {
+    std::vector <RuleFingerprint> fingerprints = fingerprint_rules(gcs);
+    std::vector <unsigned> representative(gcs.rules.size());
+    // Class representatives by hash. Rules with colliding hashes but different expansions share a bucket.
+    std::unordered_map <unsigned long long, std::vector <unsigned> > classes;
+    for (unsigned index: topological_order(gcs)) {
+        const RuleFingerprint &fingerprint = fingerprints[index];
+        auto &bucket = classes[fingerprint.hash];
+        representative[index] = index;
+        for (unsigned candidate: bucket) {
+            if (fingerprints[candidate].hash == fingerprint.hash &&
+                fingerprints[candidate].length == fingerprint.length &&
+                (!verify || same_structure(gcs, representative, candidate, index) ||
+                 equal_expansions(gcs, candidate, index))) {
+                representative[index] = candidate;
+                break;
+            }
+        }
+        if (representative[index] == index) {
+            bucket.push_back(index);
+        }
+    }
+    return representative;
+}
+
+AlphabetSignature alphabet_signature(std::string_view s) {
+    AlphabetSignature signature;
+    for (char c: s) {
+        signature.set(intify(c));
+    }
+    return signature;
+}
+
+std::vector <AlphabetSignature> alphabet_signatures(const GrammarCompressedStorage &gcs) {
+    std::vector <AlphabetSignature> signatures(gcs.rules.size());
+    for (unsigned index: topological_order(gcs)) {
+        const GrammarCompressed &rule = gcs.rules[index];
+        if (rule.is_base) {
+            signatures[index].set(intify(rule.value));
+        } else {
+            signatures[index] = signatures[rule.first_symbol] | signatures[rule.second_symbol];
+        }
+    }
+    return signatures;
 }
 
 
-GCKernel::GCKernel(const std::string &p, const GrammarCompressedStorage &t): lcs(calculate_lcs(p, t)) {}
 
 // Returns permutation split into strings touching the left side and not.
-std::pair <matrix::Permutation, matrix::Permutation> get_left(const matrix::Permutation &p,
-                                                              unsigned left, unsigned right) {
+template <typename Index>
+std::pair <matrix::BasicPermutation<Index>, matrix::BasicPermutation<Index> > get_left(
+        const matrix::BasicPermutation<Index> &p, Index left, Index right) {
     // from left => row index is from 1 to m
     auto result = p.split_row(left);
     return {result.first, result.second.split_col(right).second};
 }
 
 // Returns permutation split into strings touching the right side and not.
-std::pair <matrix::Permutation, matrix::Permutation> get_right(const matrix::Permutation &p,
-                                                               unsigned left, unsigned right) {
+template <typename Index>
+std::pair <matrix::BasicPermutation<Index>, matrix::BasicPermutation<Index> > get_right(
+        const matrix::BasicPermutation<Index> &p, Index left, Index right) {
     // to right => col index is from n + 1 to n + m
     auto result = p.split_col(right);
     return {result.first.split_row(left).first, result.second};
 }
 
 // Returns permutation with compressed coordinates (values from 1 to x).
-matrix::Permutation compress(const matrix::Permutation &uncompressed) {
-    std::vector <int> row_values(uncompressed.rows.size());
-    std::vector <int> col_values(uncompressed.rows.size());
+template <typename Index>
+matrix::BasicPermutation<Index> compress(const matrix::BasicPermutation<Index> &uncompressed) {
+    std::vector <Index> row_values(uncompressed.rows.size());
+    std::vector <Index> col_values(uncompressed.rows.size());
     for (unsigned i = 0; i < row_values.size(); ++i) {
         row_values[i] = uncompressed.rows[i].first;
         col_values[i] = uncompressed.rows[i].second;
     }
     std::sort(col_values.begin(), col_values.end());
     std::reverse(row_values.begin(), row_values.end());
-    std::unordered_map <unsigned, unsigned> row_compression;
-    std::unordered_map <unsigned, unsigned> col_compression;
+    std::unordered_map <Index, Index> row_compression;
+    std::unordered_map <Index, Index> col_compression;
     for (unsigned i = 0; i < row_values.size(); ++i) {
         row_compression[row_values[i]] = i + 1;
     }
     for (unsigned i = 0; i < col_values.size(); ++i) {
         col_compression[col_values[i]] = i + 1;
     }
-    std::vector <std::pair <unsigned, unsigned> > compressed_rows(uncompressed.rows.size());
-    std::vector <std::pair <unsigned, unsigned> > compressed_cols(uncompressed.cols.size());
+    std::vector <std::pair <Index, Index> > compressed_rows(uncompressed.rows.size());
+    std::vector <std::pair <Index, Index> > compressed_cols(uncompressed.cols.size());
     for (unsigned i = 0; i < uncompressed.rows.size(); ++i) {
         compressed_rows[i].first = row_compression[uncompressed.rows[i].first];
         compressed_rows[i].second = col_compression[uncompressed.rows[i].second];
@@ -556,35 +1099,140 @@ matrix::Permutation compress(const matrix::Permutation &uncompressed) {
         compressed_cols[i].first = col_compression[uncompressed.cols[i].first];
         compressed_cols[i].second = row_compression[uncompressed.cols[i].second];
     }
-    return matrix::Permutation{compressed_rows, compressed_cols};
+    return matrix::BasicPermutation<Index>{compressed_rows, compressed_cols};
 }
 
-matrix::Permutation GCKernel::calculate_char_kernel(const std::string &p, char c) {
-    unsigned last_row = p.size();
-    std::vector <unsigned> last_col(p.size());
-    for (unsigned i = 0; i < p.size(); ++i) {
-        last_col[i] = p.size() - i - 1;
-        if (p[i] == c || last_col[i] > last_row) {
+template <typename Index>
+matrix::BasicPermutation<Index> GCQueryEngine::calculate_char_kernel(unsigned m, const std::vector <unsigned> &positions) {
+    Index last_row = m;
+    std::vector <Index> last_col(m);
+    auto position = positions.begin();
+    for (Index i = 0; i < m; ++i) {
+        last_col[i] = m - i - 1;
+        bool match = position != positions.end() && *position == i;
+        position += match;
+        if (match || last_col[i] > last_row) {
             std::swap(last_col[i], last_row);
         }
     }
-    std::vector <unsigned> result(p.size() + 1);
+    std::vector <Index> result(m + 1);
     last_col.push_back(last_row);
-    for (unsigned i = 0; i <= p.size(); ++i) {
-        result[last_col[i]] = p.size() + 1 - i;
+    for (Index i = 0; i <= m; ++i) {
+        result[last_col[i]] = m + 1 - i;
     }
-    if (last_row == p.size()) {  // from top to bottom
+    if (last_row == m) {  // from top to bottom
         result.pop_back();
     }
-    return compress(matrix::Permutation(result));
+    return compress(matrix::BasicPermutation<Index>(result));
 }
 
+GCQueryEngine::Pattern GCQueryEngine::plain_pattern(std::string_view p) {
+    return {(unsigned)p.size(), alphabet_signature(p), [p](char c) {
+        std::vector <unsigned> positions;
+        for (unsigned i = 0; i < p.size(); ++i) {
+            if (p[i] == c) {
+                positions.push_back(i);
+            }
+        }
+        return positions;
+    }};
+}
+
+GCQueryEngine::Pattern GCQueryEngine::plain_pattern(std::string_view p, const kernel::CharClasses &classes) {
+    AlphabetSignature pattern_classes, alphabet;
+    for (char c: p) {
+        pattern_classes.set(classes.class_of(c));
+    }
+    for (unsigned c = 0; c < alphabet.size(); ++c) {
+        alphabet[c] = pattern_classes.test(classes.class_of(c));
+    }
+    return {(unsigned)p.size(), alphabet, [p, classes](char c) {
+        std::vector <unsigned> positions;
+        for (unsigned i = 0; i < p.size(); ++i) {
+            if (classes(p[i], c)) {
+                positions.push_back(i);
+            }
+        }
+        return positions;
+    }};
+}
+
+std::vector <unsigned> GCQueryEngine::occurrences(char c) const {
+    if (text_length() > std::numeric_limits<unsigned>::max()) {
+        throw std::length_error("text of length " + std::to_string(text_length()));
+    }
+    // The number of occurrences of c in every rule, counted bottom-up. Runs expand far beyond 2^32
+    // in rules that are not a part of the text, so the counts are 64-bit.
+    std::vector <unsigned long long> counts(nodes.size());
+    for (unsigned i = 0; i < nodes.size(); ++i) {
+        const Node &node = nodes[i];
+        if (node.is_base) {
+            counts[i] = node.value == c;
+        } else if (node.run_length) {
+            counts[i] = counts[node.first_symbol] * node.run_length;
+        } else {
+            counts[i] = counts[node.first_symbol] + counts[node.second_symbol];
+        }
+    }
+    std::vector <unsigned> positions(counts[roots.back()]);
+    // The index in positions and the text position where every rule was first placed, so that its other
+    // occurrences copy its positions instead of visiting its rules again.
+    const unsigned NOT_PLACED = std::numeric_limits<unsigned>::max();
+    std::vector <std::pair <unsigned, unsigned long long> > placed(nodes.size(), {NOT_PLACED, 0});
+    // Rules with their index in positions and their text position, the leftmost one on top.
+    // The copies of a run are placed by an entry for the run itself, after its first copy.
+    struct Entry {
+        unsigned node;
+        unsigned index;
+        unsigned long long start;
+        bool copies;
+    };
+    std::vector <Entry> stack = {{roots.back(), 0, 0, false}};
+    while (!stack.empty()) {
+        Entry entry = stack.back();
+        stack.pop_back();
+        const Node &node = nodes[entry.node];
+        if (entry.copies) {
+            unsigned long long count = counts[node.first_symbol];
+            unsigned long long length = lengths[node.first_symbol];
+            for (unsigned long long k = 1; k < node.run_length; ++k) {
+                for (unsigned long long j = 0; j < count; ++j) {
+                    positions[entry.index + k * count + j] = positions[entry.index + j] + k * length;
+                }
+            }
+            continue;
+        }
+        if (!counts[entry.node]) {
+            continue;
+        }
+        auto &first = placed[entry.node];
+        if (first.first != NOT_PLACED) {
+            for (unsigned long long j = 0; j < counts[entry.node]; ++j) {
+                positions[entry.index + j] = positions[first.first + j] + (entry.start - first.second);
+            }
+            continue;
+        }
+        first = {entry.index, entry.start};
+        if (node.is_base) {
+            positions[entry.index] = entry.start;
+        } else if (node.run_length) {
+            stack.push_back({entry.node, entry.index, entry.start, true});
+            stack.push_back({node.first_symbol, entry.index, entry.start, false});
+        } else {
+            stack.push_back({node.second_symbol, (unsigned)(entry.index + counts[node.first_symbol]),
+                             entry.start + lengths[node.first_symbol], false});
+            stack.push_back({node.first_symbol, entry.index, entry.start, false});
+        }
+    }
+    return positions;
+}
 
 // Collects a permutation from the strings adjacent to the left side, right side and both.
-matrix::Permutation combine(matrix::Permutation &left_side,
-                            matrix::Permutation &both_sides,
-                            matrix::Permutation &right_side,
-                            unsigned row_add, unsigned col_add) {
+template <typename Index>
+matrix::BasicPermutation<Index> combine(matrix::BasicPermutation<Index> &left_side,
+                                        matrix::BasicPermutation<Index> &both_sides,
+                                        matrix::BasicPermutation<Index> &right_side,
+                                        Index row_add, Index col_add) {
     for (auto &i : both_sides.rows) {
         i.second += col_add;
     }
@@ -599,8 +1247,8 @@ matrix::Permutation combine(matrix::Permutation &left_side,
         i.first += col_add;
         i.second += row_add;
     }
-    std::vector <std::pair <unsigned, unsigned> > part_combined_rows, all_combined_rows;
-    std::vector <std::pair <unsigned, unsigned> > part_combined_cols, all_combined_cols;
+    std::vector <std::pair <Index, Index> > part_combined_rows, all_combined_rows;
+    std::vector <std::pair <Index, Index> > part_combined_cols, all_combined_cols;
     std::merge(left_side.cols.begin(), left_side.cols.end(),
                both_sides.cols.begin(), both_sides.cols.end(),
                std::back_inserter(part_combined_cols));
@@ -609,52 +1257,706 @@ matrix::Permutation combine(matrix::Permutation &left_side,
                std::back_inserter(all_combined_cols));
     std::merge(left_side.rows.begin(), left_side.rows.end(),
                both_sides.rows.begin(), both_sides.rows.end(),
-               std::back_inserter(part_combined_rows), std::greater<std::pair <unsigned, unsigned>>());
+               std::back_inserter(part_combined_rows), std::greater<std::pair <Index, Index>>());
     std::merge(right_side.rows.begin(), right_side.rows.end(),
                part_combined_rows.begin(), part_combined_rows.end(),
-               std::back_inserter(all_combined_rows), std::greater<std::pair <unsigned, unsigned>>());
-    return compress(matrix::Permutation(all_combined_rows, all_combined_cols));
+               std::back_inserter(all_combined_rows), std::greater<std::pair <Index, Index>>());
+    return compress(matrix::BasicPermutation<Index>(all_combined_rows, all_combined_cols));
+}
+
+
+// Returns the compressed kernel for the concatenation of two texts by their compressed kernels for a pattern of size m.
+template <typename Index>
+matrix::BasicPermutation<Index> concatenate_kernels(const matrix::BasicPermutation<Index> &first,
+                                                    const matrix::BasicPermutation<Index> &second, Index m) {
+    auto to_right = get_right<Index>(first, m, first.cols.size() - m);
+    auto from_left = get_left<Index>(second, m, second.cols.size() - m);
+    auto intersection = to_right.second * from_left.first;
+    return combine<Index>(to_right.first, intersection, from_left.second,
+                          first.rows.size() - m, first.cols.size() - m);
+}
+
+// Returns the compressed kernel for a text repeated k > 0 times by its compressed kernel
+// for a pattern of size m, using O(log k) concatenations by repeated squaring.
+template <typename Index>
+matrix::BasicPermutation<Index> repeat_kernel(matrix::BasicPermutation<Index> base, unsigned long long k, Index m) {
+    matrix::BasicPermutation<Index> result = base;
+    for (--k; k; k >>= 1) {
+        if (k & 1) {
+            result = concatenate_kernels(result, base, m);
+        }
+        if (k > 1) {
+            base = concatenate_kernels(base, base, m);
+        }
+    }
+    return result;
+}
+
+namespace {
+
+// Returns the compressed kernel for a pattern of size m = top_rows.size() and a text of one character
+// for every set top_rows[i], in row order, that matches only row i. Its strand leaving row i
+// to the right starts at the top exactly if top_rows[i] is set.
+template <typename Index>
+matrix::BasicPermutation<Index> state_kernel(const std::vector <char> &top_rows) {
+    Index m = top_rows.size(), top_count = std::count(top_rows.begin(), top_rows.end(), 1);
+    std::vector <Index> permutation(m + top_count);
+    Index top = 0;
+    for (Index i = 0; i < m; ++i) {
+        if (top_rows[i]) {
+            permutation[m + top] = top_count + m - i;
+            permutation[m - i - 1] = ++top;
+        } else {
+            permutation[m - i - 1] = top_count + m - i;
+        }
+    }
+    return matrix::BasicPermutation<Index>(permutation);
+}
+
+// Sets top_rows[i] if the strand of a compressed kernel for a pattern of size m = top_rows.size()
+// that leaves row i to the right started at the top, that is if lcs(p[0:i + 1], t) > lcs(p[0:i], t).
+template <typename Index>
+void read_top_rows(const matrix::BasicPermutation<Index> &kernel, std::vector <char> &top_rows) {
+    Index m = top_rows.size(), bottom = kernel.cols.size() - m;
+    for (const auto &col: kernel.cols) {
+        if (col.first > bottom) {
+            top_rows[m - (col.first - bottom)] = col.second > m;
+        }
+    }
+}
+
+// Passes the column of a character matching the pattern at the sorted positions through the rows of top_rows,
+// as one column of the dynamic programming table, where grows tells whether the value above the column
+// grows across it. Returns whether the value below it grows.
+bool pass_column(std::vector <char> &top_rows, const std::vector <unsigned> &positions, bool grows) {
+    auto position = positions.begin();
+    char down = grows;
+    for (unsigned i = 0; i < top_rows.size(); ++i) {
+        bool match = position != positions.end() && *position == i;
+        position += match;
+        char &right = top_rows[i];
+        if (match ? right == down : right && down) {
+            right = down = !right;
+        }
+    }
+    return down;
 }
 
+}  // namespace
 
-void GCKernel::calculate_gc_kernel(std::vector<matrix::Permutation> &calculated, 
-                                                  const std::string &p, const GrammarCompressedStorage &t, unsigned int index) {
-    if (calculated[t.rules[index].number].get_nonzero_amount()) {
-    } else if (t.rules[index].is_base) { // t is a single symbol
-        calculated[t.rules[index].number] = calculate_char_kernel(p, t.rules[index].value);
-    } else { // t = uv
-        unsigned int first_half = t.rules[index].first_symbol;
-        unsigned int second_half = t.rules[index].second_symbol;
-        unsigned int first_number = t.rules[first_half].number;
-        unsigned int second_number = t.rules[second_half].number;
-        if (!calculated[first_number].get_nonzero_amount()) {
-            calculate_gc_kernel(calculated, p, t, first_half);
+GCQueryEngine::GCQueryEngine(const GrammarCompressedStorage &t, ExpansionSharing sharing):
+    GCQueryEngine(t, std::vector <unsigned>(1, t.final_rule), sharing) {}
+
+GCQueryEngine::GCQueryEngine(const GrammarCorpus &corpus, ExpansionSharing sharing):
+    GCQueryEngine(corpus.grammar(), corpus.roots(), sharing) {}
+
+GCQueryEngine::GCQueryEngine(const GrammarCompressedStorage &t, const std::vector <unsigned> &root_rules,
+                             ExpansionSharing sharing) {
+    for (unsigned root: root_rules) {
+        if (root == GrammarCompressedStorage::NO_RULE) {
+            throw std::invalid_argument("a query engine needs non-empty grammars");
+        }
+    }
+    std::vector <unsigned> order = topological_order(t);
+    std::vector <unsigned> representative(t.rules.size());
+    if (sharing != ExpansionSharing::NONE) {
+        representative = expansion_classes(t, sharing == ExpansionSharing::VERIFIED);
+    } else {
+        std::iota(representative.begin(), representative.end(), 0);
+    }
+    // A representative precedes all rules of its class in topological order,
+    // so the rules needed for the roots can be marked in a single backward pass.
+    std::vector <char> needed(t.rules.size(), 0);
+    for (unsigned root: root_rules) {
+        needed[representative[root]] = 1;
+    }
+    for (auto it = order.rbegin(); it != order.rend(); ++it) {
+        const GrammarCompressed &rule = t.rules[*it];
+        if (needed[*it] && !rule.is_base) {
+            needed[representative[rule.first_symbol]] = 1;
+            needed[representative[rule.second_symbol]] = 1;
+        }
+    }
+    std::vector <unsigned> node_index(t.rules.size());
+    for (unsigned index: order) {
+        if (!needed[index]) {
+            continue;
+        }
+        const GrammarCompressed &rule = t.rules[index];
+        node_index[index] = nodes.size();
+        if (rule.is_base) {
+            nodes.push_back({true, rule.value, 0, 0, 0});
+            lengths.push_back(1);
+            signatures.emplace_back();
+            signatures.back().set(intify(rule.value));
+            continue;
+        }
+        unsigned first = node_index[representative[rule.first_symbol]];
+        unsigned second = node_index[representative[rule.second_symbol]];
+        nodes.push_back({false, 0, first, second, rule.run_length});
+        lengths.push_back(rule.is_run() ? lengths[first] * rule.run_length : lengths[first] + lengths[second]);
+        signatures.push_back(signatures[first] | signatures[second]);
+    }
+    for (unsigned root: root_rules) {
+        roots.push_back(node_index[representative[root]]);
+    }
+}
+
+template <typename Index>
+void GCQueryEngine::evaluate(const Pattern &p, std::vector <unsigned> &projected, std::vector <unsigned> &uses,
+                             KernelStore<Index> &kernels, bool keep_kernels, Checkpoint<Index> *checkpoint) const {
+    const AlphabetSignature &pattern = p.alphabet;
+    unsigned n = nodes.size();
+    Index m = p.size;
+    projected.assign(n, 0);
+    uses.assign(n, 0);
+    kernels.reset(n);
+
+    // Top-to-bottom strands are dropped from compressed kernels, so appending a string
+    // without characters of p to either side of a rule does not change its kernel.
+    unsigned no_match = n;  // the first rule without characters of p
+    // Terminals of the same character share the kernel of the first one, so the positions
+    // of a character in p are found once however many terminals the grammar has for it.
+    std::vector <unsigned> first_terminal(ASCII_SIZE, n);
+    for (unsigned i = 0; i < n; ++i) {
+        const Node &node = nodes[i];
+        if ((signatures[i] & pattern).none()) {
+            if (no_match == n) {
+                no_match = i;
+            }
+            projected[i] = no_match;
+        } else if (node.is_base) {
+            unsigned &first = first_terminal[intify(node.value)];
+            first = std::min(first, i);
+            projected[i] = first;
+        } else if (!node.is_base && (signatures[node.first_symbol] & pattern).none()) {
+            projected[i] = projected[node.second_symbol];
+        } else if (!node.is_base && (signatures[node.second_symbol] & pattern).none()) {
+            projected[i] = projected[node.first_symbol];
+        } else {
+            projected[i] = i;
+        }
+    }
+    // Only the kernels reachable from the roots through projected rules are calculated,
+    // unless all of them are kept. For them, count the calculated rules that use them.
+    for (unsigned root: roots) {
+        uses[projected[root]] = 1;
+    }
+    for (unsigned i = 0; keep_kernels && i < n; ++i) {
+        uses[projected[i]] = 1;
+    }
+    for (unsigned i = n; i-- > 0;) {
+        if (uses[i] && !nodes[i].is_base) {
+            ++uses[projected[nodes[i].first_symbol]];
+            if (!nodes[i].run_length) {
+                ++uses[projected[nodes[i].second_symbol]];
+            }
+        }
+    }
+
+    unsigned start = 0;
+    if (checkpoint && checkpoint->archive.next) {
+        // The saved kernels have lost the uses of the rules before the save.
+        start = checkpoint->archive.next;
+        std::vector <unsigned> uses_left = uses;
+        for (unsigned i = 0; i < start; ++i) {
+            if (uses[i] && !nodes[i].is_base) {
+                --uses_left[projected[nodes[i].first_symbol]];
+                if (!nodes[i].run_length) {
+                    --uses_left[projected[nodes[i].second_symbol]];
+                }
+            }
+        }
+        for (const auto &kernel: checkpoint->archive.kernels) {
+            PackedKernel<Index> packed = PackedKernel<Index>::read(kernel.second.data(), kernel.second.size());
+            kernels.put(kernel.first, packed.unpack(), uses_left[kernel.first]);
+        }
+        checkpoint->archive.kernels.clear();
+    }
+    for (unsigned i = start; i < n; ++i) {
+        if (checkpoint && i > start && i % checkpoint->interval == 0) {
+            // The kernels are saved as they are stored, so spilled kernels are not read back.
+            checkpoint->archive.next = i;
+            for (unsigned j: kernels.live()) {
+                checkpoint->archive.kernels.emplace_back(j, std::vector <char>());
+                kernels.write(j, checkpoint->archive.kernels.back().second);
+            }
+            io::save_archive(checkpoint->file, checkpoint->archive);
+            checkpoint->archive.kernels.clear();
+        }
+        if (!uses[i]) {
+            continue;
+        }
+        const Node &node = nodes[i];
+        if (node.is_base) {
+            kernels.put(i, calculate_char_kernel<Index>(m, p.occurrences(node.value)), uses[i]);
+        } else if (node.run_length) {
+            unsigned first = projected[node.first_symbol];
+            matrix::BasicPermutation<Index> result = repeat_kernel<Index>(kernels.get(first), node.run_length, m);
+            kernels.release(first);
+            kernels.put(i, std::move(result), uses[i]);
+        } else {
+            unsigned first = projected[node.first_symbol], second = projected[node.second_symbol];
+            // Both kernels stay in memory until the next put.
+            const matrix::BasicPermutation<Index> &first_kernel = kernels.get(first);
+            const matrix::BasicPermutation<Index> &second_kernel = kernels.get(second);
+            matrix::BasicPermutation<Index> result = concatenate_kernels<Index>(first_kernel, second_kernel, m);
+            kernels.release(first);
+            kernels.release(second);
+            kernels.put(i, std::move(result), uses[i]);
+        }
+    }
+}
+
+unsigned GCQueryEngine::query(std::string_view p) const {
+    return query(plain_pattern(p)).back();
+}
+
+unsigned GCQueryEngine::query(std::string_view p, KernelStats &stats) const {
+    return query(plain_pattern(p), &stats).back();
+}
+
+unsigned GCQueryEngine::query(std::string_view p, const kernel::CharClasses &classes) const {
+    return query(plain_pattern(p, classes)).back();
+}
+
+unsigned GCQueryEngine::query(const GCQueryEngine &pattern) const {
+    if (pattern.text_length() > std::numeric_limits<unsigned>::max()) {
+        throw std::length_error("pattern of length " + std::to_string(pattern.text_length()));
+    }
+    return query(Pattern{(unsigned)pattern.text_length(), pattern.alphabet(),
+                         [&pattern](char c) { return pattern.occurrences(c); }}).back();
+}
+
+unsigned GCQueryEngine::query_cached(std::string_view p, const std::string &cache_directory,
+                                     unsigned checkpoint_interval) const {
+    // The key also tells apart the kernel index types, as they are chosen by the size of p.
+    std::uint64_t key = io::content_hash(p.data(), p.size(), content_hash());
+    char name[32];
+    std::snprintf(name, sizeof(name), "%016llx.lcsk", (unsigned long long)key);
+    std::string file = cache_directory + "/" + name;
+    checkpoint_interval = std::max(checkpoint_interval, 1u);
+    if (p.size() < (1u << 13)) {
+        return query_cached<std::uint16_t>(p, file, key, checkpoint_interval);
+    } else if (p.size() < (1u << 29)) {
+        return query_cached<std::uint32_t>(p, file, key, checkpoint_interval);
+    }
+    return query_cached<std::uint64_t>(p, file, key, checkpoint_interval);
+}
+
+template <typename Index>
+unsigned GCQueryEngine::query_cached(std::string_view p, const std::string &file, std::uint64_t key,
+                                     unsigned interval) const {
+    Checkpoint<Index> checkpoint{file, interval, io::KernelArchive<Index>()};
+    try {
+        // The key is only a hash, so the pattern is compared as well.
+        if (!io::load_archive(file, checkpoint.archive) || checkpoint.archive.key != key ||
+            checkpoint.archive.pattern != p) {
+            checkpoint.archive = io::KernelArchive<Index>();
+        }
+        // A file written by another build can pass its checksum with records that do not fit this grammar.
+        if (checkpoint.archive.next > nodes.size()) {
+            throw io::KernelFileError(file, "resumes past the last rule");
         }
-        if (!calculated[second_number].get_nonzero_amount()) {
-            calculate_gc_kernel(calculated, p, t, second_half);
+        for (const auto &kernel: checkpoint.archive.kernels) {
+            if (kernel.first >= nodes.size()) {
+                throw io::KernelFileError(file, "holds the kernel of rule " + std::to_string(kernel.first) +
+                                                " outside the grammar");
+            }
+            PackedKernel<Index>::read(kernel.second.data(), kernel.second.size());
         }
+    } catch (const std::runtime_error &) {
+        checkpoint.archive = io::KernelArchive<Index>();
+    }
+    checkpoint.archive.key = key;
+    checkpoint.archive.pattern = std::string(p);
+    // A finished query keeps only the kernel of the text.
+    if (checkpoint.archive.next == nodes.size() && checkpoint.archive.kernels.size() == 1) {
+        const std::vector <char> &record = checkpoint.archive.kernels[0].second;
+        return whole_lcs<Index>(PackedKernel<Index>::read(record.data(), record.size()).unpack(), p.size());
+    }
+    KernelStore<Index> kernels(memory_budget, spill_directory, packing);
+    std::vector <unsigned> projected, uses;
+    evaluate<Index>(plain_pattern(p), projected, uses, kernels, false, &checkpoint);
+    unsigned final_rule = projected[roots.back()];
+    checkpoint.archive.next = nodes.size();
+    checkpoint.archive.kernels = {{final_rule, std::vector <char>()}};
+    kernels.write(final_rule, checkpoint.archive.kernels[0].second);
+    io::save_archive(file, checkpoint.archive);
+    return whole_lcs<Index>(kernels.get(final_rule), p.size());
+}
+
+std::uint64_t GCQueryEngine::content_hash() const {
+    std::uint64_t hash = io::content_hash(nullptr, 0);
+    for (const Node &node: nodes) {
+        std::uint64_t fields[4] = {(std::uint64_t)node.is_base << 8 | (unsigned char)node.value,
+                                   node.first_symbol, node.second_symbol, node.run_length};
+        hash = io::content_hash(fields, sizeof(fields), hash);
+    }
+    return io::content_hash(roots.data(), roots.size() * sizeof(roots[0]), hash);
+}
+
+std::vector <unsigned> GCQueryEngine::query_all(std::string_view p) const {
+    return query(plain_pattern(p));
+}
+
+std::vector <unsigned> GCQueryEngine::query(const Pattern &p, KernelStats *stats) const {
+    // Compressed kernels have at most 2|p| strands, and their coordinates stay below 4|p| + 4 in products.
+    if (p.size < (1u << 13)) {
+        return query<std::uint16_t>(p, stats);
+    } else if (p.size < (1u << 29)) {
+        return query<std::uint32_t>(p, stats);
+    }
+    return query<std::uint64_t>(p, stats);
+}
 
-        auto to_right = get_right(calculated[first_number], p.size(), calculated[first_number].cols.size() - p.size());
-        auto from_left = get_left(calculated[second_number], p.size(), calculated[second_number].cols.size() - p.size());
-        auto intersection = to_right.second * from_left.first;
+template <typename Index>
+std::vector <unsigned> GCQueryEngine::query(const Pattern &p, KernelStats *stats) const {
+    // Scratch space reused by all queries of the current thread.
+    thread_local KernelStore<Index> kernels;
+    thread_local std::vector <unsigned> projected, uses;
+    kernels.configure(memory_budget, spill_directory, packing);
+    evaluate<Index>(p, projected, uses, kernels, false);
+    std::vector <unsigned> result(roots.size());
+    for (unsigned i = 0; i < roots.size(); ++i) {
+        result[i] = whole_lcs<Index>(kernels.get(projected[roots[i]]), p.size);
+    }
+    if (stats) {
+        *stats = kernels.statistics();
+    }
+    kernels.reset(0);
+    return result;
+}
+
+unsigned GCQueryEngine::query_split(std::string_view p, unsigned blocks, unsigned threads) const {
+    blocks = std::min<std::size_t>(blocks, p.size());
+    if (blocks < 2) {
+        return query(p);
+    }
+    threads = std::max(threads, 1u);
+    // The kernels of a block have at most twice as many strands as its longest block has characters.
+    std::size_t block_size = (p.size() + blocks - 1) / blocks;
+    if (block_size < (1u << 13)) {
+        return query_split<std::uint16_t>(p, blocks, threads);
+    } else if (block_size < (1u << 29)) {
+        return query_split<std::uint32_t>(p, blocks, threads);
+    }
+    return query_split<std::uint64_t>(p, blocks, threads);
+}
+
+template <typename Index>
+unsigned GCQueryEngine::query_split(std::string_view p, unsigned blocks, unsigned threads) const {
+    std::vector <unsigned long long> tops, steps;  // where lcs(the blocks swept so far, t[0:j + 1)) grows
+    unsigned result = 0;
+    for (unsigned first = 0; first < blocks; first += threads) {
+        // The kernels of a wave of blocks are calculated in parallel and kept until the block is swept.
+        unsigned wave = std::min(threads, blocks - first);
+        std::vector <Pattern> patterns;
+        for (unsigned i = first; i < first + wave; ++i) {
+            std::size_t begin = p.size() * i / blocks, end = p.size() * (i + 1) / blocks;
+            patterns.push_back(plain_pattern(p.substr(begin, end - begin)));
+        }
+        std::deque <KernelStore<Index> > kernels;
+        for (unsigned i = 0; i < wave; ++i) {
+            kernels.emplace_back(memory_budget, spill_directory, packing);
+        }
+        std::vector <std::vector <unsigned> > projected(wave), uses(wave);
+        auto calculate = [&](unsigned i) {
+            evaluate<Index>(patterns[i], projected[i], uses[i], kernels[i], true);
+        };
+        std::vector <std::thread> workers;
+        for (unsigned i = 1; i < wave; ++i) {
+            workers.emplace_back(calculate, i);
+        }
+        calculate(0);
+        for (auto &worker: workers) {
+            worker.join();
+        }
+        for (unsigned i = 0; i < wave; ++i) {
+            bool last = first + i + 1 == blocks;
+            steps.clear();
+            result = sweep<Index>(patterns[i], projected[i], kernels[i], tops, last ? nullptr : &steps);
+            tops.swap(steps);
+            kernels[i].reset(0);
+        }
+    }
+    return result;
+}
 
-        calculated[t.rules[index].number] = combine(to_right.first, intersection, from_left.second,
-                                                    calculated[first_number].rows.size() - p.size(),
-                                                    calculated[first_number].cols.size() - p.size());
+template <typename Index>
+unsigned GCQueryEngine::sweep(const Pattern &p, const std::vector <unsigned> &projected, KernelStore<Index> &kernels,
+                              const std::vector <unsigned long long> &tops,
+                              std::vector <unsigned long long> *steps) const {
+    Index m = p.size;
+    std::vector <char> top_rows(m), next_rows(m);
+    unsigned result = 0;
+    auto top = tops.begin();  // the first position of tops that is not swept yet
+    // The pieces of the text that are still to be swept, the leftmost one on top:
+    // copies copies of the rule of a node, starting at a text position.
+    struct Piece {
+        unsigned node;
+        unsigned long long copies, start;
+    };
+    std::vector <Piece> stack = {{roots.back(), 1, 0}};
+    while (!stack.empty()) {
+        Piece piece = stack.back();
+        stack.pop_back();
+        const Node &node = nodes[piece.node];
+        bool marked = top != tops.end() && *top < piece.start + piece.copies * lengths[piece.node];
+        if (!marked && (signatures[piece.node] & p.alphabet).none()) {
+            continue;
+        }
+        if (!marked) {
+            // Without growth above it, the piece is passed at once through its kernel.
+            matrix::BasicPermutation<Index> kernel = kernels.get(projected[piece.node]);
+            if (piece.copies > 1) {
+                kernel = repeat_kernel<Index>(std::move(kernel), piece.copies, m);
+            }
+            read_top_rows<Index>(concatenate_kernels<Index>(state_kernel<Index>(top_rows), kernel, m), next_rows);
+            unsigned grown = std::count(next_rows.begin(), next_rows.end(), 1) -
+                             std::count(top_rows.begin(), top_rows.end(), 1);
+            if (!steps || !grown) {
+                result += grown;
+                top_rows.swap(next_rows);
+                continue;
+            }
+        }
+        // Otherwise it is divided until the positions of growth above and below are single characters.
+        if (piece.copies > 1) {
+            unsigned long long half = piece.copies / 2;
+            stack.push_back({piece.node, piece.copies - half, piece.start + half * lengths[piece.node]});
+            stack.push_back({piece.node, half, piece.start});
+        } else if (node.is_base) {
+            top += marked;
+            if (pass_column(top_rows, p.occurrences(node.value), marked)) {
+                ++result;
+                if (steps) {
+                    steps->push_back(piece.start);
+                }
+            }
+        } else if (node.run_length) {
+            stack.push_back({node.first_symbol, node.run_length, piece.start});
+        } else {
+            stack.push_back({node.second_symbol, 1, piece.start + lengths[node.first_symbol]});
+            stack.push_back({node.first_symbol, 1, piece.start});
+        }
     }
+    return result;
 }
 
-unsigned GCKernel::calculate_lcs(const std::string &p, const GrammarCompressedStorage &t) {
-    std::vector <matrix::Permutation> kernels(t.rules[t.final_rule].number + 1);
-    calculate_gc_kernel(kernels, p, t, t.final_rule);
-    auto kernel = kernels.back();
-    int size = kernel.cols.size() - p.size();
+template <typename Index>
+unsigned GCQueryEngine::whole_lcs(const matrix::BasicPermutation<Index> &kernel, unsigned m) {
+    Index size = kernel.cols.size() - m;
     unsigned count_dom = 0;
     for (auto i: kernel.rows) {
-        count_dom += (i.first <= p.size() && i.second > (unsigned)size);
+        count_dom += (i.first <= m && i.second > size);
+    }
+    return m - count_dom;
+}
+
+namespace {
+
+// Throws std::out_of_range unless l <= r <= size for the range from l to r of the named string.
+void check_range(unsigned long long l, unsigned long long r, unsigned long long size, const char *name) {
+    if (l > r || r > size) {
+        throw std::out_of_range("range [" + std::to_string(l) + ", " + std::to_string(r) + ") is not within " +
+                                name + " of length " + std::to_string(size));
+    }
+}
+
+}  // namespace
+
+GCSemiLocalKernel::GCSemiLocalKernel(std::string_view a, const GrammarCompressedStorage &b,
+                                     ExpansionSharing sharing, kernel::Ownership ownership):
+    GCSemiLocalKernel(a, std::make_shared<const GCQueryEngine>(b, sharing), ownership) {}
+
+GCSemiLocalKernel::GCSemiLocalKernel(std::string_view a, std::shared_ptr <const GCQueryEngine> engine,
+                                     kernel::Ownership ownership):
+    owned_a(ownership == kernel::Ownership::COPY ? a : std::string_view()),
+    a(ownership == kernel::Ownership::COPY ? std::string_view(owned_a) : a),
+    engine(std::move(engine)),
+    whole_b(evaluate()),
+    lcs(GCQueryEngine::whole_lcs(final_kernel(), this->a.size())) {}
+
+matrix::DominanceCounter GCSemiLocalKernel::evaluate() {
+    std::vector <unsigned> uses;
+    KernelStore<unsigned> store;
+    engine->evaluate<unsigned>(GCQueryEngine::plain_pattern(a), projected, uses, store, true);
+    kernels.resize(engine->nodes.size());
+    for (unsigned i = 0; i < kernels.size(); ++i) {
+        if (projected[i] == i) {
+            kernels[i] = store.take(i);
+        }
     }
-    return p.size() - count_dom;
+    return matrix::DominanceCounter(final_kernel());
 }
 
+const matrix::Permutation &GCSemiLocalKernel::final_kernel() const {
+    return kernels[projected[engine->roots.back()]];
+}
+
+matrix::Permutation GCSemiLocalKernel::range_kernel(unsigned long long b_l, unsigned long long b_r) const {
+    // Rules covering the range left to right, with the number of their consecutive repetitions.
+    std::vector <std::pair <unsigned, unsigned long long> > pieces;
+    // Rules with the part of their expansion to cover, ordered so that the leftmost one is on top.
+    // A part with repeat > 1 stands for that many consecutive copies of the whole rule.
+    struct Part {
+        unsigned node;
+        unsigned long long l, r, repeat;
+    };
+    std::vector <Part> stack(1, {engine->roots.back(), b_l, b_r, 1});
+    while (!stack.empty()) {
+        Part part = stack.back();
+        stack.pop_back();
+        const GCQueryEngine::Node &node = engine->nodes[part.node];
+        if (part.l == 0 && part.r == engine->lengths[part.node]) {
+            pieces.push_back({part.node, part.repeat});
+        } else if (node.run_length) {
+            unsigned long long period = engine->lengths[node.first_symbol];
+            unsigned long long first_block = part.l / period, last_block = (part.r - 1) / period;
+            if (first_block == last_block) {
+                stack.push_back({node.first_symbol, part.l - first_block * period, part.r - first_block * period, 1});
+                continue;
+            }
+            // The range is split into an incomplete first period, full periods and an incomplete last one.
+            unsigned long long full_begin = first_block + (part.l % period != 0);
+            unsigned long long full_end = last_block + (part.r % period == 0);
+            if (part.r % period != 0) {
+                stack.push_back({node.first_symbol, 0, part.r - last_block * period, 1});
+            }
+            if (full_begin < full_end) {
+                stack.push_back({node.first_symbol, 0, period, full_end - full_begin});
+            }
+            if (part.l % period != 0) {
+                stack.push_back({node.first_symbol, part.l - first_block * period, period, 1});
+            }
+        } else {
+            unsigned long long middle = engine->lengths[node.first_symbol];
+            if (part.r > middle) {
+                stack.push_back({node.second_symbol, std::max(part.l, middle) - middle, part.r - middle, 1});
+            }
+            if (part.l < middle) {
+                stack.push_back({node.first_symbol, part.l, std::min(part.r, middle), 1});
+            }
+        }
+    }
+    matrix::Permutation result;
+    for (unsigned i = 0; i < pieces.size(); ++i) {
+        matrix::Permutation piece = kernels[projected[pieces[i].first]];
+        if (pieces[i].second > 1) {
+            piece = repeat_kernel<unsigned>(piece, pieces[i].second, a.size());
+        }
+        result = i ? concatenate_kernels<unsigned>(result, piece, a.size()) : piece;
+    }
+    return result;
+}
+unsigned GCSemiLocalKernel::substring_lcs(const matrix::Permutation &kernel, unsigned a_l, unsigned a_r) const {
+    unsigned m = a.size(), k = kernel.cols.size();
+    unsigned dominated = 0;
+    for (auto i: kernel.rows) {
+        dominated += (i.first > m - a_l && i.second > k - a_r);
+    }
+    return dominated - a_l;
+}
+
+unsigned GCSemiLocalKernel::lcs_whole_a(unsigned long long b_l, unsigned long long b_r) const {
+    check_range(b_l, b_r, text_length(), "b");
+    if (b_l == b_r || a.empty()) {
+        return 0;
+    }
+    return substring_lcs(range_kernel(b_l, b_r), 0, a.size());
+}
+
+unsigned GCSemiLocalKernel::lcs_whole_b(unsigned a_l, unsigned a_r) const {
+    check_range(a_l, a_r, a.size(), "a");
+    if (a_l == a_r) {
+        return 0;
+    }
+    unsigned k = final_kernel().cols.size();
+    return whole_b.count(a.size() - a_l, k - a_r) - a_l;
+}
+
+unsigned GCSemiLocalKernel::lcs_suffix_a_prefix_b(unsigned a_l, unsigned long long b_r) const {
+    check_range(a_l, a.size(), a.size(), "a");
+    check_range(0, b_r, text_length(), "b");
+    if (a_l == a.size() || b_r == 0) {
+        return 0;
+    }
+    return substring_lcs(range_kernel(0, b_r), a_l, a.size());
+}
+
+unsigned GCSemiLocalKernel::lcs_prefix_a_suffix_b(unsigned a_r, unsigned long long b_l) const {
+    check_range(0, a_r, a.size(), "a");
+    check_range(b_l, text_length(), text_length(), "b");
+    if (a_r == 0 || b_l == text_length()) {
+        return 0;
+    }
+    return substring_lcs(range_kernel(b_l, text_length()), 0, a_r);
+}
+
+GCIncrementalQuery::GCIncrementalQuery(std::string_view p): p(p), pattern(alphabet_signature(p)),
+                                                              no_match(NO_MATCH), last_lcs(0) {}
+
+unsigned GCIncrementalQuery::update(const GrammarCompressedStorage &t) {
+    if (t.empty()) {
+        return last_lcs;
+    }
+    GCQueryEngine::Pattern view = GCQueryEngine::plain_pattern(p);
+    for (unsigned i = projected.size(); i < t.rules.size(); ++i) {
+        const GrammarCompressed &rule = t.rules[i];
+        matches.push_back(rule.is_base ? pattern.test(intify(rule.value))
+                                       : matches[rule.first_symbol] || matches[rule.second_symbol]);
+        // The same projections as in GCQueryEngine::evaluate.
+        if (!matches[i]) {
+            if (no_match == NO_MATCH) {
+                no_match = i;
+                kernels.resize(i + 1);
+                kernels[i] = GCQueryEngine::calculate_char_kernel<unsigned>(p.size(), {});
+            }
+            projected.push_back(no_match);
+        } else if (!rule.is_base && !rule.is_run() && !matches[rule.first_symbol]) {
+            projected.push_back(projected[rule.second_symbol]);
+        } else if (!rule.is_base && !rule.is_run() && !matches[rule.second_symbol]) {
+            projected.push_back(projected[rule.first_symbol]);
+        } else {
+            kernels.resize(i + 1);
+            if (rule.is_base) {
+                kernels[i] = GCQueryEngine::calculate_char_kernel<unsigned>(p.size(), view.occurrences(rule.value));
+            } else if (rule.is_run()) {
+                kernels[i] = repeat_kernel<unsigned>(kernels[projected[rule.first_symbol]], rule.run_length, p.size());
+            } else {
+                kernels[i] = concatenate_kernels<unsigned>(kernels[projected[rule.first_symbol]],
+                                                           kernels[projected[rule.second_symbol]], p.size());
+            }
+            projected.push_back(i);
+        }
+    }
+    last_lcs = GCQueryEngine::whole_lcs(kernels[projected[t.final_rule]], p.size());
+    return last_lcs;
+}
+
+namespace {
+
+unsigned query_within_budget(std::string_view p, const GrammarCompressedStorage &t, ExpansionSharing sharing,
+                             std::size_t memory_budget) {
+    GCQueryEngine engine(t, sharing);
+    engine.set_memory_budget(memory_budget);
+    return engine.query(p);
+}
+
+}  // namespace
+
+GCKernel::GCKernel(std::string_view p, const GrammarCompressedStorage &t, ExpansionSharing sharing,
+                   std::size_t memory_budget):
+    lcs(query_within_budget(p, t, sharing, memory_budget)) {}
+
+GCKernel::GCKernel(std::string_view p, const GrammarCompressedStorage &t, const kernel::CharClasses &classes,
+                   ExpansionSharing sharing):
+    lcs(GCQueryEngine(t, sharing).query(p, classes)) {}
+
+GCKernel::GCKernel(const GrammarCompressedStorage &p, const GrammarCompressedStorage &t,
+                   ExpansionSharing sharing):
+    lcs(GCQueryEngine(t, sharing).query(GCQueryEngine(p, sharing))) {}
+
 }  // namespace gc
 }  // namespace LCS
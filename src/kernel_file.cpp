@@ -0,0 +1,284 @@
+#include "kernel_file.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace LCS {
+namespace io {
+
+namespace {
+
+// The kinds of file contents.
+enum Kind: std::uint32_t {
+    PERMUTATION = 1,
+    LCS_KERNEL = 2,
+    KERNEL_ARCHIVE = 3,
+};
+
+struct Header {
+    char magic[4];
+    std::uint32_t version;
+    std::uint32_t kind;
+    std::uint32_t index_bytes;  // the size of the permutation index type, 0 if there are no permutations
+    std::uint64_t payload_size;
+    std::uint64_t checksum;
+};
+
+const char MAGIC[4] = {'L', 'C', 'S', 'K'};
+
+// Appends values to a payload.
+class Writer {
+public:
+    void bytes(const void *data, std::size_t size) {
+        payload.insert(payload.end(), static_cast<const char *>(data), static_cast<const char *>(data) + size);
+    }
+    void number(std::uint64_t value) { bytes(&value, sizeof(value)); }
+    void string(std::string_view s) {
+        number(s.size());
+        bytes(s.data(), s.size());
+    }
+    void record(const std::vector <char> &r) {
+        number(r.size());
+        bytes(r.data(), r.size());
+    }
+    template <typename Index>
+    void permutation(const matrix::BasicPermutation<Index> &p) {
+        static_assert(sizeof(typename matrix::BasicPermutation<Index>::Element) == 2 * sizeof(Index),
+                      "permutation elements must be stored without padding");
+        number(p.rows.size());
+        number(p.cols.size());
+        bytes(p.rows.data(), p.rows.size() * sizeof(p.rows[0]));
+        bytes(p.cols.data(), p.cols.size() * sizeof(p.cols[0]));
+    }
+
+    std::vector <char> payload;
+};
+
+// Reads values from a payload, throwing KernelFileError if they run past its end.
+class Reader {
+public:
+    Reader(const std::string &file, const char *data, std::size_t size): file(file), data(data), left(size) {}
+
+    const char *bytes(std::size_t size) {
+        if (size > left) {
+            throw KernelFileError(file, "unexpected end of payload");
+        }
+        const char *result = data;
+        data += size;
+        left -= size;
+        return result;
+    }
+    std::uint64_t number() {
+        std::uint64_t value;
+        std::memcpy(&value, bytes(sizeof(value)), sizeof(value));
+        return value;
+    }
+    std::string string() {
+        std::uint64_t size = number();
+        return std::string(bytes(size), size);
+    }
+    std::vector <char> record() {
+        std::uint64_t size = number();
+        const char *data = bytes(size);
+        return std::vector <char>(data, data + size);
+    }
+    template <typename Index>
+    matrix::BasicPermutation<Index> permutation() {
+        typedef typename matrix::BasicPermutation<Index>::Element Element;
+        std::uint64_t rows = number(), cols = number();
+        if (rows > left / sizeof(Element) || cols > left / sizeof(Element)) {
+            throw KernelFileError(file, "unexpected end of payload");
+        }
+        matrix::BasicPermutation<Index> result;
+        result.rows.resize(rows);
+        result.cols.resize(cols);
+        std::memcpy(static_cast<void *>(result.rows.data()), bytes(rows * sizeof(Element)), rows * sizeof(Element));
+        std::memcpy(static_cast<void *>(result.cols.data()), bytes(cols * sizeof(Element)), cols * sizeof(Element));
+        return result;
+    }
+private:
+    const std::string &file;
+    const char *data;
+    std::size_t left;
+};
+
+// Writes the header and the payload to a temporary file next to file, and renames it to file.
+void save(const std::string &file, Kind kind, std::uint32_t index_bytes, const std::vector <char> &payload) {
+    Header header;
+    std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = FORMAT_VERSION;
+    header.kind = kind;
+    header.index_bytes = index_bytes;
+    header.payload_size = payload.size();
+    header.checksum = content_hash(payload.data(), payload.size());
+    // The temporary file has a unique name, so that processes saving the same file do not write into each other's.
+    std::string temporary = file + ".XXXXXX";
+    int descriptor = mkstemp(&temporary[0]);
+    if (descriptor == -1) {
+        throw KernelFileError(temporary, "can not be created");
+    }
+    close(descriptor);
+    {
+        std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+        out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        out.write(payload.data(), payload.size());
+        if (!out) {
+            unlink(temporary.c_str());
+            throw KernelFileError(temporary, "can not be written");
+        }
+    }
+    if (std::rename(temporary.c_str(), file.c_str()) != 0) {
+        unlink(temporary.c_str());
+        throw KernelFileError(file, "can not be replaced");
+    }
+}
+
+// Checks the header of a mapped file and returns a reader for its payload.
+Reader open(const std::string &file, const MappedFile &mapped, Kind kind, std::uint32_t index_bytes) {
+    Header header;
+    if (mapped.size() < sizeof(header)) {
+        throw KernelFileError(file, "too short for a kernel file");
+    }
+    std::memcpy(&header, mapped.data(), sizeof(header));
+    if (std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0) {
+        throw KernelFileError(file, "not a kernel file");
+    }
+    if (header.version != FORMAT_VERSION) {
+        throw KernelFileError(file, "format version " + std::to_string(header.version) + " is not supported");
+    }
+    if (header.kind != kind || header.index_bytes != index_bytes) {
+        throw KernelFileError(file, "holds other contents");
+    }
+    if (header.payload_size != mapped.size() - sizeof(header)) {
+        throw KernelFileError(file, "has a wrong payload size");
+    }
+    const char *payload = mapped.data() + sizeof(header);
+    if (content_hash(payload, header.payload_size) != header.checksum) {
+        throw KernelFileError(file, "checksum mismatch");
+    }
+    return Reader(file, payload, header.payload_size);
+}
+
+}  // namespace
+
+MappedFile::MappedFile(const std::string &file) {
+    int descriptor = ::open(file.c_str(), O_RDONLY);
+    if (descriptor == -1) {
+        throw KernelFileError(file, "can not be opened");
+    }
+    struct stat status;
+    if (fstat(descriptor, &status) != 0) {
+        close(descriptor);
+        throw KernelFileError(file, "can not be read");
+    }
+    length = status.st_size;
+    if (length) {
+        void *result = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, descriptor, 0);
+        if (result == MAP_FAILED) {
+            close(descriptor);
+            throw KernelFileError(file, "can not be mapped");
+        }
+        mapping = static_cast<char *>(result);
+    }
+    close(descriptor);
+}
+
+MappedFile::~MappedFile() {
+    if (mapping) {
+        munmap(mapping, length);
+    }
+}
+
+std::uint64_t content_hash(const void *data, std::size_t size, std::uint64_t hash) {
+    const unsigned char *bytes = static_cast<const unsigned char *>(data);
+    for (std::size_t i = 0; i < size; ++i) {
+        hash = (hash ^ bytes[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+template <typename Index>
+void save_permutation(const std::string &file, const matrix::BasicPermutation<Index> &permutation) {
+    Writer writer;
+    writer.permutation(permutation);
+    save(file, PERMUTATION, sizeof(Index), writer.payload);
+}
+
+template <typename Index>
+matrix::BasicPermutation<Index> load_permutation(const std::string &file) {
+    MappedFile mapped(file);
+    Reader reader = open(file, mapped, PERMUTATION, sizeof(Index));
+    return reader.permutation<Index>();
+}
+
+void save_kernel(const std::string &file, const kernel::LCSKernel &kernel) {
+    Writer writer;
+    writer.string(kernel.get_a());
+    writer.string(kernel.get_b());
+    writer.permutation(kernel.get_kernel());
+    save(file, LCS_KERNEL, sizeof(unsigned), writer.payload);
+}
+
+kernel::LCSKernel load_kernel(const std::string &file) {
+    MappedFile mapped(file);
+    Reader reader = open(file, mapped, LCS_KERNEL, sizeof(unsigned));
+    std::string a = reader.string();
+    std::string b = reader.string();
+    return kernel::LCSKernel(a, b, reader.permutation<unsigned>(), kernel::Ownership::COPY);
+}
+
+template <typename Index>
+void save_archive(const std::string &file, const KernelArchive<Index> &archive) {
+    Writer writer;
+    writer.number(archive.key);
+    writer.string(archive.pattern);
+    writer.number(archive.next);
+    writer.number(archive.kernels.size());
+    for (const auto &kernel: archive.kernels) {
+        writer.number(kernel.first);
+        writer.record(kernel.second);
+    }
+    save(file, KERNEL_ARCHIVE, sizeof(Index), writer.payload);
+}
+
+template <typename Index>
+bool load_archive(const std::string &file, KernelArchive<Index> &archive) {
+    if (access(file.c_str(), F_OK) != 0) {
+        return false;
+    }
+    MappedFile mapped(file);
+    Reader reader = open(file, mapped, KERNEL_ARCHIVE, sizeof(Index));
+    archive.key = reader.number();
+    archive.pattern = reader.string();
+    archive.next = reader.number();
+    std::uint64_t count = reader.number();
+    archive.kernels.clear();
+    for (std::uint64_t i = 0; i < count; ++i) {
+        unsigned rule = reader.number();
+        archive.kernels.emplace_back(rule, reader.record());
+    }
+    return true;
+}
+
+template void save_permutation(const std::string &, const matrix::BasicPermutation<std::uint16_t> &);
+template void save_permutation(const std::string &, const matrix::BasicPermutation<std::uint32_t> &);
+template void save_permutation(const std::string &, const matrix::BasicPermutation<std::uint64_t> &);
+template matrix::BasicPermutation<std::uint16_t> load_permutation<std::uint16_t>(const std::string &);
+template matrix::BasicPermutation<std::uint32_t> load_permutation<std::uint32_t>(const std::string &);
+template matrix::BasicPermutation<std::uint64_t> load_permutation<std::uint64_t>(const std::string &);
+template void save_archive(const std::string &, const KernelArchive<std::uint16_t> &);
+template void save_archive(const std::string &, const KernelArchive<std::uint32_t> &);
+template void save_archive(const std::string &, const KernelArchive<std::uint64_t> &);
+template bool load_archive(const std::string &, KernelArchive<std::uint16_t> &);
+template bool load_archive(const std::string &, KernelArchive<std::uint32_t> &);
+template bool load_archive(const std::string &, KernelArchive<std::uint64_t> &);
+
+}  // namespace io
+}  // namespace LCS
@@ -0,0 +1,419 @@
+#include "kernel_store.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace LCS {
+namespace gc {
+
+SpillFile::SpillFile(const std::string &directory): directory(directory) {}
+
+SpillFile::~SpillFile() {
+    if (mapping) {
+        munmap(mapping, capacity);
+    }
+    if (descriptor != -1) {
+        close(descriptor);
+    }
+}
+
+std::size_t SpillFile::write(const void *data, std::size_t size) {
+    if (descriptor == -1) {
+        std::string path = directory;
+        if (path.empty()) {
+            const char *tmpdir = std::getenv("TMPDIR");
+            path = tmpdir && *tmpdir ? tmpdir : "/tmp";
+        }
+        path += "/lcs_kernels_XXXXXX";
+        descriptor = mkstemp(&path[0]);
+        if (descriptor == -1) {
+            throw std::runtime_error("can not create kernel spill file " + path);
+        }
+        unlink(path.c_str());
+    }
+    if (used + size > capacity) {
+        std::size_t new_capacity = std::max(std::max(2 * capacity, used + size), (std::size_t)1 << 20);
+        if (mapping) {
+            munmap(mapping, capacity);
+            mapping = nullptr;
+        }
+        if (ftruncate(descriptor, new_capacity) != 0) {
+            throw std::runtime_error("can not grow kernel spill file to " + std::to_string(new_capacity) + " bytes");
+        }
+        void *result = mmap(nullptr, new_capacity, PROT_READ | PROT_WRITE, MAP_SHARED, descriptor, 0);
+        if (result == MAP_FAILED) {
+            throw std::runtime_error("can not map kernel spill file of " + std::to_string(new_capacity) + " bytes");
+        }
+        mapping = static_cast<char *>(result);
+        capacity = new_capacity;
+    }
+    std::memcpy(mapping + used, data, size);
+    used += size;
+    return used - size;
+}
+
+namespace {
+
+// Returns the number of bits needed for value.
+unsigned bit_width(std::uint64_t value) {
+    unsigned width = 0;
+    for (; value; value >>= 1) {
+        ++width;
+    }
+    return width;
+}
+
+// Maps the differences ..., -2, -1, 0, 1, 2, ... to 3, 1, 0, 2, 4, ...
+std::uint64_t zigzag(std::int64_t value) {
+    return value < 0 ? 2 * (std::uint64_t)(-(value + 1)) + 1 : 2 * (std::uint64_t)value;
+}
+
+std::int64_t unzigzag(std::uint64_t value) {
+    return value & 1 ? -(std::int64_t)(value >> 1) - 1 : (std::int64_t)(value >> 1);
+}
+
+// Packs the values with the given number of bits each.
+std::vector <std::uint64_t> pack(const std::vector <std::uint64_t> &values, unsigned width) {
+    std::vector <std::uint64_t> words((values.size() * width + 63) / 64);
+    for (std::size_t i = 0, bit = 0; width && i < values.size(); ++i, bit += width) {
+        words[bit / 64] |= values[i] << (bit % 64);
+        if (bit % 64 + width > 64) {
+            words[bit / 64 + 1] |= values[i] >> (64 - bit % 64);
+        }
+    }
+    return words;
+}
+
+// Returns the i-th value packed with the given number of bits each.
+std::uint64_t unpack_value(const std::vector <std::uint64_t> &words, std::size_t i, unsigned width) {
+    if (!width) {
+        return 0;
+    }
+    std::size_t bit = i * width;
+    std::uint64_t value = words[bit / 64] >> (bit % 64);
+    if (bit % 64 + width > 64) {
+        value |= words[bit / 64 + 1] << (64 - bit % 64);
+    }
+    return width == 64 ? value : value & ((std::uint64_t(1) << width) - 1);
+}
+
+}  // namespace
+
+template <typename Index>
+PackedKernel<Index>::PackedKernel(const matrix::BasicPermutation<Index> &kernel): size(kernel.rows.size()) {
+    for (std::uint64_t j = 0; dense && j < size; ++j) {
+        dense = kernel.rows[j].first == size - j && kernel.cols[j].first == j + 1;
+    }
+    std::vector <std::uint64_t> values;
+    values.reserve(dense ? size : 2 * size);
+    for (const auto &element: kernel.rows) {
+        if (dense) {
+            values.push_back(zigzag((std::int64_t)element.second - (std::int64_t)element.first));
+        } else {
+            values.push_back(element.first);
+            values.push_back(element.second);
+        }
+    }
+    width = bit_width(values.empty() ? 0 : *std::max_element(values.begin(), values.end()));
+    words = pack(values, width);
+}
+
+template <typename Index>
+matrix::BasicPermutation<Index> PackedKernel<Index>::unpack() const {
+    matrix::BasicPermutation<Index> kernel;
+    kernel.rows.resize(size);
+    kernel.cols.resize(size);
+    for (std::uint64_t j = 0; j < size; ++j) {
+        if (dense) {
+            std::int64_t column = (std::int64_t)(size - j) + unzigzag(unpack_value(words, j, width));
+            if (column < 1 || (std::uint64_t)column > size) {
+                throw std::runtime_error("packed kernel has column " + std::to_string(column) + " outside 1.." +
+                                         std::to_string(size));
+            }
+            Index row = size - j, col = column;
+            kernel.rows[j] = {row, col};
+            kernel.cols[col - 1] = {col, row};
+        } else {
+            Index row = unpack_value(words, 2 * j, width), col = unpack_value(words, 2 * j + 1, width);
+            kernel.rows[j] = {row, col};
+            kernel.cols[j] = {col, row};
+        }
+    }
+    if (!dense) {
+        std::sort(kernel.cols.begin(), kernel.cols.end());
+    }
+    return kernel;
+}
+
+template <typename Index>
+void PackedKernel<Index>::write(std::vector <char> &out) const {
+    // The number of elements, the kind and width of the values, and the packed words.
+    std::size_t start = out.size();
+    std::uint64_t header[2] = {size, (std::uint64_t)dense << 8 | width};
+    out.resize(start + sizeof(header) + words.size() * sizeof(std::uint64_t));
+    std::memcpy(out.data() + start, header, sizeof(header));
+    std::memcpy(out.data() + start + sizeof(header), words.data(), words.size() * sizeof(std::uint64_t));
+}
+
+template <typename Index>
+PackedKernel<Index> PackedKernel<Index>::read(const char *record, std::size_t size) {
+    std::uint64_t header[2];
+    if (size < sizeof(header)) {
+        throw std::runtime_error("packed kernel record of " + std::to_string(size) + " bytes is too short");
+    }
+    std::memcpy(header, record, sizeof(header));
+    // Values of a nonzero width take a bit each at least, which bounds their number by the words in the record.
+    std::uint64_t width = header[1] & 255, words = (size - sizeof(header)) / sizeof(std::uint64_t);
+    std::uint64_t values = header[0] <= words * 64 ? ((header[1] >> 8) ? 1 : 2) * header[0] : 0;
+    if (width > 64 || (width && header[0] > words * 64) ||
+        sizeof(header) + (values * width + 63) / 64 * sizeof(std::uint64_t) != size) {
+        throw std::runtime_error("packed kernel record of " + std::to_string(size) + " bytes is damaged");
+    }
+    return read(record);
+}
+
+template <typename Index>
+PackedKernel<Index> PackedKernel<Index>::read(const char *record) {
+    PackedKernel result;
+    std::uint64_t header[2];
+    std::memcpy(header, record, sizeof(header));
+    result.size = header[0];
+    result.dense = header[1] >> 8;
+    result.width = header[1] & 255;
+    result.words.resize(((result.dense ? 1 : 2) * result.size * result.width + 63) / 64);
+    std::memcpy(result.words.data(), record + sizeof(header), result.words.size() * sizeof(std::uint64_t));
+    return result;
+}
+
+template <typename Index>
+KernelStore<Index>::KernelStore(std::size_t memory_budget, const std::string &spill_directory, bool packing):
+    memory_budget(memory_budget), spill_directory(spill_directory), packing(packing) {}
+
+template <typename Index>
+void KernelStore<Index>::configure(std::size_t memory_budget, const std::string &spill_directory, bool packing) {
+    this->memory_budget = memory_budget;
+    this->packing = packing;
+    if (spill_directory != this->spill_directory) {
+        this->spill_directory = spill_directory;
+        file.reset();
+    }
+}
+
+template <typename Index>
+void KernelStore<Index>::reset(unsigned n) {
+    kernels.clear();
+    kernels.resize(packing ? 0 : n);
+    packed.clear();
+    packed.resize(packing ? n : 0);
+    pinned.clear();
+    unpacked.clear();
+    uses.assign(n, 0);
+    stored.clear();
+    last_used.assign(n, 0);
+    offsets.assign(n, NOT_SPILLED);
+    in_memory.assign(n, 0);
+    eviction.clear();
+    clock = 0;
+    resident = 0;
+    stats = KernelStats();
+    if (file) {
+        file->clear();
+    }
+}
+
+template <typename Index>
+std::size_t KernelStore<Index>::bytes(const matrix::BasicPermutation<Index> &kernel) {
+    return (kernel.rows.capacity() + kernel.cols.capacity()) * sizeof(typename matrix::BasicPermutation<Index>::Element);
+}
+
+template <typename Index>
+void KernelStore<Index>::touch(unsigned i) {
+    eviction.erase(key(i));
+    last_used[i] = ++clock;
+    eviction.insert(key(i));
+}
+
+template <typename Index>
+void KernelStore<Index>::add_resident(unsigned i) {
+    in_memory[i] = 1;
+    resident += kernel_bytes(i);
+    stats.peak_bytes = std::max(stats.peak_bytes, resident);
+}
+
+template <typename Index>
+void KernelStore<Index>::drop(unsigned i) {
+    resident -= kernel_bytes(i);
+    if (packing) {
+        packed[i] = PackedKernel<Index>();
+    } else {
+        kernels[i] = matrix::BasicPermutation<Index>();
+    }
+    in_memory[i] = 0;
+}
+
+template <typename Index>
+void KernelStore<Index>::put(unsigned i, matrix::BasicPermutation<Index> &&kernel, unsigned uses) {
+    unpin();
+    if (packing) {
+        packed[i] = PackedKernel<Index>(kernel);
+    } else {
+        kernels[i] = std::move(kernel);
+    }
+    this->uses[i] = uses;
+    stored.insert(i);
+    add_resident(i);
+    touch(i);
+    trim();
+}
+
+template <typename Index>
+const matrix::BasicPermutation<Index> &KernelStore<Index>::get(unsigned i) {
+    if (!in_memory[i]) {
+        PackedKernel<Index> kernel = PackedKernel<Index>::read(file->read(offsets[i]));
+        if (packing) {
+            packed[i] = std::move(kernel);
+        } else {
+            kernels[i] = kernel.unpack();
+        }
+        add_resident(i);
+    }
+    touch(i);
+    pin(i);
+    if (!packing) {
+        trim();
+        return kernels[i];
+    }
+    for (const auto &kernel: unpacked) {
+        if (kernel.first == i) {
+            return kernel.second;
+        }
+    }
+    unpacked.emplace_back(i, packed[i].unpack());
+    resident += bytes(unpacked.back().second);
+    stats.peak_bytes = std::max(stats.peak_bytes, resident);
+    trim();
+    return unpacked.back().second;
+}
+
+template <typename Index>
+void KernelStore<Index>::pin(unsigned i) {
+    eviction.erase(key(i));
+    auto it = std::find(pinned.begin(), pinned.end(), i);
+    if (it != pinned.end()) {
+        pinned.erase(it);
+    } else if (pinned.size() == PINNED) {
+        unsigned oldest = pinned.front();
+        pinned.pop_front();
+        if (in_memory[oldest]) {
+            eviction.insert(key(oldest));
+        }
+        // At most PINNED copies are unpacked, so the copy of the oldest one is at an end and erasing it
+        // leaves the references to the others valid.
+        for (auto copy = unpacked.begin(); copy != unpacked.end(); ++copy) {
+            if (copy->first == oldest) {
+                resident -= bytes(copy->second);
+                unpacked.erase(copy);
+                break;
+            }
+        }
+    }
+    pinned.push_back(i);
+}
+
+template <typename Index>
+void KernelStore<Index>::unpin() {
+    for (unsigned i: pinned) {
+        if (in_memory[i]) {
+            eviction.insert(key(i));
+        }
+    }
+    pinned.clear();
+    for (const auto &kernel: unpacked) {
+        resident -= bytes(kernel.second);
+    }
+    unpacked.clear();
+}
+
+template <typename Index>
+bool KernelStore<Index>::release(unsigned i) {
+    if (in_memory[i]) {
+        eviction.erase(key(i));
+    }
+    if (--uses[i]) {
+        if (in_memory[i] && std::find(pinned.begin(), pinned.end(), i) == pinned.end()) {
+            eviction.insert(key(i));
+        }
+        return false;
+    }
+    stored.erase(i);
+    if (in_memory[i]) {
+        drop(i);
+    }
+    return true;
+}
+
+template <typename Index>
+matrix::BasicPermutation<Index> KernelStore<Index>::take(unsigned i) {
+    const matrix::BasicPermutation<Index> &kernel = get(i);
+    eviction.erase(key(i));
+    uses[i] = 0;
+    stored.erase(i);
+    resident -= kernel_bytes(i);
+    in_memory[i] = 0;
+    matrix::BasicPermutation<Index> result;
+    if (packing) {
+        result = kernel;
+        packed[i] = PackedKernel<Index>();
+    } else {
+        result = std::move(kernels[i]);
+    }
+    unpin();
+    return result;
+}
+
+template <typename Index>
+void KernelStore<Index>::write(unsigned i, std::vector <char> &out) const {
+    if (!in_memory[i]) {
+        PackedKernel<Index>::read(file->read(offsets[i])).write(out);
+    } else if (packing) {
+        packed[i].write(out);
+    } else {
+        PackedKernel<Index>(kernels[i]).write(out);
+    }
+}
+
+template <typename Index>
+void KernelStore<Index>::trim() {
+    while (memory_budget && resident > memory_budget && !eviction.empty()) {
+        unsigned i = std::get<2>(*eviction.begin());
+        eviction.erase(eviction.begin());
+        if (offsets[i] == NOT_SPILLED) {
+            if (!file) {
+                file.reset(new SpillFile(spill_directory));
+            }
+            std::vector <char> record;
+            (packing ? packed[i] : PackedKernel<Index>(kernels[i])).write(record);
+            offsets[i] = file->write(record.data(), record.size());
+            ++stats.spilled;
+        }
+        drop(i);
+    }
+}
+
+template class PackedKernel<std::uint16_t>;
+template class PackedKernel<std::uint32_t>;
+template class PackedKernel<std::uint64_t>;
+template class KernelStore<std::uint16_t>;
+template class KernelStore<std::uint32_t>;
+template class KernelStore<std::uint64_t>;
+
+}  // namespace gc
+}  // namespace LCS
@@ -2,17 +2,53 @@
 
 #include <iostream>
 #include <algorithm>
+#include <atomic>
+#include <functional>
 #include <numeric>
+#include <stdexcept>
+#include <thread>
+
+#include "combing_tables.h"
 
 namespace LCS {
 namespace kernel {
 
-unsigned dp_lcs(const std::string &a, const std::string &b) {
+CharClasses::CharClasses() {
+    for (unsigned c = 0; c < representative.size(); ++c) {
+        representative[c] = c;
+    }
+}
+
+CharClasses CharClasses::case_insensitive() {
+    CharClasses classes;
+    for (char c = 'a'; c <= 'z'; ++c) {
+        const char letter[2] = {c, (char)(c - 'a' + 'A')};
+        classes.join(std::string_view(letter, 2));
+    }
+    return classes;
+}
+
+CharClasses &CharClasses::join(std::string_view characters) {
+    if (characters.empty()) {
+        return *this;
+    }
+    unsigned char joined = class_of(characters[0]);
+    for (char c: characters) {
+        unsigned char old = class_of(c);
+        if (old != joined) {
+            std::replace(representative.begin(), representative.end(), old, joined);
+        }
+    }
+    return *this;
+}
+
+template <typename Symbol, typename Match>
+unsigned dp_lcs(SymbolSpan<Symbol> a, SymbolSpan<Symbol> b, const Match &match) {
     std::vector <std::vector <unsigned>> lcs(a.size() + 1, std::vector <unsigned>(b.size() + 1, 0));
     for (unsigned i = 0; i < a.size(); ++i) {
         for (unsigned j = 0; j < b.size(); ++j) {
             lcs[i + 1][j + 1] = std::max(lcs[i][j + 1], lcs[i + 1][j]);
-            if (a[i] == b[j]) {
+            if (match(a[i], b[j])) {
                 lcs[i + 1][j + 1] = std::max(lcs[i + 1][j + 1], lcs[i][j] + 1);
             }
         }
@@ -20,17 +56,189 @@ unsigned dp_lcs(const std::string &a, const std::string &b) {
     return lcs[a.size()][b.size()];
 }
 
-LCSKernel::LCSKernel(const std::string &a, const std::string &b, const matrix::MongeMatrix &kernel_sum): 
-                                                                                    a(a),
-                                                                                    b(b),
-                                                                                    kernel_sum(kernel_sum) {}
+namespace {
+
+// Combs the braid of a[a_l:a_r) and b[b_l:b_r) as in IterativeLCS, keeping only the strands at its bottom and right.
+// Left strands are numbered from a_r - a_l - 1 down to 0 and top strands from a_r - a_l up, left to right.
+template <typename Symbol, typename Match>
+void comb_braid(SymbolSpan<Symbol> a, SymbolSpan<Symbol> b, const Match &match,
+                unsigned a_l, unsigned a_r, unsigned b_l, unsigned b_r,
+                std::vector <unsigned> &last_row, std::vector <unsigned> &last_col) {
+    last_row.resize(b_r - b_l);
+    last_col.resize(a_r - a_l);
+    std::iota(last_row.begin(), last_row.end(), a_r - a_l);
+    for (unsigned i = a_l; i < a_r; ++i) {
+        unsigned strand = a_r - i - 1;
+        for (unsigned j = b_l; j < b_r; ++j) {
+            if (match(a[i], b[j]) || strand > last_row[j - b_l]) {
+                std::swap(strand, last_row[j - b_l]);
+            }
+        }
+        last_col[i - a_l] = strand;
+    }
+}
+
+// Returns the length of the prefix of b[b_l:b_r) to match with a[a_l:a_m) in an lcs of a[a_l:a_r) and b[b_l:b_r).
+template <typename Symbol, typename Match>
+unsigned split_point(SymbolSpan<Symbol> a, SymbolSpan<Symbol> b, const Match &match,
+                     unsigned a_l, unsigned a_m, unsigned a_r, unsigned b_l, unsigned b_r) {
+    unsigned n = b_r - b_l;
+    std::vector <unsigned> last_row, last_col;
+    // lcs(a[a_l:a_m), b[b_l:b_l + j)) is the number of left strands that end at the bottom before column j.
+    std::vector <unsigned> prefix(n + 1, 0);
+    comb_braid(a, b, match, a_l, a_m, b_l, b_r, last_row, last_col);
+    for (unsigned j = 0; j < n; ++j) {
+        prefix[j + 1] = prefix[j] + (last_row[j] < a_m - a_l);
+    }
+    // lcs(a[a_m:a_r), b[b_l + j:b_r)) is the number of top strands from column j or later that end at the right.
+    std::vector <unsigned> suffix(n + 1, 0);
+    comb_braid(a, b, match, a_m, a_r, b_l, b_r, last_row, last_col);
+    for (unsigned strand: last_col) {
+        if (strand >= a_r - a_m) {
+            ++suffix[strand - (a_r - a_m)];
+        }
+    }
+    for (unsigned j = n; j-- > 0;) {
+        suffix[j] += suffix[j + 1];
+    }
+    unsigned split = 0;
+    for (unsigned j = 1; j <= n; ++j) {
+        if (prefix[j] + suffix[j] > prefix[split] + suffix[split]) {
+            split = j;
+        }
+    }
+    return split;
+}
 
-RecursiveLCS::RecursiveLCS(const std::string &a, const std::string &b, unsigned recursion_base): LCSKernel(a, b,
-    matrix::MongeMatrix(calculate_kernel(recursion_base, a, b, 0, a.size(), 0, b.size())
-                                            .expand(a.size() + b.size(), a.size() + b.size()))) {}
+// Appends the matched pairs of an lcs of a[a_l:a_r) and b[b_l:b_r) to result.
+template <typename Symbol, typename Match>
+void align(SymbolSpan<Symbol> a, SymbolSpan<Symbol> b, const Match &match,
+           unsigned a_l, unsigned a_r, unsigned b_l, unsigned b_r,
+           unsigned threads, std::vector <std::pair <unsigned, unsigned> > &result) {
+    if (a_l == a_r || b_l == b_r) {
+        return;
+    }
+    if (a_l + 1 == a_r) {
+        for (unsigned j = b_l; j < b_r; ++j) {
+            if (match(a[a_l], b[j])) {
+                result.push_back({a_l, j});
+                return;
+            }
+        }
+        return;
+    }
+    unsigned a_m = (a_l + a_r) / 2;
+    unsigned b_m = b_l + split_point(a, b, match, a_l, a_m, a_r, b_l, b_r);
+    if (threads > 1) {
+        std::vector <std::pair <unsigned, unsigned> > second_half;
+        std::thread worker(align<Symbol, Match>, a, b, std::cref(match), a_m, a_r, b_m, b_r, threads / 2,
+                           std::ref(second_half));
+        align(a, b, match, a_l, a_m, b_l, b_m, threads - threads / 2, result);
+        worker.join();
+        result.insert(result.end(), second_half.begin(), second_half.end());
+    } else {
+        align(a, b, match, a_l, a_m, b_l, b_m, 1, result);
+        align(a, b, match, a_m, a_r, b_m, b_r, 1, result);
+    }
+}
+
+}  // namespace
+
+template <typename Symbol, typename Match>
+std::vector <std::pair <unsigned, unsigned> > lcs_alignment(SymbolSpan<Symbol> a, SymbolSpan<Symbol> b,
+                                                            unsigned threads, const Match &match) {
+    std::vector <std::pair <unsigned, unsigned> > result;
+    align(a, b, match, 0, a.size(), 0, b.size(), std::max(threads, 1u), result);
+    return result;
+}
 
-IterativeLCS::IterativeLCS(const std::string &a, const std::string &b):
-                                            LCSKernel(a, b, calculate_iterative_kernel(a, b)) {}
+LCSKernel::LCSKernel(std::string_view a, std::string_view b, const matrix::MongeMatrix &kernel_sum,
+                     Ownership ownership):
+    ownership(ownership),
+    owned_a(ownership == Ownership::COPY ? a : std::string_view()),
+    owned_b(ownership == Ownership::COPY ? b : std::string_view()),
+    a(ownership == Ownership::COPY ? std::string_view(owned_a) : a),
+    b(ownership == Ownership::COPY ? std::string_view(owned_b) : b),
+    kernel_sum(kernel_sum) {}
+
+LCSKernel::LCSKernel(std::string_view a, std::string_view b, const matrix::Permutation &kernel, Ownership ownership):
+    LCSKernel(a, b, matrix::MongeMatrix(kernel.expand(a.size() + b.size(), a.size() + b.size())), ownership) {}
+
+LCSKernel::LCSKernel(const LCSKernel &other): LCSKernel(other.a, other.b, other.kernel_sum, other.ownership) {}
+
+matrix::Permutation LCSKernel::get_kernel() const {
+    return matrix::Permutation(matrix::PermutationMatrix(kernel_sum));
+}
+
+matrix::Permutation concat_kernels(const matrix::Permutation &first, const matrix::Permutation &second,
+                                   unsigned size) {
+    matrix::Permutation first_half = first, second_half = second;
+    first_half.grow_back(size);
+    second_half.grow_front(size);
+    return first_half * second_half;
+}
+
+LCSKernel concat(const LCSKernel &first, const LCSKernel &second) {
+    if (first.get_a() != second.get_a()) {
+        throw std::invalid_argument("LCS kernels for different strings can not be concatenated");
+    }
+    std::string_view a = first.get_a();
+    std::string b(first.get_b());
+    b += second.get_b();
+    return LCSKernel(a, b, concat_kernels(first.get_kernel(), second.get_kernel(), a.size() + b.size()),
+                     Ownership::COPY);
+}
+
+template <typename Symbol, typename Match>
+matrix::Permutation RecursiveLCS::kernel(SymbolSpan<Symbol> a, SymbolSpan<Symbol> b, unsigned recursion_base,
+                                         const Match &match) {
+    auto base_case = [&](unsigned a_l, unsigned a_r, unsigned b_l, unsigned b_r) {
+        return calculate_recursion_base(a, b, match, a_l, a_r, b_l, b_r);
+    };
+    return calculate_kernel(recursion_base, base_case, 0, a.size(), 0, b.size());
+}
+
+matrix::Permutation RecursiveLCS::kernel(std::string_view a, std::string_view b, unsigned recursion_base,
+                                         BaseCase base_case) {
+    if (base_case == BaseCase::COMBING) {
+        return kernel(a, b, recursion_base);
+    }
+    // Every base block could fit the tables while the strings do not.
+    CombingTables::check_alphabet(a, b);
+    const CombingTables &tables = CombingTables::get();
+    auto comb = [&](unsigned a_l, unsigned a_r, unsigned b_l, unsigned b_r) {
+        return tables.comb(a.substr(a_l, a_r - a_l), b.substr(b_l, b_r - b_l));
+    };
+    return calculate_kernel(recursion_base, comb, 0, a.size(), 0, b.size());
+}
+
+RecursiveLCS::RecursiveLCS(std::string_view a, std::string_view b, unsigned recursion_base,
+                           Ownership ownership): LCSKernel(a, b,
+    matrix::MongeMatrix(kernel(a, b, recursion_base).expand(a.size() + b.size(), a.size() + b.size())), ownership) {}
+
+RecursiveLCS::RecursiveLCS(std::string_view a, std::string_view b, const CharClasses &classes,
+                           unsigned recursion_base, Ownership ownership): LCSKernel(a, b,
+    matrix::MongeMatrix(kernel(a, b, classes, recursion_base).expand(a.size() + b.size(), a.size() + b.size())),
+    ownership) {}
+
+RecursiveLCS::RecursiveLCS(std::string_view a, std::string_view b, unsigned recursion_base, BaseCase base_case,
+                           Ownership ownership): LCSKernel(a, b,
+    matrix::MongeMatrix(kernel(a, b, recursion_base, base_case).expand(a.size() + b.size(), a.size() + b.size())),
+    ownership) {}
+
+IterativeLCS::IterativeLCS(std::string_view a, std::string_view b, Ownership ownership):
+    LCSKernel(a, b, kernel(a, b), ownership) {}
+
+IterativeLCS::IterativeLCS(std::string_view a, std::string_view b, unsigned threads, Ownership ownership):
+    LCSKernel(a, b, kernel(a, b, threads), ownership) {}
+
+IterativeLCS::IterativeLCS(std::string_view a, std::string_view b, const CharClasses &classes, Ownership ownership):
+    LCSKernel(a, b, calculate_iterative_kernel<char>(a, b, classes, 1), ownership) {}
+
+template <typename Symbol>
+matrix::Permutation IterativeLCS::kernel(SymbolSpan<Symbol> a, SymbolSpan<Symbol> b, unsigned threads) {
+    return calculate_iterative_kernel(a, b, std::equal_to<Symbol>(), threads);
+}
 
 unsigned LCSKernel::lcs_whole_a(unsigned b_l, unsigned b_r) const {
     return b_r - b_l - kernel_sum(b_l + a.size(), b_r);
@@ -48,8 +256,10 @@ unsigned LCSKernel::lcs_prefix_a_suffix_b(unsigned a_r, unsigned b_l) const {
     return b.size() - b_l - kernel_sum(b_l + a.size(), a.size() + b.size() - a_r);
 }
 
-matrix::Permutation RecursiveLCS::calculate_recursion_base(const std::string &a,
-                                                           const std::string &b,
+template <typename Symbol, typename Match>
+matrix::Permutation RecursiveLCS::calculate_recursion_base(SymbolSpan<Symbol> a,
+                                                           SymbolSpan<Symbol> b,
+                                                           const Match &match,
                                                            unsigned a_l, unsigned a_r,
                                                            unsigned b_l, unsigned b_r) {
     std::vector <unsigned> last_row(b_r - b_l); //  The index of the braid strand at the end of row i.
@@ -61,7 +271,7 @@ matrix::Permutation RecursiveLCS::calculate_recursion_base(const std::string &a,
             // The braid strands should not cross if the string symbols match,
             // or if they have already crossed previously.
             // They have crossed previously if the natural ordering is ruined.
-            if (a[i] == b[j] || last_col[i - a_l] > last_row[j - b_l]) {
+            if (match(a[i], b[j]) || last_col[i - a_l] > last_row[j - b_l]) {
                 std::swap(last_col[i - a_l], last_row[j - b_l]);  // uncross the two strands
             }
         }
@@ -77,56 +287,139 @@ matrix::Permutation RecursiveLCS::calculate_recursion_base(const std::string &a,
     return matrix::Permutation{result};
 }
 
+template <typename Base>
 matrix::Permutation RecursiveLCS::calculate_kernel(unsigned recursion_base,
-                                                   const std::string &a,
-                                                   const std::string &b,
+                                                   const Base &base_case,
                                                    unsigned a_l, unsigned a_r,
                                                    unsigned b_l, unsigned b_r) {
     unsigned sum_length = a_r - a_l + b_r - b_l;
     if (sum_length <= recursion_base) {
-        return calculate_recursion_base(a, b, a_l, a_r, b_l, b_r);
+        return base_case(a_l, a_r, b_l, b_r);
     } else if (a_l + 1 < a_r) {  // split by row
         unsigned a_m  = (a_l + a_r) / 2;
-        matrix::Permutation first_half = calculate_kernel(recursion_base, a, b, a_l, a_m, b_l, b_r);
-        matrix::Permutation second_half = calculate_kernel(recursion_base, a, b, a_m, a_r, b_l, b_r);
+        matrix::Permutation first_half = calculate_kernel(recursion_base, base_case, a_l, a_m, b_l, b_r);
+        matrix::Permutation second_half = calculate_kernel(recursion_base, base_case, a_m, a_r, b_l, b_r);
         first_half.grow_front(sum_length);
         second_half.grow_back(sum_length);
         return first_half * second_half;
     } else {  // first string has length 1 (split by column)
         unsigned b_m  = (b_l + b_r) / 2;
-        matrix::Permutation first_half = calculate_kernel(recursion_base, a, b, a_l, a_r, b_l, b_m);
-        matrix::Permutation second_half = calculate_kernel(recursion_base, a, b, a_l, a_r, b_m, b_r);
+        matrix::Permutation first_half = calculate_kernel(recursion_base, base_case, a_l, a_r, b_l, b_m);
+        matrix::Permutation second_half = calculate_kernel(recursion_base, base_case, a_l, a_r, b_m, b_r);
         first_half.grow_back(sum_length);
         second_half.grow_front(sum_length);
         return first_half * second_half;
     }
 }
 
-matrix::MongeMatrix IterativeLCS::calculate_iterative_kernel(const std::string &a, const std::string &b) {
-    std::vector <unsigned> last_row(b.size()); //  The index of the braid strand at the end of row i.
-    std::vector <unsigned> last_col(a.size()); //  The index of the braid strand at the end of col i.
-    std::iota(last_row.begin(), last_row.end(), a.size());
-    for (unsigned i = 0; i < a.size(); ++i) {
-        last_col[i] = a.size() - i - 1;
-        for (unsigned j = 0; j < b.size(); ++j) {
-            // The braid strands should not cross if the string symbols match,
-            // or if they have already crossed previously.
-            // They have crossed previously if the natural ordering is ruined.
-            if (a[i] == b[j] || last_col[i] > last_row[j]) {
-                std::swap(last_col[i], last_row[j]);  // uncross the two strands
+template <typename Symbol, typename Match>
+matrix::Permutation IterativeLCS::calculate_iterative_kernel(SymbolSpan<Symbol> a, SymbolSpan<Symbol> b,
+                                                             const Match &match, unsigned threads) {
+    unsigned m = a.size(), n = b.size();
+    std::vector <unsigned> last_row(n); //  The index of the braid strand at the end of row i.
+    std::vector <unsigned> last_col(m); //  The index of the braid strand at the end of col i.
+    std::iota(last_row.begin(), last_row.end(), m);
+    for (unsigned i = 0; i < m; ++i) {
+        last_col[i] = m - i - 1;
+    }
+    // Every thread needs a row of tiles of its own, so with fewer than threads rows of tiles,
+    // the rows of a are split evenly into threads shorter rows of tiles.
+    threads = std::max(1u, std::min(threads, m));
+    unsigned height = TILE;
+    if (threads > 1 && m < threads * TILE) {
+        height = (m + threads - 1) / threads;
+    }
+    // Comb the tile in row r and column c of the tiles. The strands entering it from the left and from above
+    // are at the ends of its rows and columns, and the strands leaving it take their places.
+    auto comb_tile = [&](unsigned r, unsigned c) {
+        unsigned i_r = std::min(m, (r + 1) * height), j_r = std::min(n, (c + 1) * TILE);
+        for (unsigned i = r * height; i < i_r; ++i) {
+            unsigned strand = last_col[i];
+            for (unsigned j = c * TILE; j < j_r; ++j) {
+                // The braid strands should not cross if the string symbols match,
+                // or if they have already crossed previously.
+                // They have crossed previously if the natural ordering is ruined.
+                // The strands are exchanged by a mask rather than a branch, which would be mispredicted
+                // on every other cell of random strings.
+                unsigned top = last_row[j];
+                unsigned uncross = -(unsigned(match(a[i], b[j])) | unsigned(strand > top));
+                unsigned exchange = (strand ^ top) & uncross;
+                last_row[j] = top ^ exchange;
+                strand ^= exchange;
+            }
+            last_col[i] = strand;
+        }
+    };
+    unsigned tile_rows = (m + height - 1) / height, tile_cols = (n + TILE - 1) / TILE;
+    threads = std::max(1u, std::min(threads, tile_rows));
+    if (threads == 1) {
+        for (unsigned r = 0; r < tile_rows; ++r) {
+            for (unsigned c = 0; c < tile_cols; ++c) {
+                comb_tile(r, c);
+            }
+        }
+    } else {
+        // Every thread combs every threads-th row of tiles, each tile once the row above has combed past it.
+        std::vector <std::atomic <unsigned> > combed(tile_rows);  // the number of combed tiles of every row
+        auto comb_rows = [&](unsigned first) {
+            for (unsigned r = first; r < tile_rows; r += threads) {
+                for (unsigned c = 0; c < tile_cols; ++c) {
+                    while (r > 0 && combed[r - 1].load(std::memory_order_acquire) <= c) {
+                        std::this_thread::yield();
+                    }
+                    comb_tile(r, c);
+                    combed[r].store(c + 1, std::memory_order_release);
+                }
             }
+        };
+        std::vector <std::thread> workers;
+        for (unsigned t = 1; t < threads; ++t) {
+            workers.emplace_back(comb_rows, t);
+        }
+        comb_rows(0);
+        for (auto &worker: workers) {
+            worker.join();
         }
     }
     // Restore the kernel permutation from the braid.
-    std::vector <unsigned> result(a.size() + b.size());
-    for (unsigned i = 0; i < a.size(); ++i) {
-        result[last_col[i]] = a.size() + b.size() - i;
+    std::vector <unsigned> result(m + n);
+    for (unsigned i = 0; i < m; ++i) {
+        result[last_col[i]] = m + n - i;
     }
-    for (unsigned i = 0; i < b.size(); ++i) {
+    for (unsigned i = 0; i < n; ++i) {
         result[last_row[i]] = i + 1;
     }
-    return matrix::MongeMatrix(matrix::PermutationMatrix(result.size(), result.size(), result));
+    return matrix::Permutation{result};
 }
 
+template unsigned dp_lcs(SymbolSpan<char>, SymbolSpan<char>, const std::equal_to<char> &);
+template unsigned dp_lcs(SymbolSpan<std::uint8_t>, SymbolSpan<std::uint8_t>, const std::equal_to<std::uint8_t> &);
+template unsigned dp_lcs(SymbolSpan<std::uint16_t>, SymbolSpan<std::uint16_t>, const std::equal_to<std::uint16_t> &);
+template unsigned dp_lcs(SymbolSpan<std::uint32_t>, SymbolSpan<std::uint32_t>, const std::equal_to<std::uint32_t> &);
+template unsigned dp_lcs(SymbolSpan<char>, SymbolSpan<char>, const CharClasses &);
+template std::vector <std::pair <unsigned, unsigned> > lcs_alignment(SymbolSpan<char>, SymbolSpan<char>, unsigned,
+                                                                     const std::equal_to<char> &);
+template std::vector <std::pair <unsigned, unsigned> > lcs_alignment(SymbolSpan<std::uint8_t>, SymbolSpan<std::uint8_t>,
+                                                                     unsigned, const std::equal_to<std::uint8_t> &);
+template std::vector <std::pair <unsigned, unsigned> > lcs_alignment(SymbolSpan<std::uint16_t>, SymbolSpan<std::uint16_t>,
+                                                                     unsigned, const std::equal_to<std::uint16_t> &);
+template std::vector <std::pair <unsigned, unsigned> > lcs_alignment(SymbolSpan<std::uint32_t>, SymbolSpan<std::uint32_t>,
+                                                                     unsigned, const std::equal_to<std::uint32_t> &);
+template std::vector <std::pair <unsigned, unsigned> > lcs_alignment(SymbolSpan<char>, SymbolSpan<char>, unsigned,
+                                                                     const CharClasses &);
+template matrix::Permutation RecursiveLCS::kernel(SymbolSpan<char>, SymbolSpan<char>, unsigned,
+                                                  const std::equal_to<char> &);
+template matrix::Permutation RecursiveLCS::kernel(SymbolSpan<std::uint8_t>, SymbolSpan<std::uint8_t>, unsigned,
+                                                  const std::equal_to<std::uint8_t> &);
+template matrix::Permutation RecursiveLCS::kernel(SymbolSpan<std::uint16_t>, SymbolSpan<std::uint16_t>, unsigned,
+                                                  const std::equal_to<std::uint16_t> &);
+template matrix::Permutation RecursiveLCS::kernel(SymbolSpan<std::uint32_t>, SymbolSpan<std::uint32_t>, unsigned,
+                                                  const std::equal_to<std::uint32_t> &);
+template matrix::Permutation RecursiveLCS::kernel(SymbolSpan<char>, SymbolSpan<char>, unsigned, const CharClasses &);
+template matrix::Permutation IterativeLCS::kernel(SymbolSpan<char>, SymbolSpan<char>, unsigned);
+template matrix::Permutation IterativeLCS::kernel(SymbolSpan<std::uint8_t>, SymbolSpan<std::uint8_t>, unsigned);
+template matrix::Permutation IterativeLCS::kernel(SymbolSpan<std::uint16_t>, SymbolSpan<std::uint16_t>, unsigned);
+template matrix::Permutation IterativeLCS::kernel(SymbolSpan<std::uint32_t>, SymbolSpan<std::uint32_t>, unsigned);
+
 }  // namespace kernel
 }  // namespace LCS
@@ -1,5 +1,8 @@
 #include "monge_matrix.h"
 
+#include <algorithm>
+#include <iterator>
+
 namespace LCS {
 namespace matrix {
 
@@ -64,9 +67,10 @@ unsigned PermutationMatrix::operator() (unsigned x, unsigned y) const {
 
 // Grows the permutation to the required size by adding trivial elements to its end.
 // Takes O(new_size) time.
-void Permutation::grow_back(unsigned new_cols) {
-    unsigned max_col = cols.back().first;
-    unsigned max_row = rows[0].first;
+template <typename Index>
+void BasicPermutation<Index>::grow_back(Index new_cols) {
+    Index max_col = cols.back().first;
+    Index max_row = rows[0].first;
     if (new_cols == max_col) {
         return;
     } else if (new_cols < max_col) {
@@ -74,7 +78,7 @@ void Permutation::grow_back(unsigned new_cols) {
             "new column size " + std::to_string(new_cols));
     }
     rows.insert(rows.begin(), new_cols - max_col, {0, 0});
-    for (unsigned add = 1; add <= new_cols - max_col; ++add) {
+    for (Index add = 1; add <= new_cols - max_col; ++add) {
         cols.push_back({max_col + add, max_row + add});
         rows[new_cols - max_col - add] = {max_row + add, max_col + add};
     }
@@ -82,8 +86,9 @@ void Permutation::grow_back(unsigned new_cols) {
 
 // Grows the permutation to the required size by adding trivial elements to its front.
 // Takes O(new_size) time.
-void Permutation::grow_front(unsigned new_rows) {
-    unsigned max_row = rows[0].first;
+template <typename Index>
+void BasicPermutation<Index>::grow_front(Index new_rows) {
+    Index max_row = rows[0].first;
     if (new_rows == max_row) {
         return;
     } else if (new_rows <= max_row) {
@@ -99,7 +104,7 @@ void Permutation::grow_front(unsigned new_rows) {
         i.second += (new_rows - max_row);
     }
     cols.insert(cols.begin(), new_rows - max_row, {0, 0});
-    for (unsigned add = new_rows - max_row; add > 0; --add) {
+    for (Index add = new_rows - max_row; add > 0; --add) {
         cols[add - 1] = {add, add};
         rows.push_back({add, add});
     }
@@ -122,25 +127,27 @@ PermutationMatrix PermutationMatrix::operator^(
     return PermutationMatrix(product);
 }
 
-Permutation::Permutation(const PermutationMatrix &m) {
+template <typename Index>
+BasicPermutation<Index>::BasicPermutation(const PermutationMatrix &m) {
     std::vector <unsigned> count_for_cols(m.get_cols() + 1, 0);
     for (unsigned i = m.get_rows(); i != 0; --i) {
         if (m.matrix[i]) {
-            rows.push_back({i, m.matrix[i]});
+            rows.push_back(Element(i, m.matrix[i]));
         }
         count_for_cols[m.matrix[i]] = i;
     }
     for (unsigned i = 1; i <= m.get_cols(); ++i) {
         if (count_for_cols[i]) {
-            cols.push_back({i, count_for_cols[i]});
+            cols.push_back(Element(i, count_for_cols[i]));
         }
     }
 }
 
 // TODO MAKE BETTER
-Permutation::Permutation(const std::vector<unsigned> &permutation) {
+template <typename Index>
+BasicPermutation<Index>::BasicPermutation(const std::vector<Index> &permutation) {
     cols.resize(permutation.size() + 1, {0, 0});
-    for (int row = permutation.size(); row > 0; --row) {
+    for (Index row = permutation.size(); row > 0; --row) {
         rows.push_back({row, permutation[row - 1]});
         cols[permutation[row - 1] - 1] = {permutation[row - 1], row};
     }
@@ -151,7 +158,8 @@ Permutation::Permutation(const std::vector<unsigned> &permutation) {
     }
 }
 
-PermutationMatrix Permutation::expand(unsigned row_amount, unsigned col_amount) const {
+template <typename Index>
+PermutationMatrix BasicPermutation<Index>::expand(unsigned row_amount, unsigned col_amount) const {
     std::vector <unsigned> subpermutation(row_amount, 0);
     for (const auto &permutation_pair: rows) {
         subpermutation[permutation_pair.first - 1] = permutation_pair.second;
@@ -161,9 +169,10 @@ PermutationMatrix Permutation::expand(unsigned row_amount, unsigned col_amount)
 
 // Returns a pair of two permutations, where the first one has
 // the row values no greater than split_value.
-std::pair<Permutation, Permutation> Permutation::split_row(unsigned split_value) const {
-    std::vector <std::pair <unsigned, unsigned> > row_first, row_second;
-    std::vector <std::pair <unsigned, unsigned> > col_first, col_second;
+template <typename Index>
+std::pair<BasicPermutation<Index>, BasicPermutation<Index> > BasicPermutation<Index>::split_row(Index split_value) const {
+    std::vector <Element> row_first, row_second;
+    std::vector <Element> col_first, col_second;
     for (const auto &matched_pair: rows) {
         if (matched_pair.first <= split_value) {
             row_first.push_back(matched_pair);
@@ -180,14 +189,15 @@ std::pair<Permutation, Permutation> Permutation::split_row(unsigned split_value)
             col_second.push_back(matched_pair);
         }
     }
-    return {Permutation{row_first, col_first}, Permutation{row_second, col_second}};
+    return {BasicPermutation{row_first, col_first}, BasicPermutation{row_second, col_second}};
 }
 
 // Returns a pair of two permutations, where the first one has
 // the column values no greater than split_value.
-std::pair<Permutation, Permutation> Permutation::split_col(unsigned split_value) const {
-    std::vector <std::pair <unsigned, unsigned> > row_first, row_second;
-    std::vector <std::pair <unsigned, unsigned> > col_first, col_second;
+template <typename Index>
+std::pair<BasicPermutation<Index>, BasicPermutation<Index> > BasicPermutation<Index>::split_col(Index split_value) const {
+    std::vector <Element> row_first, row_second;
+    std::vector <Element> col_first, col_second;
     for (const auto &matched_pair: rows) {
         if (matched_pair.second <= split_value) {
             row_first.push_back(matched_pair);
@@ -204,16 +214,17 @@ std::pair<Permutation, Permutation> Permutation::split_col(unsigned split_value)
             col_second.push_back(matched_pair);
         }
     }
-    return {Permutation{row_first, col_first}, Permutation{row_second, col_second}};
+    return {BasicPermutation{row_first, col_first}, BasicPermutation{row_second, col_second}};
 }
 
 
 // Try to move the ant up.
 // It might stop seeing a bad R_high value, or see a new bad R_low value.
 // If this happens, the balance is broken and the ant can not move up.
-bool SteadyAnt::can_move_up() const {
-    PermutationIterator new_high(high_it);
-    PermutationIterator new_low(low_it);
+template <typename Index>
+bool SteadyAnt<Index>::can_move_up() const {
+    PermutationIterator<Index> new_high(high_it);
+    PermutationIterator<Index> new_low(low_it);
     for (; !new_high.has_row_ended() && new_high.row() == ant_row; new_high.inc_row()) {
         if (new_high.matching_col() < ant_col) {
             return false;
@@ -230,9 +241,10 @@ bool SteadyAnt::can_move_up() const {
 // Try to move the ant right.
 // It might stop seeing a bad R_low value, or see a new bad R_high value.
 // If this happens, the balance is broken and the ant can not move right.
-bool SteadyAnt::can_move_right() const {
-    PermutationIterator new_high(high_it);
-    PermutationIterator new_low(low_it);
+template <typename Index>
+bool SteadyAnt<Index>::can_move_right() const {
+    PermutationIterator<Index> new_high(high_it);
+    PermutationIterator<Index> new_low(low_it);
     for (; !new_high.has_col_ended() && new_high.col() == ant_col; new_high.inc_col()) {
         if (new_high.matching_row() <= ant_row) {
             return false;
@@ -248,7 +260,8 @@ bool SteadyAnt::can_move_right() const {
 
 // Moves the ant up. 
 // The up move validity is not checked since it is confirmed in the main traversal.
-void SteadyAnt::move_up() {
+template <typename Index>
+void SteadyAnt<Index>::move_up() {
     for (; !high_it.has_row_ended() && high_it.row() == ant_row; high_it.inc_row()) {
         if (high_it.matching_col() >= ant_col) {
             good_elements_row.push_back(high_it.row_pair());
@@ -264,7 +277,8 @@ void SteadyAnt::move_up() {
 
 // Moves the ant right. 
 // The right move validity is not checked since it is confirmed in the main traversal.
-void SteadyAnt::move_right() {
+template <typename Index>
+void SteadyAnt<Index>::move_right() {
     for (; !high_it.has_col_ended() && high_it.col() == ant_col; high_it.inc_col()) {
         if (high_it.matching_row() > ant_row) {
             good_elements_col.push_back(high_it.col_pair());
@@ -278,27 +292,31 @@ void SteadyAnt::move_right() {
     ant_col = get_next_col();
 }
 
-unsigned SteadyAnt::get_next_row() const {
+template <typename Index>
+Index SteadyAnt<Index>::get_next_row() const {
     return std::max(low_it.has_row_ended() ? min_row : low_it.row(), 
                     high_it.has_row_ended() ? min_row : high_it.row());
 }
 
-unsigned SteadyAnt::get_next_col() const {
+template <typename Index>
+Index SteadyAnt<Index>::get_next_col() const {
     return std::min(low_it.has_col_ended() ? max_col : low_it.col(), 
                     high_it.has_col_ended() ? max_col : high_it.col());
 }
 
-SteadyAnt::SteadyAnt(const Permutation &r_low, const Permutation &r_high): 
-                                                low_it(PermutationIterator(r_low)),
-                                                high_it(PermutationIterator(r_high)) {
+template <typename Index>
+SteadyAnt<Index>::SteadyAnt(const BasicPermutation<Index> &r_low, const BasicPermutation<Index> &r_high): 
+                                                low_it(PermutationIterator<Index>(r_low)),
+                                                high_it(PermutationIterator<Index>(r_high)) {
 
-    min_row = std::min(r_low.rows.size() ? r_low.rows.back().first : 1, 
-                       r_high.rows.size() ? r_high.rows.back().first : 1) - 1;
-    max_col = std::max(r_low.cols.size() ? r_low.cols.back().first : 1, 
-                       r_high.cols.size() ? r_high.cols.back().first : 1) + 1;
+    min_row = std::min<Index>(r_low.rows.size() ? r_low.rows.back().first : 1, 
+                              r_high.rows.size() ? r_high.rows.back().first : 1) - 1;
+    max_col = std::max<Index>(r_low.cols.size() ? r_low.cols.back().first : 1, 
+                              r_high.cols.size() ? r_high.cols.back().first : 1) + 1;
 }
 
-Permutation SteadyAnt::restore_correct_product() {
+template <typename Index>
+BasicPermutation<Index> SteadyAnt<Index>::restore_correct_product() {
     // The ant position.
     // This is the pair of indexes before which the ant is currently located.
     ant_row = get_next_row();
@@ -316,22 +334,23 @@ Permutation SteadyAnt::restore_correct_product() {
             move_right();
         }
     }
-    return Permutation{good_elements_row, good_elements_col};
+    return BasicPermutation<Index>{good_elements_row, good_elements_col};
 }
 
-Permutation multiply(const Permutation &p, const Permutation &q) {
+template <typename Index>
+BasicPermutation<Index> multiply(const BasicPermutation<Index> &p, const BasicPermutation<Index> &q) {
     if (p.get_nonzero_amount() == 0 || q.get_nonzero_amount() == 0) {
         // If all elements are zeroes, the product is a zero as well.
-        return Permutation({}, {});
+        return BasicPermutation<Index>({}, {});
     }
     // The recursion base: at most one non-zero in each permutation.
     if (p.get_nonzero_amount() == 1 && q.get_nonzero_amount() == 1) {
         // The only non-zero value in the product C = A * B is 
         // C[i][k] if A[i][_] and B[_][k] are both non-zero.
-        std::pair<unsigned, unsigned> p_nonzero = p.rows[0];
-        std::pair<unsigned, unsigned> q_nonzero = q.cols[0];
-        return Permutation({{p_nonzero.first, q_nonzero.first}},
-                           {{q_nonzero.first, p_nonzero.first}});
+        std::pair<Index, Index> p_nonzero = p.rows[0];
+        std::pair<Index, Index> q_nonzero = q.cols[0];
+        return BasicPermutation<Index>({{p_nonzero.first, q_nonzero.first}},
+                                       {{q_nonzero.first, p_nonzero.first}});
     }
     // The divide phrase.
     // Split the first matrix by cols and the second by rows on the same it
@@ -340,19 +359,20 @@ Permutation multiply(const Permutation &p, const Permutation &q) {
     auto p_split = p.split_col(p.cols[(p.cols.size() - 1) / 2].first);
     auto q_split = q.split_row(q.rows[q.rows.size() / 2].first);
     // Recursively multiply two pairs of permutations.
-    Permutation r_low = multiply(p_split.first, q_split.first);
-    Permutation r_high = multiply(p_split.second, q_split.second);
+    BasicPermutation<Index> r_low = multiply(p_split.first, q_split.first);
+    BasicPermutation<Index> r_high = multiply(p_split.second, q_split.second);
 
     // The conquer phrase.
     // "Ant" scanline counting the amount of wrong elements in the sum-product.
     // Remove all incorrect elements: higher than the ant scan for the one matrix,
     // lower than the ant scan for the other matrix.
-    SteadyAnt ant = SteadyAnt(r_low, r_high);
+    SteadyAnt<Index> ant(r_low, r_high);
     return ant.restore_correct_product();
 }
 
 // Recursively multiplies two permutations using the steady ant algorithm.
-Permutation Permutation::operator*(const Permutation &p) const {
+template <typename Index>
+BasicPermutation<Index> BasicPermutation<Index>::operator*(const BasicPermutation &p) const {
     return multiply(*this, p);
 }
 
@@ -370,6 +390,47 @@ PermutationMatrix PermutationMatrix::operator*(
     return result.expand(rows, m.get_cols());
 }
 
+DominanceCounter::DominanceCounter(const Permutation &p) {
+    std::vector <std::pair <unsigned, unsigned> > elements(p.rows.rbegin(), p.rows.rend());
+    sorted_rows.reserve(elements.size());
+    for (const auto &element: elements) {
+        sorted_rows.push_back(element.first);
+    }
+    unsigned size = 1;
+    while (size < elements.size()) {
+        size *= 2;
+    }
+    tree.resize(2 * size);
+    for (unsigned i = 0; i < elements.size(); ++i) {
+        tree[size + i].push_back(elements[i].second);
+    }
+    for (unsigned v = size - 1; v > 0; --v) {
+        std::merge(tree[2 * v].begin(), tree[2 * v].end(),
+                   tree[2 * v + 1].begin(), tree[2 * v + 1].end(),
+                   std::back_inserter(tree[v]));
+    }
+}
+
+unsigned DominanceCounter::count(unsigned x, unsigned y) const {
+    unsigned size = tree.size() / 2;
+    unsigned result = 0;
+    // Count the cols greater than y over the elements from the first row greater than x to the end.
+    unsigned l = std::upper_bound(sorted_rows.begin(), sorted_rows.end(), x) - sorted_rows.begin() + size;
+    unsigned r = sorted_rows.size() + size;
+    auto count_greater = [&](unsigned v) {
+        return tree[v].end() - std::upper_bound(tree[v].begin(), tree[v].end(), y);
+    };
+    for (; l < r; l /= 2, r /= 2) {
+        if (l & 1) {
+            result += count_greater(l++);
+        }
+        if (r & 1) {
+            result += count_greater(--r);
+        }
+    }
+    return result;
+}
+
 // Multiplies two Monge matrices.
 // No performance optimization is required as this is intended primarily for
 // testing subpermutation sticky multiplication.
@@ -392,5 +453,9 @@ MongeMatrix MongeMatrix::operator*(const MongeMatrix& m) const {
     return MongeMatrix{result};
 }
 
+template class BasicPermutation<std::uint16_t>;
+template class BasicPermutation<std::uint32_t>;
+template class BasicPermutation<std::uint64_t>;
+
 }  // namespace matrix
 }  // namespace LCS
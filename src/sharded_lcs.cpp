@@ -0,0 +1,143 @@
+#include "sharded_lcs.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <deque>
+#include <functional>
+#include <stdexcept>
+#include <vector>
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "kernel_file.h"
+
+namespace LCS {
+namespace kernel {
+
+namespace {
+
+// Runs every task in a forked process, at most workers at once, and waits for all of them.
+// A task fails if it throws. After a failure no more tasks are started.
+void run_in_workers(const std::vector <std::function <void()> > &tasks, unsigned workers) {
+    std::deque <pid_t> running;
+    bool failed = false;
+    for (std::size_t next = 0; (next < tasks.size() && !failed) || !running.empty();) {
+        if (next < tasks.size() && !failed && running.size() < workers) {
+            pid_t pid = fork();
+            if (pid == 0) {
+                int status = 0;
+                try {
+                    tasks[next]();
+                } catch (...) {
+                    status = 1;
+                }
+                _exit(status);
+            }
+            if (pid == -1) {
+                failed = true;
+            } else {
+                running.push_back(pid);
+                ++next;
+            }
+            continue;
+        }
+        // Only the workers started here are waited for, the oldest first.
+        int status;
+        if (waitpid(running.front(), &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            failed = true;
+        }
+        running.pop_front();
+    }
+    if (failed) {
+        throw std::runtime_error("a worker process for the sharded kernel failed");
+    }
+}
+
+// Removes the kernel files, and the directory if it was created for them.
+class ShardFiles {
+public:
+    explicit ShardFiles(const std::string &directory): path(directory) {
+        if (path.empty()) {
+            const char *tmpdir = std::getenv("TMPDIR");
+            std::string name = std::string(tmpdir && *tmpdir ? tmpdir : "/tmp") + "/lcs_shards_XXXXXX";
+            if (!mkdtemp(&name[0])) {
+                throw std::runtime_error("can not create a directory for shard kernels in " + name);
+            }
+            path = name;
+            created = true;
+        }
+    }
+    ~ShardFiles() {
+        for (const auto &file: files) {
+            unlink(file.c_str());
+        }
+        if (created) {
+            rmdir(path.c_str());
+        }
+    }
+    ShardFiles(const ShardFiles &) = delete;
+    ShardFiles &operator=(const ShardFiles &) = delete;
+
+    // Returns a new file name in the directory.
+    std::string add() {
+        files.push_back(path + "/kernel_" + std::to_string(files.size()) + ".lcsk");
+        return files.back();
+    }
+private:
+    std::string path;
+    bool created = false;
+    std::vector <std::string> files;
+};
+
+}  // namespace
+
+matrix::Permutation sharded_kernel(std::string_view a, std::string_view b, unsigned shards,
+                                   unsigned workers, const std::string &directory) {
+    shards = std::max(1u, std::min(shards, (unsigned)b.size()));
+    workers = std::max(workers, 1u);
+    ShardFiles files(directory);
+
+    // Every level keeps the files of its kernels and the lengths of their parts of b.
+    std::vector <std::string> level;
+    std::vector <unsigned> lengths;
+    std::vector <std::function <void()> > tasks;
+    for (unsigned i = 0; i < shards; ++i) {
+        unsigned l = (unsigned long long)b.size() * i / shards, r = (unsigned long long)b.size() * (i + 1) / shards;
+        std::string file = files.add();
+        tasks.push_back([a, b, file, l, r]() {
+            io::save_permutation(file, RecursiveLCS::kernel(a, b.substr(l, r - l)));
+        });
+        level.push_back(file);
+        lengths.push_back(r - l);
+    }
+    run_in_workers(tasks, workers);
+
+    while (level.size() > 1) {
+        std::vector <std::string> next_level;
+        std::vector <unsigned> next_lengths;
+        tasks.clear();
+        for (unsigned i = 0; i + 1 < level.size(); i += 2) {
+            std::string first = level[i], second = level[i + 1], file = files.add();
+            unsigned size = a.size() + lengths[i] + lengths[i + 1];
+            tasks.push_back([first, second, file, size]() {
+                io::save_permutation(file, concat_kernels(io::load_permutation<unsigned>(first),
+                                                          io::load_permutation<unsigned>(second), size));
+            });
+            next_level.push_back(file);
+            next_lengths.push_back(lengths[i] + lengths[i + 1]);
+        }
+        if (level.size() % 2) {
+            next_level.push_back(level.back());
+            next_lengths.push_back(lengths.back());
+        }
+        run_in_workers(tasks, workers);
+        level = next_level;
+        lengths = next_lengths;
+    }
+    return io::load_permutation<unsigned>(level[0]);
+}
+
+}  // namespace kernel
+}  // namespace LCS
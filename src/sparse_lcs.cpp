@@ -0,0 +1,125 @@
+#include "sparse_lcs.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <numeric>
+#include <vector>
+
+namespace LCS {
+namespace kernel {
+
+namespace {
+
+// The positions in b of every symbol of a, found by sorting the positions of b by their symbols.
+template <typename Symbol>
+class MatchLists {
+public:
+    MatchLists(SymbolSpan<Symbol> a, SymbolSpan<Symbol> b): positions(b.size()), ranges(a.size()) {
+        std::iota(positions.begin(), positions.end(), 0);
+        std::stable_sort(positions.begin(), positions.end(), [&b](unsigned x, unsigned y) { return b[x] < b[y]; });
+        for (unsigned i = 0; i < a.size(); ++i) {
+            auto first = std::lower_bound(positions.begin(), positions.end(), a[i],
+                                          [&b](unsigned x, const Symbol &c) { return b[x] < c; });
+            auto last = std::upper_bound(first, positions.end(), a[i],
+                                         [&b](const Symbol &c, unsigned x) { return c < b[x]; });
+            ranges[i] = {first - positions.begin(), last - positions.begin()};
+        }
+    }
+
+    // The positions of a[i] in b in increasing order.
+    const unsigned *begin(unsigned i) const { return positions.data() + ranges[i].first; }
+    const unsigned *end(unsigned i) const { return positions.data() + ranges[i].second; }
+
+    // Returns whether a symbol of a[a_l:a_r) occurs in b[b_l:b_r).
+    bool any(unsigned a_l, unsigned a_r, unsigned b_l, unsigned b_r) const {
+        for (unsigned i = a_l; i < a_r; ++i) {
+            const unsigned *j = std::lower_bound(begin(i), end(i), b_l);
+            if (j != end(i) && *j < b_r) {
+                return true;
+            }
+        }
+        return false;
+    }
+private:
+    std::vector <unsigned> positions;
+    std::vector <std::pair <std::size_t, std::size_t> > ranges;
+};
+
+// Count the LCS kernel for a[a_l:a_r) and b[b_l:b_r) as RecursiveLCS does, closing blocks without matches at once.
+template <typename Symbol>
+matrix::Permutation sparse_kernel(const MatchLists<Symbol> &matches, SymbolSpan<Symbol> a, SymbolSpan<Symbol> b,
+                                  unsigned recursion_base, unsigned a_l, unsigned a_r, unsigned b_l, unsigned b_r) {
+    unsigned m = a_r - a_l, n = b_r - b_l;
+    if (!matches.any(a_l, a_r, b_l, b_r)) {
+        // No strands are uncrossed: the left strands end at the bottom and the top strands at the right.
+        std::vector <unsigned> result(m + n);
+        for (unsigned k = 0; k < m; ++k) {
+            result[k] = n + k + 1;
+        }
+        for (unsigned j = 0; j < n; ++j) {
+            result[m + j] = j + 1;
+        }
+        return matrix::Permutation(result);
+    }
+    if (m + n <= recursion_base) {
+        return RecursiveLCS::kernel<Symbol>(a.substr(a_l, m), b.substr(b_l, n), recursion_base);
+    } else if (m > 1) {  // split by row
+        unsigned a_m = (a_l + a_r) / 2;
+        matrix::Permutation first_half = sparse_kernel(matches, a, b, recursion_base, a_l, a_m, b_l, b_r);
+        matrix::Permutation second_half = sparse_kernel(matches, a, b, recursion_base, a_m, a_r, b_l, b_r);
+        first_half.grow_front(m + n);
+        second_half.grow_back(m + n);
+        return first_half * second_half;
+    } else {  // split by column
+        unsigned b_m = (b_l + b_r) / 2;
+        matrix::Permutation first_half = sparse_kernel(matches, a, b, recursion_base, a_l, a_r, b_l, b_m);
+        matrix::Permutation second_half = sparse_kernel(matches, a, b, recursion_base, a_l, a_r, b_m, b_r);
+        first_half.grow_back(m + n);
+        second_half.grow_front(m + n);
+        return first_half * second_half;
+    }
+}
+
+}  // namespace
+
+template <typename Symbol>
+unsigned sparse_lcs(SymbolSpan<Symbol> a, SymbolSpan<Symbol> b) {
+    MatchLists<Symbol> matches(a, b);
+    // thresholds[k] is the smallest end in b of a common subsequence of length k + 1 of the processed prefix of a.
+    std::vector <unsigned> thresholds;
+    for (unsigned i = 0; i < a.size(); ++i) {
+        // Positions are taken from right to left, so that no two of them extend each other.
+        for (const unsigned *j = matches.end(i); j != matches.begin(i);) {
+            --j;
+            auto k = std::lower_bound(thresholds.begin(), thresholds.end(), *j);
+            if (k == thresholds.end()) {
+                thresholds.push_back(*j);
+            } else {
+                *k = *j;
+            }
+        }
+    }
+    return thresholds.size();
+}
+
+template <typename Symbol>
+matrix::Permutation SparseLCS::kernel(SymbolSpan<Symbol> a, SymbolSpan<Symbol> b, unsigned recursion_base) {
+    // A matching pair of single symbols can not be split further.
+    recursion_base = std::max(recursion_base, 2u);
+    return sparse_kernel(MatchLists<Symbol>(a, b), a, b, recursion_base, 0, a.size(), 0, b.size());
+}
+
+SparseLCS::SparseLCS(std::string_view a, std::string_view b, unsigned recursion_base, Ownership ownership):
+    LCSKernel(a, b, kernel(a, b, recursion_base), ownership) {}
+
+template unsigned sparse_lcs(SymbolSpan<char>, SymbolSpan<char>);
+template unsigned sparse_lcs(SymbolSpan<std::uint8_t>, SymbolSpan<std::uint8_t>);
+template unsigned sparse_lcs(SymbolSpan<std::uint16_t>, SymbolSpan<std::uint16_t>);
+template unsigned sparse_lcs(SymbolSpan<std::uint32_t>, SymbolSpan<std::uint32_t>);
+template matrix::Permutation SparseLCS::kernel(SymbolSpan<char>, SymbolSpan<char>, unsigned);
+template matrix::Permutation SparseLCS::kernel(SymbolSpan<std::uint8_t>, SymbolSpan<std::uint8_t>, unsigned);
+template matrix::Permutation SparseLCS::kernel(SymbolSpan<std::uint16_t>, SymbolSpan<std::uint16_t>, unsigned);
+template matrix::Permutation SparseLCS::kernel(SymbolSpan<std::uint32_t>, SymbolSpan<std::uint32_t>, unsigned);
+
+}  // namespace kernel
+}  // namespace LCS
@@ -0,0 +1,69 @@
+#include <string>
+#include <random>
+#include <stdexcept>
+
+#include "gtest/gtest.h"
+#include "monge_matrix.h"
+#include "lcs_kernel.h"
+#include "combing_tables.h"
+#include "test_utils.h"
+
+namespace LCS {
+namespace kernel {
+namespace {
+
+using test::random_string;
+
+TEST(CombingTablesTest, TableCombingIsCellCombingTest) {
+    std::mt19937 generator(49);
+    for (std::string alphabet: {"A", "AB", "ACG", "ACGT"}) {
+        for (unsigned i = 0; i < 40; ++i) {
+            std::string a = random_string(generator, generator() % 40, alphabet);
+            std::string b = random_string(generator, generator() % 50, alphabet);
+            ASSERT_EQ(CombingTables::get().comb(a, b).rows, RecursiveLCS::kernel(a, b).rows);
+        }
+    }
+}
+
+TEST(CombingTablesTest, TablesAsRecursionBaseTest) {
+    std::mt19937 generator(49);
+    for (unsigned i = 0; i < 20; ++i) {
+        std::string a = random_string(generator, 20 + generator() % 40, "ACGT");
+        std::string b = random_string(generator, 20 + generator() % 40, "ACGT");
+        for (unsigned recursion_base: {2u, 7u, 30u, 1000u}) {
+            ASSERT_EQ(RecursiveLCS::kernel(a, b, recursion_base, BaseCase::TABLES).rows,
+                      RecursiveLCS::kernel(a, b).rows);
+        }
+    }
+}
+
+TEST(CombingTablesTest, TableLCSAnswersSemiLocalQueriesTest) {
+    std::string a = "GATTACAGATC", b = "CTAGGATTTACAG";
+    TableLCS tables(a, b);
+    RecursiveLCS recursive(a, b, 64, BaseCase::TABLES);
+    IterativeLCS expected(a, b);
+    for (unsigned l = 0; l <= b.size(); ++l) {
+        for (unsigned r = l; r <= b.size(); ++r) {
+            ASSERT_EQ(tables.lcs_whole_a(l, r), expected.lcs_whole_a(l, r));
+            ASSERT_EQ(recursive.lcs_whole_a(l, r), expected.lcs_whole_a(l, r));
+        }
+    }
+    for (unsigned l = 0; l <= a.size(); ++l) {
+        for (unsigned r = l; r <= a.size(); ++r) {
+            ASSERT_EQ(tables.lcs_whole_b(l, r), expected.lcs_whole_b(l, r));
+        }
+    }
+}
+
+TEST(CombingTablesTest, TablesRejectLargeAlphabetsTest) {
+    ASSERT_THROW(TableLCS("ACGT", "ACGU"), std::invalid_argument);
+    ASSERT_THROW(RecursiveLCS::kernel("ABCDE", "ABC", 100, BaseCase::TABLES), std::invalid_argument);
+    // The alphabets are checked before the strings are divided into blocks that would fit the tables.
+    ASSERT_THROW(RecursiveLCS::kernel("ABCDEF", "FEDCBA", 2, BaseCase::TABLES), std::invalid_argument);
+    ASSERT_THROW(RecursiveLCS("ABCDEF", "FEDCBA", 2, BaseCase::TABLES), std::invalid_argument);
+    ASSERT_NO_THROW(TableLCS("", ""));
+}
+
+}  // namespace
+}  // namespace kernel
+}  // namespace LCS
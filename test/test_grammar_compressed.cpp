@@ -1,7 +1,13 @@
 #include <string>
+#include <string_view>
 #include <algorithm>
 #include <iostream>
 #include <numeric>
+#include <memory>
+#include <sstream>
+#include <random>
+#include <stdexcept>
+#include <thread>
 
 #include "gtest/gtest.h"
 #include "monge_matrix.h"
@@ -131,22 +137,24 @@ TEST(GrammarCompressedTest, LZ78ComputesCorrectlyTest) {
     auto right = gc_lz78_string.rules[gc_lz78_string.final_rule].second_symbol;
     ASSERT_EQ(gc_lz78_string.rules[left].decompress(gc_lz78_string), "ABACAB");
     ASSERT_EQ(gc_lz78_string.rules[right].decompress(gc_lz78_string), "A");
+    // The phrases A, B, AC, AB, A are concatenated as a balanced tree.
     auto lower_left = gc_lz78_string.rules[left].first_symbol;
     auto lower_right = gc_lz78_string.rules[left].second_symbol;
-    ASSERT_EQ(gc_lz78_string.rules[lower_left].decompress(gc_lz78_string), "ABAC");
-    ASSERT_EQ(gc_lz78_string.rules[lower_right].decompress(gc_lz78_string), "AB");
-    auto final_left = gc_lz78_string.rules[lower_left].first_symbol;
-    auto final_right = gc_lz78_string.rules[lower_left].second_symbol;
-    ASSERT_EQ(gc_lz78_string.rules[final_left].decompress(gc_lz78_string), "AB");
-    ASSERT_EQ(gc_lz78_string.rules[final_right].decompress(gc_lz78_string), "AC");
+    ASSERT_EQ(gc_lz78_string.rules[lower_left].decompress(gc_lz78_string), "AB");
+    ASSERT_EQ(gc_lz78_string.rules[lower_right].decompress(gc_lz78_string), "ACAB");
+    auto final_left = gc_lz78_string.rules[lower_right].first_symbol;
+    auto final_right = gc_lz78_string.rules[lower_right].second_symbol;
+    ASSERT_EQ(gc_lz78_string.rules[final_left].decompress(gc_lz78_string), "AC");
+    ASSERT_EQ(gc_lz78_string.rules[final_right].decompress(gc_lz78_string), "AB");
     // Test that the decompression works correctly.
     ASSERT_EQ(gc_lz78_string.rules[gc_lz78_string.final_rule].number, 11);
-    ASSERT_EQ(gc_lz78_string.rules[left].number, 9);
-    ASSERT_EQ(gc_lz78_string.rules[right].number, 10);
-    ASSERT_EQ(gc_lz78_string.rules[lower_left].number, 6);
-    ASSERT_EQ(gc_lz78_string.rules[lower_right].number, 8);
-    ASSERT_EQ(gc_lz78_string.rules[final_left].number, 3);
-    ASSERT_EQ(gc_lz78_string.rules[final_right].number, 5);
+    // Concatenation rules are added one phrase later, after checking that the phrase does not continue a run.
+    ASSERT_EQ(gc_lz78_string.rules[left].number, 10);
+    ASSERT_EQ(gc_lz78_string.rules[right].number, 8);
+    ASSERT_EQ(gc_lz78_string.rules[lower_left].number, 5);
+    ASSERT_EQ(gc_lz78_string.rules[lower_right].number, 9);
+    ASSERT_EQ(gc_lz78_string.rules[final_left].number, 4);
+    ASSERT_EQ(gc_lz78_string.rules[final_right].number, 7);
 } 
 
 TEST(GrammarCompressedTest, LZWComputesCorrectlyTest) {
@@ -164,8 +172,8 @@ TEST(GrammarCompressedTest, LZWComputesCorrectlyTest) {
     ASSERT_EQ(gc_lzw_string.rules[lower_right].decompress(gc_lzw_string), "AC");
     // Test that the decompression works correctly.
     ASSERT_EQ(gc_lzw_string.rules[gc_lzw_string.final_rule].number, 27 + 5);
-    ASSERT_EQ(gc_lzw_string.rules[left].number, 27 + 3);
-    ASSERT_EQ(gc_lzw_string.rules[right].number, 27 + 4);
+    ASSERT_EQ(gc_lzw_string.rules[left].number, 27 + 4);
+    ASSERT_EQ(gc_lzw_string.rules[right].number, 27 + 3);
     ASSERT_EQ(gc_lzw_string.rules[lower_left].number, 27 + 1);
     ASSERT_EQ(gc_lzw_string.rules[lower_right].number, 27 + 2);
 }
@@ -243,6 +251,728 @@ TEST(GrammarCompressedTest, LZGrammarStringIsCompressedQuadraticallyByLZWCompres
     }
 }
 
+TEST(GrammarCompressedTest, LZWASCIIDecompressesToOriginalStringTest) {
+    std::string s = "This is a test file!\nIt has \t all sorts \x01 of \xff symbols \xff\xff\xff.\n";
+    auto gcs = LZWASCII(s);
+    ASSERT_EQ(gcs.rules[gcs.final_rule].decompress(gcs), s);
+    auto gcs2 = LZW2(s);
+    ASSERT_EQ(gcs2.rules[gcs2.final_rule].decompress(gcs2), s);
+}
+
+TEST(GrammarCompressedTest, LZWASCIIFullDictionaryTest) {
+    // With 9 bits the dictionary only has 256 free entries, so both policies are exercised.
+    std::string s = get_lzw_grammar_string(100) + "some more text" + get_lz78_grammar_string(60);
+    auto frozen = LZWASCII(s, 9);
+    ASSERT_EQ(frozen.rules[frozen.final_rule].decompress(frozen), s);
+    auto reset = LZW2(s, 9);
+    ASSERT_EQ(reset.rules[reset.final_rule].decompress(reset), s);
+}
+
+TEST(GrammarCompressedTest, LZWASCIIReadsStreamTest) {
+    std::string s = get_lzw_grammar_string(50, 3);
+    std::istringstream in(s);
+    auto gcs = LZW2(in, 10);
+    ASSERT_EQ(gcs.rules[gcs.final_rule].decompress(gcs), s);
+
+    LZWStream stream(10, DictionaryPolicy::freeze);
+    for (char c: s) {
+        stream.push(c);
+    }
+    auto streamed = stream.finish();
+    auto whole = LZWASCII(s, 10);
+    ASSERT_EQ(streamed.final_rule, whole.final_rule);
+    ASSERT_EQ(streamed.rules[streamed.final_rule].decompress(streamed), s);
+}
+
+TEST(GrammarCompressedTest, LZWStreamWithoutInputIsEmptyGrammarTest) {
+    LZWStream stream;
+    const GrammarCompressedStorage &gcs = stream.finish();
+    ASSERT_TRUE(gcs.empty());
+    ASSERT_TRUE(LZW2("").empty());
+    ASSERT_TRUE(normalize(gcs).empty());
+    GCIncrementalQuery query("AB");
+    ASSERT_EQ(query.update(gcs), 0u);
+    stream.push('B');
+    // The grammar of the stream is returned, so the reference follows it.
+    ASSERT_EQ(&stream.finish(), &gcs);
+    ASSERT_FALSE(gcs.empty());
+    ASSERT_EQ(query.update(gcs), 1u);
+}
+
+TEST(GrammarCompressedTest, LZWRejectsDictionarySizesTest) {
+    ASSERT_THROW(LZWStream(8), std::invalid_argument);
+    ASSERT_THROW(LZWStream(64), std::invalid_argument);
+    ASSERT_THROW(LZW2("ABAB", 0), std::invalid_argument);
+    ASSERT_NO_THROW(LZWStream(9));
+    ASSERT_NO_THROW(LZWStream(63));
+}
+
+TEST(GrammarCompressedTest, LZW2LcsIsCorrectTest) {
+    std::string p = "ABCADBA";
+    std::string t = get_lzw_grammar_string(40) + get_lz78_grammar_string(20, 2);
+    auto gcs = LZW2(t, 9);
+    ASSERT_EQ(kernel::dp_lcs(p, t), GCKernel(p, gcs).lcs);
+}
+
+unsigned grammar_depth(const GrammarCompressedStorage &gcs, unsigned index) {
+    if (gcs.rules[index].is_base) {
+        return 0;
+    }
+    return 1 + std::max(grammar_depth(gcs, gcs.rules[index].first_symbol),
+                        grammar_depth(gcs, gcs.rules[index].second_symbol));
+}
+
+TEST(GrammarCompressedTest, IncrementalQueryFollowsGrowingStreamTest) {
+    std::string p = "ABCADBA";
+    std::string s = get_lzw_grammar_string(60) + std::string(50, 'A') + get_lz78_grammar_string(40, 2);
+    LZWStream stream(12, DictionaryPolicy::freeze);
+    GCIncrementalQuery query(p);
+    std::string text;
+    for (unsigned begin = 0; begin < s.size(); begin += 37) {
+        std::string chunk = s.substr(begin, 37);
+        stream.push(chunk.begin(), chunk.end());
+        text += chunk;
+        const GrammarCompressedStorage &gcs = stream.finish();
+        ASSERT_EQ(gcs.rules[gcs.final_rule].decompress(gcs), text);
+        ASSERT_EQ(kernel::dp_lcs(p, text), query.update(gcs));
+        ASSERT_EQ(query.size(), gcs.rules.size());
+    }
+    const GrammarCompressedStorage &gcs = stream.finish();
+    ASSERT_EQ(GCKernel(p, gcs).lcs, query.lcs());
+    // Folding the spine on every call keeps the depth close to that of the grammar built in one go.
+    auto whole = LZWASCII(s, 12);
+    ASSERT_LE(grammar_depth(gcs, gcs.final_rule), grammar_depth(whole, whole.final_rule) + 1);
+}
+
+TEST(GrammarCompressedTest, IncrementalQueryWithMatchingRuleFirstTest) {
+    // A rule with characters of p before the first rule without them.
+    GrammarCompressedStorage gcs;
+    gcs.add_rule(GrammarCompressed(gcs, 1, 'a'));
+    gcs.add_rule(GrammarCompressed(gcs, 2, 'b'));
+    gcs.add_rule(GrammarCompressed(gcs, 3, 1u, 1u));
+    gcs.final_rule = 2;
+    ASSERT_EQ(GCIncrementalQuery("a").update(gcs), 0u);
+    ASSERT_EQ(GCIncrementalQuery("ab").update(gcs), 1u);
+
+    // The terminal of '\0' is the first rule of LZWStream.
+    std::string p("A\0B", 3);
+    LZWStream stream;
+    GCIncrementalQuery query(p);
+    std::string text;
+    for (std::string chunk: {std::string("CCDC"), std::string("CA\0D", 4), std::string("DDBC")}) {
+        stream.push(chunk.begin(), chunk.end());
+        text += chunk;
+        ASSERT_EQ(query.update(stream.finish()), kernel::dp_lcs(p, text));
+    }
+}
+
+TEST(GrammarCompressedTest, RePairDecompressesToOriginalStringTest) {
+    std::vector <std::string> strings = {"A", "AB", "aaaaaaaaaaaaaaaaaaaaaaaaaaa", "abababababa",
+                                         "This is a test file!\n", fib_string(12),
+                                         get_lz78_grammar_string(40), get_lzw_grammar_string(30, 5)};
+    for (const auto &s: strings) {
+        auto gcs = RePair(s);
+        ASSERT_EQ(gcs.rules[gcs.final_rule].decompress(gcs), s);
+    }
+}
+
+TEST(GrammarCompressedTest, RePairOfEmptyStringIsEmptyGrammarTest) {
+    auto gcs = RePair("");
+    ASSERT_TRUE(gcs.empty());
+    ASSERT_EQ(gcs.final_rule, GrammarCompressedStorage::NO_RULE);
+    ASSERT_TRUE(GrammarCompressedStorage().empty());
+    ASSERT_TRUE(normalize(gcs).empty());
+    ASSERT_THROW(GCQueryEngine engine(gcs), std::invalid_argument);
+    ASSERT_THROW(GrammarCorpus().add(gcs), std::invalid_argument);
+    ASSERT_FALSE(RePair("A").empty());
+}
+
+TEST(GrammarCompressedTest, RePairIsSmallerThanLZTest) {
+    std::string s = get_lzw_grammar_string(200);
+    auto repair = RePair(s);
+    ASSERT_EQ(repair.rules[repair.final_rule].decompress(repair), s);
+    ASSERT_LT(repair.rules.size(), LZ78(s).rules.size());
+    // Fibonacci strings are compressed into a logarithmic number of rules.
+    std::string f = fib_string(20);
+    ASSERT_LT(RePair(f).rules.size(), 100u);
+}
+
+TEST(GrammarCompressedTest, RePairConcatenationIsBalancedTest) {
+    // No pair is repeated, so the grammar is just the concatenation of 64 symbols.
+    std::string s;
+    for (char c = '0'; c < '0' + 64; ++c) {
+        s += c;
+    }
+    auto gcs = RePair(s);
+    ASSERT_EQ(gcs.rules.size(), 64u + 63u);
+    ASSERT_EQ(grammar_depth(gcs, gcs.final_rule), 6u);
+    s += "!";
+    auto odd = RePair(s);
+    ASSERT_EQ(odd.rules[odd.final_rule].decompress(odd), s);
+    ASSERT_EQ(grammar_depth(odd, odd.final_rule), 7u);
+}
+
+TEST(GrammarCompressedTest, RePairLcsIsCorrectTest) {
+    std::string p = "ABCADBAXC";
+    std::string t = get_lzw_grammar_string(40) + fib_string(9);
+    ASSERT_EQ(kernel::dp_lcs(p, t), GCKernel(p, RePair(t)).lcs);
+}
+
+TEST(GrammarCompressedTest, LZConcatenationIsBalancedTest) {
+    // The concatenation depth is logarithmic in the amount of phrases,
+    // so only the dictionary strings themselves can make the grammar deep.
+    std::string s = get_lzw_grammar_string(300);
+    auto gc_lzw_string = LZW(s);
+    ASSERT_EQ(gc_lzw_string.rules[gc_lzw_string.final_rule].decompress(gc_lzw_string), s);
+    ASSERT_LE(grammar_depth(gc_lzw_string, gc_lzw_string.final_rule), 2 * 9 + 301u);
+    auto gc_lz78_string = LZ78(s);
+    ASSERT_EQ(gc_lz78_string.rules[gc_lz78_string.final_rule].decompress(gc_lz78_string), s);
+
+    std::string t = "abcdefghijklmnopqrstuvwxyz0123456789";
+    auto gcs = LZW2(t + t + t + t);
+    ASSERT_EQ(gcs.rules[gcs.final_rule].decompress(gcs), t + t + t + t);
+    ASSERT_LE(grammar_depth(gcs, gcs.final_rule), 2 * 7 + 4u);
+    auto gcs_aaaa = get_aaaa(1000);
+    ASSERT_TRUE(gcs_aaaa.rules[gcs_aaaa.final_rule].is_run());
+    ASSERT_EQ(gcs_aaaa.rules[gcs_aaaa.final_rule].decompress(gcs_aaaa), std::string(1000, 'a'));
+}
+
+void test_normalized(const GrammarCompressedStorage &gcs, const GrammarCompressedStorage &normalized) {
+    ASSERT_EQ(normalized.rules[normalized.final_rule].decompress(normalized),
+              gcs.rules[gcs.final_rule].decompress(gcs));
+    ASSERT_EQ(normalized.final_rule + 1, normalized.rules.size());
+    for (unsigned i = 0; i < normalized.rules.size(); ++i) {
+        ASSERT_EQ(normalized.rules[i].number, (int)i + 1);
+        if (!normalized.rules[i].is_base) {
+            ASSERT_LT(normalized.rules[i].first_symbol, i);
+            ASSERT_LT(normalized.rules[i].second_symbol, i);
+        }
+    }
+}
+
+TEST(GrammarCompressedTest, NormalizeMergesDuplicateRulesTest) {
+    GrammarCompressedStorage gcs = GrammarCompressedStorage();
+    gcs.add_rule(GrammarCompressed(gcs, 1, 'A'));  // 0
+    gcs.add_rule(GrammarCompressed(gcs, 2, 'B'));  // 1
+    gcs.add_rule(GrammarCompressed(gcs, 3, 'A'));  // 2, duplicate of 0
+    gcs.add_rule(GrammarCompressed(gcs, 4, 'C'));  // 3, unreachable
+    gcs.add_rule(GrammarCompressed(gcs, 5, 0, 1));  // 4, AB
+    gcs.add_rule(GrammarCompressed(gcs, 6, 2, 1));  // 5, AB again
+    gcs.add_rule(GrammarCompressed(gcs, 7, 4, 5));  // 6, ABAB
+    gcs.add_rule(GrammarCompressed(gcs, 8, 3, 3));  // 7, unreachable
+    gcs.add_rule(GrammarCompressed(gcs, 9, 6, 2));  // 8, ABABA
+    gcs.final_rule = 8;
+    NormalizationReport report;
+    auto normalized = normalize(gcs, &report);
+    test_normalized(gcs, normalized);
+    ASSERT_EQ(report.rules_before, 9u);
+    // A, B, AB, ABAB, ABABA.
+    ASSERT_EQ(report.rules_after, 5u);
+}
+
+TEST(GrammarCompressedTest, NormalizeDropsUnreachableRulesTest) {
+    auto gcs = get_compress_string("../test_files/f2.Z");
+    NormalizationReport report;
+    auto normalized = normalize(gcs, &report);
+    test_normalized(gcs, normalized);
+    ASSERT_EQ(report.rules_before, gcs.rules.size());
+    ASSERT_EQ(report.rules_after, normalized.rules.size());
+    // Most of the 256 terminals are never used by the text.
+    ASSERT_LT(report.rules_after + 200, report.rules_before);
+    std::string p = "is a file X";
+    ASSERT_EQ(GCKernel(p, gcs).lcs, GCKernel(p, normalized).lcs);
+
+    auto lzw = LZW2(get_lzw_grammar_string(100) + get_lzw_grammar_string(100));
+    test_normalized(lzw, normalize(lzw));
+    auto fib = gc_fib_string(10);
+    test_normalized(fib, normalize(fib));
+}
+
+TEST(GrammarCompressedTest, FingerprintsMatchForEqualExpansionsTest) {
+    GrammarCompressedStorage gcs = GrammarCompressedStorage();
+    gcs.add_rule(GrammarCompressed(gcs, 1, 'A'));  // 0
+    gcs.add_rule(GrammarCompressed(gcs, 2, 'B'));  // 1
+    gcs.add_rule(GrammarCompressed(gcs, 3, 'C'));  // 2
+    gcs.add_rule(GrammarCompressed(gcs, 4, 0, 1));  // 3, AB
+    gcs.add_rule(GrammarCompressed(gcs, 5, 1, 2));  // 4, BC
+    gcs.add_rule(GrammarCompressed(gcs, 6, 3, 2));  // 5, (AB)C
+    gcs.add_rule(GrammarCompressed(gcs, 7, 0, 4));  // 6, A(BC)
+    gcs.add_rule(GrammarCompressed(gcs, 8, 1, 0));  // 7, BA
+    gcs.add_rule(GrammarCompressed(gcs, 9, 5, 6));  // 8, ABCABC
+    gcs.final_rule = 8;
+    auto fingerprints = fingerprint_rules(gcs);
+    ASSERT_EQ(fingerprints[8].length, 6u);
+    ASSERT_EQ(fingerprints[5].hash, fingerprints[6].hash);
+    ASSERT_NE(fingerprints[3].hash, fingerprints[7].hash);
+    for (bool verify: {false, true}) {
+        auto representative = expansion_classes(gcs, verify);
+        ASSERT_EQ(representative[5], representative[6]);
+        ASSERT_NE(representative[3], representative[7]);
+        ASSERT_EQ(representative[0], 0u);
+    }
+    for (auto p: {"ABCBCA", "CCBA", "A"}) {
+        std::string text = gcs.rules[gcs.final_rule].decompress(gcs);
+        ASSERT_EQ(GCKernel(p, gcs).lcs, kernel::dp_lcs(p, text));
+        ASSERT_EQ(GCKernel(p, gcs, ExpansionSharing::NONE).lcs, kernel::dp_lcs(p, text));
+    }
+}
+
+TEST(GrammarCompressedTest, TopologicalOrderPutsChildrenFirstTest) {
+    auto gcs = LZW2(get_lzw_grammar_string(50));
+    auto order = topological_order(gcs);
+    ASSERT_EQ(order.size(), gcs.rules.size());
+    std::vector <unsigned> position(gcs.rules.size(), gcs.rules.size());
+    for (unsigned i = 0; i < order.size(); ++i) {
+        position[order[i]] = i;
+    }
+    for (unsigned i = 0; i < gcs.rules.size(); ++i) {
+        ASSERT_LT(position[i], gcs.rules.size());
+        if (!gcs.rules[i].is_base) {
+            ASSERT_LT(position[gcs.rules[i].first_symbol], position[i]);
+            ASSERT_LT(position[gcs.rules[i].second_symbol], position[i]);
+        }
+    }
+}
+
+TEST(GrammarCompressedTest, SharedExpansionsLcsIsCorrectTest) {
+    std::string t = get_lz_grammar_string(60);
+    for (const auto &gcs: {LZ78(t), LZW(t), RePair(t)}) {
+        for (std::string p: {"abacabad", "ddcbaaaabbbb", "bad"}) {
+            ASSERT_EQ(GCKernel(p, gcs).lcs, GCKernel(p, gcs, ExpansionSharing::NONE).lcs);
+            ASSERT_EQ(GCKernel(p, gcs, ExpansionSharing::UNVERIFIED).lcs, GCKernel(p, gcs).lcs);
+            ASSERT_EQ(GCKernel(p, gcs).lcs, kernel::dp_lcs(p, t));
+        }
+    }
+}
+
+TEST(GrammarCompressedTest, VerifiedSharingComparesDifferentStructuresTest) {
+    // LZW and RePair phrases of one text generate equal strings with different rules, merged by a corpus.
+    std::string t = get_lz_grammar_string(40);
+    GrammarCorpus corpus;
+    corpus.add(LZW(t));
+    corpus.add(RePair(t));
+    const GrammarCompressedStorage &gcs = corpus.grammar();
+    auto verified = expansion_classes(gcs), unverified = expansion_classes(gcs, false);
+    ASSERT_EQ(verified, unverified);
+    ASSERT_EQ(verified[corpus.roots()[0]], verified[corpus.roots()[1]]);
+    // The fingerprint base is fixed within the process.
+    ASSERT_EQ(fingerprint_rules(gcs)[corpus.roots()[1]].hash, fingerprint_rules(gcs)[corpus.roots()[1]].hash);
+}
+
+TEST(GrammarCompressedTest, AlphabetSignaturesAreCorrectTest) {
+    auto gcs = RePair(get_lz_grammar_string(30) + "\xff");
+    auto signatures = alphabet_signatures(gcs);
+    for (unsigned i = 0; i < gcs.rules.size(); ++i) {
+        ASSERT_EQ(signatures[i], alphabet_signature(gcs.rules[i].decompress(gcs)));
+    }
+    ASSERT_TRUE(signatures[gcs.final_rule].test(255));
+    ASSERT_FALSE(signatures[gcs.final_rule].test('z'));
+}
+
+TEST(GrammarCompressedTest, RareSymbolPatternLcsIsCorrectTest) {
+    std::string t = get_lz_grammar_string(60);
+    for (std::string p: {"ZZ", "ZYXZ", "Z"}) {
+        ASSERT_EQ(GCKernel(p, LZW(t)).lcs, kernel::dp_lcs(p, t));
+    }
+    std::string x = t.substr(0, t.size() / 2) + "xy" + t.substr(t.size() / 2) + "x";
+    for (const auto &gcs: {RePair(x), LZWASCII(x)}) {
+        for (std::string p: {"xyz", "zzxzz", "yx", "QRST", "", "xaxbyx"}) {
+            ASSERT_EQ(GCKernel(p, gcs).lcs, kernel::dp_lcs(p, x));
+            ASSERT_EQ(GCKernel(p, gcs, ExpansionSharing::NONE).lcs, kernel::dp_lcs(p, x));
+        }
+    }
+    auto fib = gc_fib_string(12);
+    ASSERT_EQ(GCKernel("BBCB", fib).lcs, kernel::dp_lcs("BBCB", fib_string(12)));
+}
+
+TEST(GrammarCompressedTest, RunLengthRuleLcsIsCorrectTest) {
+    GrammarCompressedStorage gcs = GrammarCompressedStorage();
+    gcs.add_rule(GrammarCompressed(gcs, 1, 'A'));  // 0
+    gcs.add_rule(GrammarCompressed(gcs, 2, 'B'));  // 1
+    gcs.add_rule(GrammarCompressed(gcs, 3, 0, 1));  // 2, AB
+    gcs.add_rule(GrammarCompressed::run(gcs, 4, 2, 13));  // 3, (AB)^13
+    gcs.add_rule(GrammarCompressed(gcs, 5, 3, 0));  // 4, (AB)^13 A
+    gcs.add_rule(GrammarCompressed::run(gcs, 6, 4, 6));  // 5, ((AB)^13 A)^6
+    gcs.final_rule = 5;
+    std::string period = "";
+    for (int i = 0; i < 13; ++i) {
+        period += "AB";
+    }
+    std::string t = "";
+    for (int i = 0; i < 6; ++i) {
+        t += period + "A";
+    }
+    ASSERT_EQ(gcs.rules[gcs.final_rule].decompress(gcs), t);
+    for (std::string p: {"AAAAAAAAAAAAAAAAAAAAAAAAAAAAAAA", "BBBAB", "ABABABABACAB", "C"}) {
+        ASSERT_EQ(GCKernel(p, gcs).lcs, kernel::dp_lcs(p, t));
+        ASSERT_EQ(GCKernel(p, gcs, ExpansionSharing::NONE).lcs, kernel::dp_lcs(p, t));
+    }
+    auto normalized = normalize(gcs);
+    ASSERT_EQ(normalized.rules[normalized.final_rule].decompress(normalized), t);
+    ASSERT_TRUE(normalized.rules[normalized.final_rule].is_run());
+    ASSERT_EQ(fingerprint_rules(gcs)[gcs.final_rule].length, t.size());
+    ASSERT_EQ(alphabet_signatures(gcs)[gcs.final_rule], alphabet_signature(t));
+}
+
+TEST(GrammarCompressedTest, RunLengthRuleSharesFingerprintTest) {
+    GrammarCompressedStorage gcs = GrammarCompressedStorage();
+    gcs.add_rule(GrammarCompressed(gcs, 1, 'A'));  // 0
+    gcs.add_rule(GrammarCompressed(gcs, 2, 'B'));  // 1
+    gcs.add_rule(GrammarCompressed(gcs, 3, 0, 1));  // 2, AB
+    gcs.add_rule(GrammarCompressed(gcs, 4, 2, 2));  // 3, ABAB
+    gcs.add_rule(GrammarCompressed(gcs, 5, 3, 2));  // 4, ABABAB
+    gcs.add_rule(GrammarCompressed::run(gcs, 6, 2, 3));  // 5, (AB)^3
+    gcs.add_rule(GrammarCompressed(gcs, 7, 4, 5));  // 6
+    gcs.final_rule = 6;
+    for (bool verify: {false, true}) {
+        auto representative = expansion_classes(gcs, verify);
+        ASSERT_EQ(representative[4], representative[5]);
+    }
+}
+
+TEST(GrammarCompressedTest, LongRunLcsIsCorrectTest) {
+    GrammarCompressedStorage gcs = GrammarCompressedStorage();
+    gcs.add_rule(GrammarCompressed(gcs, 1, 'a'));
+    gcs.add_rule(GrammarCompressed::run(gcs, 2, 0, 1000000000000ull));
+    gcs.final_rule = 1;
+    ASSERT_EQ(fingerprint_rules(gcs)[gcs.final_rule].length, 1000000000000ull);
+    ASSERT_EQ(GCKernel("abaaca", gcs).lcs, 4u);
+    ASSERT_EQ(GCKernel("aaaa", get_aaaa(1000)).lcs, 4u);
+}
+
+TEST(GrammarCompressedTest, ConvertersEmitRunLengthRulesTest) {
+    // With 9 bits the dictionary is frozen long before the periodic part, so its phrases repeat.
+    std::string s = "abcabcabcabc" + get_lzw_grammar_string(100);
+    for (int i = 0; i < 1000; ++i) {
+        s += "abc";
+    }
+    auto gcs = LZWASCII(s, 9);
+    ASSERT_EQ(gcs.rules[gcs.final_rule].decompress(gcs), s);
+    ASSERT_TRUE(std::any_of(gcs.rules.begin(), gcs.rules.end(),
+                            [](const GrammarCompressed &rule) { return rule.is_run(); }));
+    ASSERT_EQ(GCKernel("cabbage", gcs).lcs, kernel::dp_lcs("cabbage", s));
+}
+
+TEST(GrammarCompressedTest, ConvertersCollapseCharacterRunsTest) {
+    // The phrases of LZ compressors over a run are the growing powers of its character.
+    std::string s = "ABC" + std::string(2000, 'A') + "CBA";
+    auto has_run = [](const GrammarCompressedStorage &gcs) {
+        return std::any_of(gcs.rules.begin(), gcs.rules.end(),
+                           [](const GrammarCompressed &rule) { return rule.is_run(); });
+    };
+    LZWStream stream;
+    stream.push(s.begin(), s.end());
+    for (auto gcs: {LZ78(s), LZW(s), LZW2(s), LZWASCII(s), stream.finish()}) {
+        ASSERT_EQ(gcs.rules[gcs.final_rule].decompress(gcs), s);
+        ASSERT_TRUE(has_run(gcs));
+        ASSERT_EQ(GCKernel("BACAB", gcs).lcs, kernel::dp_lcs("BACAB", s));
+    }
+    auto gcs = get_compress_string("../test_files/f4.Z");
+    ASSERT_EQ(gcs.rules[gcs.final_rule].decompress(gcs), std::string(20, 'a'));
+    ASSERT_TRUE(gcs.rules[gcs.final_rule].is_run());
+}
+
+TEST(GrammarCompressedTest, QueryEngineLcsIsCorrectTest) {
+    std::string t = get_uncompress_string("../test_files/f2.Z");
+    GCQueryEngine engine(get_compress_string("../test_files/f2.Z"));
+    ASSERT_EQ(engine.text_length(), t.size());
+    ASSERT_EQ(engine.alphabet(), alphabet_signature(t));
+    for (std::string p: {"is a file X", "", "This", "Q", "!!\n", "tttttttttttttttttttttt"}) {
+        ASSERT_EQ(engine.query(p), kernel::dp_lcs(p, t));
+    }
+}
+
+TEST(GrammarCompressedTest, QueryEngineLongPatternLcsIsCorrectTest) {
+    // Patterns past 2^13 characters are evaluated with 32-bit kernel coordinates.
+    std::string t = get_lz_grammar_string(5);
+    GCQueryEngine engine(LZW(t));
+    std::string p;
+    for (unsigned i = 0; i < 8193; ++i) {
+        p += t[(i * 7) % t.size()];
+    }
+    for (unsigned size: {8191u, 8193u}) {
+        ASSERT_EQ(engine.query(p.substr(0, size)), kernel::dp_lcs(p.substr(0, size), t));
+    }
+}
+
+TEST(GrammarCompressedTest, QueryEngineKeepsReachableDistinctRulesTest) {
+    GrammarCompressedStorage gcs = GrammarCompressedStorage();
+    gcs.add_rule(GrammarCompressed(gcs, 1, 'A'));  // 0
+    gcs.add_rule(GrammarCompressed(gcs, 2, 'B'));  // 1
+    gcs.add_rule(GrammarCompressed(gcs, 3, 'A'));  // 2, duplicate of 0
+    gcs.add_rule(GrammarCompressed(gcs, 4, 'C'));  // 3, unreachable
+    gcs.add_rule(GrammarCompressed(gcs, 5, 0, 1));  // 4, AB
+    gcs.add_rule(GrammarCompressed(gcs, 6, 2, 1));  // 5, AB again
+    gcs.add_rule(GrammarCompressed(gcs, 7, 4, 5));  // 6, ABAB
+    gcs.add_rule(GrammarCompressed(gcs, 8, 3, 3));  // 7, unreachable
+    gcs.add_rule(GrammarCompressed(gcs, 9, 6, 2));  // 8, ABABA
+    gcs.final_rule = 8;
+    // A, B, AB, ABAB, ABABA.
+    ASSERT_EQ(GCQueryEngine(gcs).size(), 5u);
+    ASSERT_EQ(GCQueryEngine(gcs, ExpansionSharing::NONE).size(), 7u);
+    ASSERT_EQ(GCQueryEngine(gcs).text_length(), 5u);
+    ASSERT_EQ(GCQueryEngine(gcs).query("BAC"), 2u);
+}
+
+TEST(GrammarCompressedTest, QueryEngineConcurrentQueriesTest) {
+    std::string t = get_lz_grammar_string(40);
+    GCQueryEngine engine(RePair(t));
+    std::vector <std::string> patterns;
+    for (unsigned i = 0; i < 8; ++i) {
+        patterns.push_back(get_lz_grammar_string(3 + i) + fib_string(i));
+    }
+    std::vector <unsigned> results(patterns.size());
+    std::vector <std::thread> threads;
+    for (unsigned i = 0; i < patterns.size(); ++i) {
+        threads.emplace_back([&, i]() {
+            for (unsigned repeat = 0; repeat < 2; ++repeat) {
+                results[i] = engine.query(patterns[i]);
+            }
+        });
+    }
+    for (auto &thread: threads) {
+        thread.join();
+    }
+    for (unsigned i = 0; i < patterns.size(); ++i) {
+        ASSERT_EQ(results[i], kernel::dp_lcs(patterns[i], t));
+    }
+}
+
+void test_semi_local(const std::string &a, const std::string &b, const GrammarCompressedStorage &gcs) {
+    GCSemiLocalKernel kernel(a, gcs);
+    ASSERT_EQ(kernel.lcs, kernel::dp_lcs(a, b));
+    for (unsigned a_l = 0; a_l <= a.size(); ++a_l) {
+        for (unsigned a_r = a_l; a_r <= a.size(); ++a_r) {
+            ASSERT_EQ(kernel.lcs_whole_b(a_l, a_r), kernel::dp_lcs(a.substr(a_l, a_r - a_l), b));
+        }
+        for (unsigned b_i = 0; b_i <= b.size(); ++b_i) {
+            ASSERT_EQ(kernel.lcs_suffix_a_prefix_b(a_l, b_i), kernel::dp_lcs(a.substr(a_l), b.substr(0, b_i)));
+            ASSERT_EQ(kernel.lcs_prefix_a_suffix_b(a_l, b_i), kernel::dp_lcs(a.substr(0, a_l), b.substr(b_i)));
+        }
+    }
+    for (unsigned b_l = 0; b_l <= b.size(); ++b_l) {
+        for (unsigned b_r = b_l; b_r <= b.size(); ++b_r) {
+            ASSERT_EQ(kernel.lcs_whole_a(b_l, b_r), kernel::dp_lcs(a, b.substr(b_l, b_r - b_l)));
+        }
+    }
+}
+
+TEST(GrammarCompressedTest, SemiLocalKernelIsCorrectTest) {
+    std::mt19937 generator(34);
+    for (unsigned i = 0; i < 10; ++i) {
+        std::string a, b;
+        for (unsigned j = 0; j < 1 + generator() % 6; ++j) {
+            a += "ABCD"[generator() % 4];
+        }
+        for (unsigned j = 0; j < 1 + generator() % 20; ++j) {
+            b += "ABC"[generator() % 3];
+        }
+        test_semi_local(a, b, RePair(b));
+        test_semi_local(a, b, LZWASCII(b));
+    }
+    test_semi_local("ABAAB", fib_string(6), gc_fib_string(6));
+}
+
+TEST(GrammarCompressedTest, SemiLocalKernelOwnsCopiedPatternTest) {
+    std::string b = fib_string(8);
+    std::string *a = new std::string("ABAABBA");
+    GCSemiLocalKernel owned(*a, RePair(b));
+    delete a;
+    for (unsigned a_l = 0; a_l <= 7; ++a_l) {
+        ASSERT_EQ(owned.lcs_whole_b(a_l, 7), kernel::dp_lcs(std::string("ABAABBA").substr(a_l), b));
+    }
+}
+
+TEST(GrammarCompressedTest, SemiLocalKernelSharesEngineTest) {
+    std::string b = fib_string(8);
+    auto engine = std::make_shared<const GCQueryEngine>(RePair(b));
+    GCSemiLocalKernel first("ABAAB", engine), second("BBA", engine);
+    ASSERT_EQ(first.lcs, kernel::dp_lcs("ABAAB", b));
+    ASSERT_EQ(second.lcs, kernel::dp_lcs("BBA", b));
+    ASSERT_EQ(second.text_length(), b.size());
+}
+
+TEST(GrammarCompressedTest, SemiLocalKernelRejectsRangesOutsideStringsTest) {
+    std::string b = fib_string(6);
+    GCSemiLocalKernel kernel("ABAAB", RePair(b));
+    ASSERT_EQ(kernel.lcs_whole_a(b.size(), b.size()), 0u);
+    ASSERT_EQ(kernel.lcs_whole_b(5, 5), 0u);
+    ASSERT_THROW(kernel.lcs_whole_a(3, 2), std::out_of_range);
+    ASSERT_THROW(kernel.lcs_whole_a(0, b.size() + 1), std::out_of_range);
+    ASSERT_THROW(kernel.lcs_whole_b(2, 1), std::out_of_range);
+    ASSERT_THROW(kernel.lcs_whole_b(0, 6), std::out_of_range);
+    ASSERT_THROW(kernel.lcs_suffix_a_prefix_b(6, 1), std::out_of_range);
+    ASSERT_THROW(kernel.lcs_suffix_a_prefix_b(0, b.size() + 1), std::out_of_range);
+    ASSERT_THROW(kernel.lcs_prefix_a_suffix_b(6, 0), std::out_of_range);
+    ASSERT_THROW(kernel.lcs_prefix_a_suffix_b(0, b.size() + 1), std::out_of_range);
+}
+
+TEST(GrammarCompressedTest, CharClassesApplyAtTerminalsTest) {
+    kernel::CharClasses classes = kernel::CharClasses::case_insensitive().join("0123456789");
+    std::mt19937 generator(47);
+    for (unsigned i = 0; i < 20; ++i) {
+        std::string p, t;
+        for (unsigned j = 1 + generator() % 12; j > 0; --j) {
+            p += "abC1-"[generator() % 5];
+        }
+        for (unsigned j = 1 + generator() % 200; j > 0; --j) {
+            t += "aAbBcC0123456789xyz"[generator() % 19];
+        }
+        unsigned expected = kernel::dp_lcs(p, t, classes);
+        ASSERT_EQ(GCKernel(p, RePair(t), classes).lcs, expected);
+        ASSERT_EQ(GCQueryEngine(LZWASCII(t)).query(p, classes), expected);
+        ASSERT_EQ(GCQueryEngine(RePair(t)).query(p), kernel::dp_lcs(p, t));
+    }
+}
+
+TEST(GrammarCompressedTest, QueriesTakeStringViewsTest) {
+    std::string buffer = "--" + fib_string(10) + "--ABCAB--";
+    std::string_view t = std::string_view(buffer).substr(2, buffer.size() - 11);
+    std::string_view p = std::string_view(buffer).substr(buffer.size() - 7, 5);
+    GCQueryEngine engine(RePair(t));
+    unsigned expected = kernel::dp_lcs(std::string(p), fib_string(10));
+    ASSERT_EQ(engine.query(p), expected);
+    ASSERT_EQ(engine.query_split(p), expected);
+    ASSERT_EQ(GCKernel(p, LZWASCII(t)).lcs, expected);
+}
+
+TEST(GrammarCompressedTest, SemiLocalKernelRunLengthTest) {
+    GrammarCompressedStorage gcs = GrammarCompressedStorage();
+    gcs.add_rule(GrammarCompressed(gcs, 1, 'A'));  // 0
+    gcs.add_rule(GrammarCompressed(gcs, 2, 'B'));  // 1
+    gcs.add_rule(GrammarCompressed(gcs, 3, 0, 1));  // 2, AB
+    gcs.add_rule(GrammarCompressed(gcs, 4, 2, 0));  // 3, ABA
+    gcs.add_rule(GrammarCompressed::run(gcs, 5, 3, 5));  // 4, (ABA)^5
+    gcs.add_rule(GrammarCompressed(gcs, 6, 1, 4));  // 5, B(ABA)^5
+    gcs.final_rule = 5;
+    test_semi_local("BBAAB", gcs.rules[gcs.final_rule].decompress(gcs), gcs);
+
+    // Coordinates beyond 2^32 in a text of length 3 * 10^12 + 1.
+    gcs.rules[4].run_length = 1000000000000ull;
+    GCSemiLocalKernel kernel("BBAAB", gcs);
+    ASSERT_EQ(kernel.lcs, 5u);
+    ASSERT_EQ(kernel.lcs_whole_a(3000000000000ull - 2, 3000000000000ull + 1), 2u);
+    ASSERT_EQ(kernel.lcs_whole_a(5000000000ull, 5000000002ull), 2u);
+    ASSERT_EQ(kernel.lcs_prefix_a_suffix_b(2, 3000000000000ull - 1), 1u);
+    ASSERT_EQ(kernel.lcs_suffix_a_prefix_b(3, 1), 1u);
+}
+
+TEST(GrammarCompressedTest, QuerySplitLcsIsCorrectTest) {
+    std::mt19937 generator(36);
+    for (unsigned i = 0; i < 30; ++i) {
+        std::string a, b;
+        for (unsigned j = 0; j < 1 + generator() % 12; ++j) {
+            a += "ABCD"[generator() % 4];
+        }
+        for (unsigned j = 0; j < 1 + generator() % 40; ++j) {
+            b += "ABCE"[generator() % 4];
+        }
+        ASSERT_EQ(GCQueryEngine(RePair(b)).query_split(a), kernel::dp_lcs(a, b));
+        ASSERT_EQ(GCQueryEngine(LZWASCII(b)).query_split(a), kernel::dp_lcs(a, b));
+        // Blocks of a single character, and more threads than blocks.
+        ASSERT_EQ(GCQueryEngine(RePair(b)).query_split(a, 1 + i % 13, 1 + i % 3), kernel::dp_lcs(a, b));
+    }
+    std::string t = get_uncompress_string("../test_files/f2.Z");
+    GCQueryEngine engine(get_compress_string("../test_files/f2.Z"));
+    for (std::string p: {"is a file X", "", "T", "!!\n", "tttttttttttttttttttttt"}) {
+        ASSERT_EQ(engine.query_split(p), kernel::dp_lcs(p, t));
+        ASSERT_EQ(engine.query_split(p, 4, 2), kernel::dp_lcs(p, t));
+    }
+
+    // Positions beyond 2^32 in a text of length 3 * 10^12 + 1.
+    GrammarCompressedStorage gcs = GrammarCompressedStorage();
+    gcs.add_rule(GrammarCompressed(gcs, 1, 'A'));  // 0
+    gcs.add_rule(GrammarCompressed(gcs, 2, 'B'));  // 1
+    gcs.add_rule(GrammarCompressed(gcs, 3, 0, 1));  // 2, AB
+    gcs.add_rule(GrammarCompressed(gcs, 4, 2, 0));  // 3, ABA
+    gcs.add_rule(GrammarCompressed::run(gcs, 5, 3, 1000000000000ull));  // 4, (ABA)^k
+    gcs.add_rule(GrammarCompressed(gcs, 6, 1, 4));  // 5, B(ABA)^k
+    gcs.final_rule = 5;
+    for (std::string p: {"BBAAB", "BBBBBBBB", "CCAB", "ABABABAB"}) {
+        ASSERT_EQ(GCQueryEngine(gcs).query_split(p), GCQueryEngine(gcs).query(p));
+        ASSERT_EQ(GCQueryEngine(gcs).query_split(p, 3, 3), GCQueryEngine(gcs).query(p));
+    }
+}
+
+TEST(GrammarCompressedTest, FullyCompressedLcsIsCorrectTest) {
+    std::mt19937 generator(37);
+    for (unsigned i = 0; i < 20; ++i) {
+        std::string a, b;
+        for (unsigned j = 0; j < 1 + generator() % 30; ++j) {
+            a += "ABCD"[generator() % 4];
+        }
+        for (unsigned j = 0; j < 1 + generator() % 40; ++j) {
+            b += "ABCE"[generator() % 4];
+        }
+        ASSERT_EQ(GCKernel(RePair(a), RePair(b)).lcs, kernel::dp_lcs(a, b));
+        ASSERT_EQ(GCKernel(LZWASCII(a), LZWASCII(b), ExpansionSharing::NONE).lcs, kernel::dp_lcs(a, b));
+        ASSERT_EQ(GCQueryEngine(RePair(b)).query(GCQueryEngine(LZWASCII(a))), kernel::dp_lcs(a, b));
+    }
+    ASSERT_EQ(GCKernel(gc_fib_string(10), gc_fib_string(8)).lcs, kernel::dp_lcs(fib_string(10), fib_string(8)));
+
+    GrammarCompressedStorage pattern = GrammarCompressedStorage();
+    pattern.add_rule(GrammarCompressed(pattern, 1, 'A'));  // 0
+    pattern.add_rule(GrammarCompressed(pattern, 2, 'B'));  // 1
+    pattern.add_rule(GrammarCompressed(pattern, 3, 0, 1));  // 2, AB
+    pattern.add_rule(GrammarCompressed::run(pattern, 4, 2, 50));  // 3, (AB)^50
+    pattern.final_rule = 3;
+    std::string b = fib_string(9);
+    std::string a = pattern.rules[pattern.final_rule].decompress(pattern);
+    ASSERT_EQ(GCKernel(pattern, gc_fib_string(9)).lcs, kernel::dp_lcs(a, b));
+
+    // Rules that occur several times, inside and outside of runs, and a text with a terminal per phrase.
+    pattern.add_rule(GrammarCompressed(pattern, 5, 2, 0));  // 4, ABA
+    pattern.add_rule(GrammarCompressed(pattern, 6, 4, 2));  // 5, ABAAB
+    pattern.add_rule(GrammarCompressed::run(pattern, 7, 5, 7));  // 6, (ABAAB)^7
+    pattern.add_rule(GrammarCompressed(pattern, 8, 6, 4));  // 7, (ABAAB)^7 ABA
+    pattern.add_rule(GrammarCompressed(pattern, 9, 3, 7));  // 8, (AB)^50 (ABAAB)^7 ABA
+    pattern.final_rule = 8;
+    a = pattern.rules[pattern.final_rule].decompress(pattern);
+    b = get_lz78_grammar_string(20, 2);
+    ASSERT_EQ(GCKernel(pattern, LZ78(b), ExpansionSharing::NONE).lcs, kernel::dp_lcs(a, b));
+}
+
+TEST(GrammarCompressedTest, CorpusQueryIsCorrectTest) {
+    std::vector <std::string> documents;
+    GrammarCorpus corpus;
+    for (std::string file: {"../test_files/f1.Z", "../test_files/f2.Z", "../test_files/f3.Z"}) {
+        documents.push_back(get_uncompress_string(file));
+        ASSERT_EQ(corpus.add_file(file), documents.size() - 1);
+    }
+    std::mt19937 generator(39);
+    std::string shared;
+    for (unsigned j = 0; j < 30; ++j) {
+        shared += "ABCE"[generator() % 4];
+    }
+    for (unsigned i = 0; i < 5; ++i) {
+        std::string document = shared.substr(generator() % 10);
+        for (unsigned j = generator() % 10; j > 0; --j) {
+            document += "ABCE"[generator() % 4];
+        }
+        documents.push_back(document);
+        corpus.add(document);
+    }
+    ASSERT_EQ(corpus.roots().size(), documents.size());
+
+    // A document with the same grammar adds no rules and shares the root.
+    unsigned rules = corpus.grammar().rules.size();
+    corpus.add(documents.back());
+    documents.push_back(documents.back());
+    ASSERT_EQ(corpus.grammar().rules.size(), rules);
+    ASSERT_EQ(corpus.roots().back(), corpus.roots()[corpus.roots().size() - 2]);
+
+    GCQueryEngine engine(corpus);
+    ASSERT_EQ(engine.text_length(), documents.back().size());
+    for (std::string p: {"ABCA", "is a file", "aab", "", "EEEEEE"}) {
+        std::vector <unsigned> lcs = engine.query_all(p);
+        ASSERT_EQ(lcs.size(), documents.size());
+        for (unsigned i = 0; i < documents.size(); ++i) {
+            ASSERT_EQ(lcs[i], kernel::dp_lcs(p, documents[i]));
+        }
+        ASSERT_EQ(engine.query(p), lcs.back());
+    }
+}
+
 TEST(GrammarCompressedTest, StringDecompressReturnsCorrectStringTest) {
     ASSERT_EQ(get_uncompress_string("../test_files/f1.Z"), "aaaaaaaa\n");
     ASSERT_EQ(get_uncompress_string("../test_files/f2.Z"), "This is a test file!\n");
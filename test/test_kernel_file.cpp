@@ -0,0 +1,166 @@
+#include <string>
+#include <iostream>
+#include <cstdio>
+#include <fstream>
+#include <stdexcept>
+#include <vector>
+
+#include <stdlib.h>
+
+#include "gtest/gtest.h"
+#include "monge_matrix.h"
+#include "lcs_kernel.h"
+#include "kernel_file.h"
+#include "grammar_compressed.h"
+
+namespace LCS {
+namespace io {
+namespace {
+
+// A directory that is removed with its files at the end of a test.
+class TemporaryDirectory {
+public:
+    TemporaryDirectory() {
+        char name[] = "/tmp/lcs_kernel_file_XXXXXX";
+        path = mkdtemp(name);
+    }
+    ~TemporaryDirectory() {
+        std::string command = "rm -rf " + path;
+        if (std::system(command.c_str()) != 0) {
+            std::cerr << "can not remove " << path << std::endl;
+        }
+    }
+    std::string path;
+};
+
+// Flips a bit of the byte at the given offset of the file.
+void damage(const std::string &file, std::size_t offset) {
+    std::fstream f(file, std::ios::in | std::ios::out | std::ios::binary);
+    f.seekg(offset);
+    char c = f.get();
+    f.seekp(offset);
+    f.put(c ^ 1);
+}
+
+TEST(KernelFileTest, PermutationIsLoadedAsSavedTest) {
+    TemporaryDirectory directory;
+    std::string file = directory.path + "/permutation";
+    matrix::Permutation p(std::vector <unsigned>{3, 1, 4, 2, 5});
+    save_permutation(file, p);
+    matrix::Permutation loaded = load_permutation<unsigned>(file);
+    ASSERT_EQ(loaded.rows, p.rows);
+    ASSERT_EQ(loaded.cols, p.cols);
+
+    matrix::BasicPermutation<std::uint16_t> small(std::vector <std::uint16_t>{2, 1});
+    save_permutation(file, small);
+    ASSERT_EQ(load_permutation<std::uint16_t>(file).rows, small.rows);
+    ASSERT_THROW(load_permutation<std::uint64_t>(file), KernelFileError);
+}
+
+TEST(KernelFileTest, DamagedFileIsRejectedTest) {
+    TemporaryDirectory directory;
+    std::string file = directory.path + "/permutation";
+    save_permutation(file, matrix::Permutation(std::vector <unsigned>{2, 3, 1}));
+    damage(file, 40);
+    ASSERT_THROW(load_permutation<unsigned>(file), KernelFileError);
+    save_permutation(file, matrix::Permutation(std::vector <unsigned>{2, 3, 1}));
+    damage(file, 4);  // the format version
+    ASSERT_THROW(load_permutation<unsigned>(file), KernelFileError);
+    ASSERT_THROW(load_permutation<unsigned>(directory.path + "/missing"), KernelFileError);
+}
+
+TEST(KernelFileTest, LCSKernelIsLoadedAsSavedTest) {
+    TemporaryDirectory directory;
+    std::string file = directory.path + "/kernel";
+    std::string a = "ABCABBAC", b = "CABBACBAABC";
+    save_kernel(file, kernel::RecursiveLCS(a, b));
+    kernel::LCSKernel loaded = load_kernel(file);
+    kernel::IterativeLCS expected(a, b);
+    ASSERT_EQ(loaded.get_a(), a);
+    ASSERT_EQ(loaded.get_b(), b);
+    for (unsigned l = 0; l <= b.size(); ++l) {
+        for (unsigned r = l; r <= b.size(); ++r) {
+            ASSERT_EQ(loaded.lcs_whole_a(l, r), expected.lcs_whole_a(l, r));
+        }
+    }
+    for (unsigned l = 0; l <= a.size(); ++l) {
+        for (unsigned r = l; r <= a.size(); ++r) {
+            ASSERT_EQ(loaded.lcs_whole_b(l, r), expected.lcs_whole_b(l, r));
+        }
+    }
+}
+
+TEST(KernelFileTest, CachedQueryIsAnsweredFromFileTest) {
+    TemporaryDirectory directory;
+    std::string p = "ABCADBAEEABCD";
+    std::string t = gc::get_lzw_grammar_string(40) + gc::get_lz78_grammar_string(20, 2);
+    gc::GCQueryEngine engine(gc::RePair(t));
+    unsigned expected = kernel::dp_lcs(p, t);
+    ASSERT_EQ(engine.query_cached(p, directory.path, 7), expected);
+
+    char name[32];
+    std::snprintf(name, sizeof(name), "%016llx.lcsk",
+                  (unsigned long long)content_hash(p.data(), p.size(), engine.content_hash()));
+    std::string file = directory.path + "/" + name;
+    KernelArchive<std::uint16_t> archive;
+    ASSERT_TRUE(load_archive(file, archive));
+    ASSERT_EQ(archive.next, engine.size());
+    ASSERT_EQ(archive.kernels.size(), 1u);
+    ASSERT_EQ(engine.query_cached(p, directory.path, 7), expected);
+
+    // A damaged cache is calculated again.
+    damage(file, 50);
+    ASSERT_EQ(engine.query_cached(p, directory.path, 7), expected);
+    ASSERT_TRUE(load_archive(file, archive));
+
+    // A file of another pattern with the same hash is not used.
+    std::string other = "DCBAEEABDACBA";
+    std::snprintf(name, sizeof(name), "%016llx.lcsk",
+                  (unsigned long long)content_hash(other.data(), other.size(), engine.content_hash()));
+    archive.key = content_hash(other.data(), other.size(), engine.content_hash());
+    save_archive(directory.path + "/" + name, archive);
+    ASSERT_EQ(engine.query_cached(other, directory.path, 7), kernel::dp_lcs(other, t));
+    ASSERT_TRUE(load_archive(directory.path + "/" + name, archive));
+    ASSERT_EQ(archive.pattern, other);
+
+    // A truncated record in a file with a valid checksum is calculated again.
+    archive.kernels[0].second.resize(archive.kernels[0].second.size() - 8);
+    save_archive(directory.path + "/" + name, archive);
+    ASSERT_EQ(engine.query_cached(other, directory.path, 7), kernel::dp_lcs(other, t));
+    // Saves leave no temporary files behind.
+    std::string command = "test $(ls " + directory.path + " | wc -l) -eq 2";
+    ASSERT_EQ(std::system(command.c_str()), 0);
+}
+
+TEST(KernelFileTest, InterruptedQueryResumesFromCheckpointTest) {
+    TemporaryDirectory directory;
+    std::string p = "ABCADBAEEABCD";
+    std::string t = gc::get_lzw_grammar_string(60) + gc::get_lz78_grammar_string(30, 2);
+    gc::GCQueryEngine engine(gc::RePair(t));
+    char name[32];
+    std::snprintf(name, sizeof(name), "%016llx.lcsk",
+                  (unsigned long long)content_hash(p.data(), p.size(), engine.content_hash()));
+    std::string file = directory.path + "/" + name;
+
+    // Spilling kernels to a missing directory fails as soon as the kernels outgrow the budget,
+    // which interrupts the query after some checkpoints were saved.
+    KernelArchive<std::uint16_t> archive;
+    for (std::size_t budget = 64; !load_archive(file, archive); budget *= 2) {
+        engine.set_memory_budget(budget, directory.path + "/missing");
+        try {
+            engine.query_cached(p, directory.path, 5);
+            FAIL() << "the query was not interrupted";
+        } catch (const std::runtime_error &) {}
+    }
+    ASSERT_GT(archive.next, 0u);
+    ASSERT_LT(archive.next, engine.size());
+
+    engine.set_memory_budget(0);
+    ASSERT_EQ(engine.query_cached(p, directory.path, 5), kernel::dp_lcs(p, t));
+    ASSERT_TRUE(load_archive(file, archive));
+    ASSERT_EQ(archive.next, engine.size());
+}
+
+}  // namespace
+}  // namespace io
+}  // namespace LCS
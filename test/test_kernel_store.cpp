@@ -0,0 +1,194 @@
+#include <string>
+#include <algorithm>
+#include <random>
+#include <stdexcept>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "monge_matrix.h"
+#include "lcs_kernel.h"
+#include "kernel_store.h"
+#include "grammar_compressed.h"
+
+namespace LCS {
+namespace gc {
+namespace {
+
+matrix::Permutation random_kernel(unsigned size, std::mt19937 &generator) {
+    std::vector <unsigned> permutation(size);
+    for (unsigned i = 0; i < size; ++i) {
+        permutation[i] = i + 1;
+    }
+    std::shuffle(permutation.begin(), permutation.end(), generator);
+    return matrix::Permutation(permutation);
+}
+
+TEST(KernelStoreTest, SpilledKernelsAreReadBackTest) {
+    std::mt19937 generator(41);
+    std::vector <matrix::Permutation> expected;
+    KernelStore<unsigned> store(4096);
+    store.reset(20);
+    for (unsigned i = 0; i < 20; ++i) {
+        expected.push_back(random_kernel(50 + 10 * i, generator));
+        matrix::Permutation kernel = expected.back();
+        store.put(i, std::move(kernel), 2);
+        ASSERT_LE(store.resident_bytes(), 4096u);
+    }
+    ASSERT_GT(store.spilled(), 0u);
+    // Kernels are written out as they are stored, without reading them back.
+    ASSERT_EQ(store.live().size(), 20u);
+    std::size_t resident = store.resident_bytes();
+    for (unsigned i: store.live()) {
+        std::vector <char> record;
+        store.write(i, record);
+        ASSERT_EQ(PackedKernel<unsigned>::read(record.data()).unpack().cols, expected[i].cols);
+    }
+    ASSERT_EQ(store.resident_bytes(), resident);
+    for (unsigned i = 0; i < 20; ++i) {
+        ASSERT_EQ(store.get(i).rows, expected[i].rows);
+        ASSERT_EQ(store.get(i).cols, expected[i].cols);
+        ASSERT_FALSE(store.release(i));
+    }
+    // Kernels are spilled once, so reading them back and evicting them again writes nothing.
+    std::size_t spilled = store.spilled();
+    for (unsigned i = 0; i < 20; ++i) {
+        matrix::Permutation kernel = store.take(i);
+        ASSERT_EQ(kernel.rows, expected[i].rows);
+    }
+    ASSERT_EQ(store.spilled(), spilled);
+    ASSERT_EQ(store.resident_bytes(), 0u);
+    ASSERT_TRUE(store.live().empty());
+}
+
+TEST(KernelStoreTest, PackedKernelIsUnpackedToOriginalTest) {
+    std::mt19937 generator(42);
+    std::vector <matrix::Permutation> kernels = {matrix::Permutation(), random_kernel(1, generator),
+                                                 random_kernel(100, generator), random_kernel(3000, generator)};
+    std::vector <unsigned> identity(500);
+    for (unsigned i = 0; i < identity.size(); ++i) {
+        identity[i] = i + 1;
+    }
+    std::swap(identity[10], identity[11]);
+    kernels.push_back(matrix::Permutation(identity));
+    // A kernel that does not have dense rows and columns.
+    kernels.push_back(matrix::Permutation({{9, 1}, {5, 7}, {2, 3}}, {{1, 9}, {3, 2}, {7, 5}}));
+    for (const auto &kernel: kernels) {
+        PackedKernel<unsigned> packed(kernel);
+        ASSERT_EQ(packed.unpack().rows, kernel.rows);
+        ASSERT_EQ(packed.unpack().cols, kernel.cols);
+        std::vector <char> record(3, 'x');
+        packed.write(record);
+        ASSERT_EQ(PackedKernel<unsigned>::read(record.data() + 3).unpack().rows, kernel.rows);
+        ASSERT_EQ(PackedKernel<unsigned>::read(record.data() + 3, record.size() - 3).unpack().rows, kernel.rows);
+        // Records whose size does not match the size they declare are rejected.
+        ASSERT_THROW(PackedKernel<unsigned>::read(record.data() + 3, record.size() - 4), std::runtime_error);
+        record.push_back(0);
+        ASSERT_THROW(PackedKernel<unsigned>::read(record.data() + 3, record.size() - 3), std::runtime_error);
+    }
+    // Two bits per element are enough for a swap of neighbours.
+    ASSERT_LE(PackedKernel<unsigned>(kernels[4]).bytes(), 2 * 500 / 8 + 8u);
+}
+
+TEST(KernelStoreTest, PackedKernelsAreSpilledAndReadBackTest) {
+    std::mt19937 generator(43);
+    std::vector <matrix::Permutation> expected;
+    KernelStore<unsigned> store(2048, "", true);
+    store.reset(10);
+    for (unsigned i = 0; i < 10; ++i) {
+        expected.push_back(random_kernel(200, generator));
+        matrix::Permutation kernel = expected.back();
+        store.put(i, std::move(kernel), 1);
+    }
+    ASSERT_GT(store.spilled(), 0u);
+    for (unsigned i = 0; i < 10; ++i) {
+        ASSERT_EQ(store.get(i).cols, expected[i].cols);
+        ASSERT_EQ(store.take(i).rows, expected[i].rows);
+    }
+}
+
+TEST(KernelStoreTest, UnpackedCopiesCountTowardsBudgetTest) {
+    std::mt19937 generator(42);
+    std::vector <matrix::Permutation> expected;
+    KernelStore<unsigned> store(0, "", true);
+    store.reset(10);
+    for (unsigned i = 0; i < 10; ++i) {
+        expected.push_back(random_kernel(200, generator));
+        matrix::Permutation kernel = expected.back();
+        store.put(i, std::move(kernel), 1);
+    }
+    std::size_t packed = store.resident_bytes();
+    // Only the copies of the last two kernels passed to get are kept, and they are counted.
+    for (unsigned i = 0; i < 10; ++i) {
+        const matrix::Permutation &kernel = store.get(i);
+        ASSERT_EQ(kernel.rows, expected[i].rows);
+        if (i > 0) {
+            ASSERT_EQ(store.get(i - 1).rows, expected[i - 1].rows);
+            ASSERT_EQ(kernel.cols, expected[i].cols);
+        }
+        ASSERT_GT(store.resident_bytes(), packed);
+        ASSERT_LE(store.resident_bytes(), packed + 2 * 2 * 200 * sizeof(matrix::Permutation::Element) + 1024);
+    }
+    ASSERT_GT(store.statistics().peak_bytes, packed);
+    ASSERT_EQ(store.take(9).rows, expected[9].rows);
+    ASSERT_LT(store.resident_bytes(), packed);
+
+    // Under a budget, reading kernels back spills others rather than growing.
+    store.configure(4096, "", true);
+    store.reset(10);
+    for (unsigned i = 0; i < 10; ++i) {
+        store.put(i, matrix::Permutation(expected[i]), 1);
+    }
+    for (unsigned i = 0; i < 10; ++i) {
+        ASSERT_EQ(store.get(i).cols, expected[i].cols);
+        ASSERT_LE(store.resident_bytes(), 4096u + 2 * 2 * 200 * sizeof(matrix::Permutation::Element) + 1024);
+    }
+}
+
+TEST(KernelStoreTest, ReleasedKernelsAreDroppedTest) {
+    KernelStore<std::uint16_t> store;
+    store.reset(2);
+    store.put(0, matrix::BasicPermutation<std::uint16_t>(std::vector <std::uint16_t>{3, 1, 2}), 2);
+    store.put(1, matrix::BasicPermutation<std::uint16_t>(std::vector <std::uint16_t>{1, 2}), 1);
+    ASSERT_FALSE(store.release(0));
+    ASSERT_TRUE(store.release(1));
+    ASSERT_TRUE(store.release(0));
+    ASSERT_EQ(store.resident_bytes(), 0u);
+    ASSERT_EQ(store.spilled(), 0u);
+}
+
+TEST(KernelStoreTest, QueryWithinMemoryBudgetIsCorrectTest) {
+    std::string p = "ABCADBAEEABCD";
+    std::string t = get_lzw_grammar_string(60) + get_lz78_grammar_string(30, 2) + get_lz_grammar_string(40);
+    auto gcs = RePair(t);
+    unsigned expected = kernel::dp_lcs(p, t);
+    ASSERT_EQ(GCKernel(p, gcs, ExpansionSharing::VERIFIED, 256).lcs, expected);
+    ASSERT_EQ(GCKernel(p, gcs, ExpansionSharing::NONE, 1).lcs, expected);
+
+    GCQueryEngine engine(gcs);
+    engine.set_memory_budget(512);
+    ASSERT_EQ(engine.query(p), expected);
+    ASSERT_EQ(engine.query_split(p), expected);
+    ASSERT_EQ(engine.query_split(p, 4, 2), expected);
+    engine.set_memory_budget(0);
+    ASSERT_EQ(engine.query(p), expected);
+}
+
+TEST(KernelStoreTest, PackedQueryIsCorrectTest) {
+    std::string p = "ABCADBAEEABCDABCADBAEEABCD";
+    std::string t = get_lzw_grammar_string(80) + get_lz78_grammar_string(40, 2) + get_lz_grammar_string(60);
+    GCQueryEngine engine(RePair(t));
+    KernelStats plain, packed;
+    unsigned expected = kernel::dp_lcs(p, t);
+    ASSERT_EQ(engine.query(p, plain), expected);
+    engine.set_kernel_packing(true);
+    ASSERT_EQ(engine.query(p, packed), expected);
+    ASSERT_EQ(engine.query_split(p), expected);
+    ASSERT_LT(packed.peak_bytes, plain.peak_bytes);
+    engine.set_memory_budget(64);
+    ASSERT_EQ(engine.query(p, packed), expected);
+    ASSERT_GT(packed.spilled, 0u);
+}
+
+}  // namespace
+}  // namespace gc
+}  // namespace LCS
@@ -1,7 +1,12 @@
 #include <string>
+#include <string_view>
 #include <algorithm>
 #include <iostream>
 #include <numeric>
+#include <random>
+#include <cstdint>
+#include <vector>
+#include <stdexcept>
 
 #include "gtest/gtest.h"
 #include "monge_matrix.h"
@@ -35,6 +40,18 @@ void test_lcs_suffix_a_prefix_b(const LCSKernel &kernel, const std::string &a, c
     }
 }
 
+void test_alignment(const std::string &a, const std::string &b, unsigned threads) {
+    auto alignment = lcs_alignment(a, b, threads);
+    ASSERT_EQ(alignment.size(), dp_lcs(a, b));
+    for (unsigned i = 0; i < alignment.size(); ++i) {
+        ASSERT_EQ(a[alignment[i].first], b[alignment[i].second]);
+        if (i) {
+            ASSERT_LT(alignment[i - 1].first, alignment[i].first);
+            ASSERT_LT(alignment[i - 1].second, alignment[i].second);
+        }
+    }
+}
+
 void test_lcs_prefix_a_suffix_b(const LCSKernel &kernel, const std::string &a, const std::string &b) {
     for (unsigned i = 0; i <= a.size(); ++i) {
         for (unsigned j = 0; j <= b.size(); ++j) {
@@ -105,6 +122,168 @@ TEST(KernelTest, CalculateIterativeLCSSuffixPrefixTest) {
     test_lcs_suffix_a_prefix_b(IterativeLCS("AAAAAAAAAAA", "AAAAAAAAA"), "AAAAAAAAAAA", "AAAAAAAAA");
 }
 
+TEST(KernelTest, TiledCombingIsRowCombingTest) {
+    std::mt19937 generator(50);
+    for (unsigned size: {IterativeLCS::TILE - 1, 2 * IterativeLCS::TILE + 37}) {
+        std::string a, b;
+        for (unsigned j = size; j > 0; --j) {
+            a += "ABC"[generator() % 3];
+        }
+        for (unsigned j = size + IterativeLCS::TILE / 2; j > 0; --j) {
+            b += "ABC"[generator() % 3];
+        }
+        // A recursion base above the summary length combs the whole braid row by row.
+        matrix::Permutation expected = RecursiveLCS::kernel(a, b, a.size() + b.size() + 1);
+        for (unsigned threads: {1u, 2u, 3u}) {
+            ASSERT_EQ(IterativeLCS::kernel(a, b, threads).rows, expected.rows);
+        }
+    }
+    // Fewer rows than threads or than a tile are split into shorter rows of tiles, one for every thread.
+    std::string a = "ABCABBACCA", b(3 * IterativeLCS::TILE + 5, 'A');
+    for (unsigned j = 0; j < b.size(); ++j) {
+        b[j] = "ABC"[generator() % 3];
+    }
+    for (unsigned threads: {2u, 3u, 4u, 16u}) {
+        ASSERT_EQ(IterativeLCS::kernel(a, b, threads).rows, RecursiveLCS::kernel(a, b, a.size() + b.size() + 1).rows);
+    }
+    ASSERT_EQ(IterativeLCS::kernel("", "AB", 4).rows, RecursiveLCS::kernel("", "AB").rows);
+}
+
+TEST(KernelTest, AlignmentIsLongestCommonSubsequenceTest) {
+    test_alignment("BAABCBCA", "BAABCABCABACA", 1);
+    test_alignment("xvuy", "uyxv", 1);
+    test_alignment("AAAAAAAAAAA", "AAAAAAAAA", 1);
+    test_alignment("", "AB", 1);
+    test_alignment("AB", "", 1);
+    test_alignment("ABC", "DEF", 1);
+    std::mt19937 generator(38);
+    for (unsigned i = 0; i < 100; ++i) {
+        std::string a, b;
+        for (unsigned j = generator() % 40; j > 0; --j) {
+            a += "ABC"[generator() % 3];
+        }
+        for (unsigned j = generator() % 40; j > 0; --j) {
+            b += "ABC"[generator() % 3];
+        }
+        test_alignment(a, b, 1 + i % 4);
+    }
+}
+
+TEST(KernelTest, ConcatenatedKernelsAreKernelOfConcatenationTest) {
+    std::mt19937 generator(44);
+    for (unsigned i = 0; i < 50; ++i) {
+        std::string a, b1, b2;
+        for (unsigned j = generator() % 20; j > 0; --j) {
+            a += "ABC"[generator() % 3];
+        }
+        for (unsigned j = generator() % 20; j > 0; --j) {
+            b1 += "ABC"[generator() % 3];
+        }
+        for (unsigned j = generator() % 20; j > 0; --j) {
+            b2 += "ABC"[generator() % 3];
+        }
+        matrix::Permutation kernel = concat_kernels(RecursiveLCS::kernel(a, b1), RecursiveLCS::kernel(a, b2),
+                                                    a.size() + b1.size() + b2.size());
+        ASSERT_EQ(kernel.rows, RecursiveLCS::kernel(a, b1 + b2).rows);
+        LCSKernel joined = concat(RecursiveLCS(a, b1), IterativeLCS(a, b2));
+        ASSERT_EQ(joined.get_b(), b1 + b2);
+        test_whole_a(joined, a, b1 + b2);
+    }
+    ASSERT_THROW(concat(RecursiveLCS("AB", "A"), RecursiveLCS("BA", "A")), std::invalid_argument);
+}
+
+TEST(KernelTest, TokenKernelsCompareWholeSymbolsTest) {
+    std::mt19937 generator(46);
+    for (unsigned i = 0; i < 30; ++i) {
+        // Tokens 0x100 + c and 0x200 + c differ only above their lowest byte.
+        std::vector <std::uint32_t> a, b;
+        std::vector <std::uint16_t> a16, b16;
+        std::string a_chars, b_chars;
+        for (unsigned j = generator() % 25; j > 0; --j) {
+            unsigned token = generator() % 4;
+            a.push_back(((token % 2 + 1) << 8) + 'A' + token / 2 + (1u << 20));
+            a16.push_back(a.back());
+            a_chars += "ABCD"[token];
+        }
+        for (unsigned j = generator() % 25; j > 0; --j) {
+            unsigned token = generator() % 4;
+            b.push_back(((token % 2 + 1) << 8) + 'A' + token / 2 + (1u << 20));
+            b16.push_back(b.back());
+            b_chars += "ABCD"[token];
+        }
+        ASSERT_EQ(dp_lcs<std::uint32_t>(a, b), dp_lcs(a_chars, b_chars));
+        ASSERT_EQ(RecursiveLCS::kernel<std::uint32_t>(a, b).rows, RecursiveLCS::kernel(a_chars, b_chars).rows);
+        ASSERT_EQ(RecursiveLCS::kernel<std::uint16_t>(a16, b16).rows, RecursiveLCS::kernel(a_chars, b_chars).rows);
+        ASSERT_EQ(IterativeLCS::kernel<std::uint32_t>(a, b, 2).rows, RecursiveLCS::kernel(a_chars, b_chars).rows);
+        auto alignment = lcs_alignment<std::uint32_t>(a, b, 2);
+        ASSERT_EQ(alignment.size(), dp_lcs(a_chars, b_chars));
+        for (const auto &match: alignment) {
+            ASSERT_EQ(a[match.first], b[match.second]);
+        }
+    }
+}
+
+// Returns s with every character replaced by the representative of its class.
+std::string normalize(const std::string &s, const CharClasses &classes) {
+    std::string result;
+    for (char c: s) {
+        result += (char)classes.class_of(c);
+    }
+    return result;
+}
+
+TEST(KernelTest, CharClassesMatchWithoutNormalizingTest) {
+    CharClasses classes = CharClasses::case_insensitive().join("0123456789");
+    ASSERT_TRUE(classes('q', 'Q'));
+    ASSERT_TRUE(classes('3', '8'));
+    ASSERT_FALSE(classes('a', 'b'));
+    ASSERT_FALSE(classes('a', '1'));
+    std::mt19937 generator(47);
+    for (unsigned i = 0; i < 30; ++i) {
+        std::string a, b;
+        for (unsigned j = generator() % 20; j > 0; --j) {
+            a += "aAbB0123-"[generator() % 9];
+        }
+        for (unsigned j = generator() % 20; j > 0; --j) {
+            b += "aAbB4567-"[generator() % 9];
+        }
+        std::string a_normal = normalize(a, classes), b_normal = normalize(b, classes);
+        ASSERT_EQ(dp_lcs(a, b, classes), dp_lcs(a_normal, b_normal));
+        ASSERT_EQ(RecursiveLCS::kernel(a, b, classes).rows, RecursiveLCS::kernel(a_normal, b_normal).rows);
+        test_whole_a(RecursiveLCS(a, b, classes, 3), a_normal, b_normal);
+        test_whole_b(IterativeLCS(a, b, classes), a_normal, b_normal);
+        auto alignment = lcs_alignment(a, b, classes, 2);
+        ASSERT_EQ(alignment.size(), dp_lcs(a_normal, b_normal));
+        for (const auto &match: alignment) {
+            ASSERT_TRUE(classes(a[match.first], b[match.second]));
+        }
+    }
+}
+
+TEST(KernelTest, KernelBorrowsOrOwnsStringsTest) {
+    std::string buffer = "xxBAABCBCAyyBAABCABCABACAzz";
+    std::string_view a = std::string_view(buffer).substr(2, 8), b = std::string_view(buffer).substr(12, 13);
+    RecursiveLCS borrowed(a, b, 5, Ownership::BORROW);
+    ASSERT_EQ(borrowed.get_a().data(), buffer.data() + 2);
+    ASSERT_EQ(LCSKernel(borrowed).get_b().data(), buffer.data() + 12);
+    test_whole_a(borrowed, std::string(a), std::string(b));
+
+    std::string copy_a(a), copy_b(b);
+    IterativeLCS *owned = new IterativeLCS(copy_a, copy_b, Ownership::COPY);
+    copy_a.assign(copy_a.size(), 'x');
+    copy_b.clear();
+    ASSERT_EQ(owned->get_a(), a);
+    LCSKernel copy(*owned);
+    delete owned;
+    ASSERT_EQ(copy.get_a(), a);
+    ASSERT_EQ(copy.get_b(), b);
+    test_whole_b(copy, std::string(a), std::string(b));
+
+    // Kernels copy their strings by default, so temporaries can be passed.
+    IterativeLCS temporary(std::string(a).substr(1), std::string(b));
+    ASSERT_EQ(temporary.get_a(), a.substr(1));
+    test_whole_a(temporary, std::string(a.substr(1)), std::string(b));
+}
 
 }  // namespace
 }  // namespace matrix
@@ -2,6 +2,7 @@
 #include <algorithm>
 #include <iostream>
 #include <numeric>
+#include <random>
 
 #include "gtest/gtest.h"
 #include "monge_matrix.h"
@@ -264,6 +265,52 @@ TEST(MongeMatrixTest, PermutationMatrixMultiplicationTestSimple) {
 //                     PermutationMatrix{3, 2, second_permutation});
 // }
 
+TEST(MongeMatrixTest, DominanceCounterMatchesBruteForce) {
+    std::mt19937 generator(7);
+    for (unsigned n: {0u, 1u, 2u, 5u, 17u, 64u}) {
+        std::vector <unsigned> permutation(n);
+        std::iota(permutation.begin(), permutation.end(), 1);
+        std::shuffle(permutation.begin(), permutation.end(), generator);
+        Permutation p(permutation);
+        DominanceCounter counter(p);
+        for (unsigned x = 0; x <= n + 1; ++x) {
+            for (unsigned y = 0; y <= n + 1; ++y) {
+                unsigned expected = 0;
+                for (auto element: p.rows) {
+                    expected += (element.first > x && element.second > y);
+                }
+                ASSERT_EQ(counter.count(x, y), expected);
+            }
+        }
+    }
+}
+
+TEST(MongeMatrixTest, PermutationMultiplicationIsIndependentOfIndexWidth) {
+    std::mt19937 generator(11);
+    for (unsigned n: {1u, 7u, 100u, 1000u}) {
+        std::vector <unsigned> first(n), second(n);
+        std::iota(first.begin(), first.end(), 1);
+        std::iota(second.begin(), second.end(), 1);
+        std::shuffle(first.begin(), first.end(), generator);
+        std::shuffle(second.begin(), second.end(), generator);
+        Permutation expected = Permutation(first) * Permutation(second);
+        BasicPermutation<std::uint16_t> narrow =
+                BasicPermutation<std::uint16_t>(std::vector <std::uint16_t>(first.begin(), first.end())) *
+                BasicPermutation<std::uint16_t>(std::vector <std::uint16_t>(second.begin(), second.end()));
+        BasicPermutation<std::uint64_t> wide =
+                BasicPermutation<std::uint64_t>(std::vector <std::uint64_t>(first.begin(), first.end())) *
+                BasicPermutation<std::uint64_t>(std::vector <std::uint64_t>(second.begin(), second.end()));
+        ASSERT_EQ(narrow.rows.size(), expected.rows.size());
+        ASSERT_EQ(wide.rows.size(), expected.rows.size());
+        for (unsigned i = 0; i < expected.rows.size(); ++i) {
+            ASSERT_EQ(narrow.rows[i].first, expected.rows[i].first);
+            ASSERT_EQ(narrow.rows[i].second, expected.rows[i].second);
+            ASSERT_EQ(wide.rows[i].first, expected.rows[i].first);
+            ASSERT_EQ(wide.rows[i].second, expected.rows[i].second);
+        }
+    }
+}
+
 }  // namespace
 }  // namespace matrix
 }  // namespace LCS
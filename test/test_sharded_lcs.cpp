@@ -0,0 +1,54 @@
+#include <string>
+#include <iostream>
+#include <cstdlib>
+#include <random>
+#include <stdexcept>
+
+#include <stdlib.h>
+
+#include "gtest/gtest.h"
+#include "monge_matrix.h"
+#include "lcs_kernel.h"
+#include "sharded_lcs.h"
+#include "test_utils.h"
+
+namespace LCS {
+namespace kernel {
+namespace {
+
+using test::random_string;
+
+TEST(ShardedLCSTest, ShardedKernelIsRecursiveKernelTest) {
+    std::mt19937 generator(44);
+    for (unsigned i = 0; i < 10; ++i) {
+        std::string a = random_string(generator, generator() % 30, "ABCD");
+        std::string b = random_string(generator, generator() % 200, "ABCD");
+        matrix::Permutation expected = RecursiveLCS::kernel(a, b);
+        for (unsigned shards: {1u, 2u, 5u, 8u}) {
+            ASSERT_EQ(sharded_kernel(a, b, shards, 1 + i % 3).rows, expected.rows);
+        }
+    }
+}
+
+TEST(ShardedLCSTest, MoreShardsThanCharactersTest) {
+    ASSERT_EQ(sharded_kernel("ABCA", "CAB", 10, 4).rows, RecursiveLCS::kernel("ABCA", "CAB").rows);
+    ASSERT_EQ(sharded_kernel("ABCA", "", 3).rows, RecursiveLCS::kernel("ABCA", "").rows);
+}
+
+TEST(ShardedLCSTest, GivenDirectoryIsLeftEmptyTest) {
+    char name[] = "/tmp/lcs_sharded_XXXXXX";
+    std::string directory = mkdtemp(name);
+    sharded_kernel("ABCABBA", "CBABACABBCA", 3, 2, directory);
+    // rmdir only removes an empty directory.
+    std::string command = "rmdir " + directory;
+    ASSERT_EQ(std::system(command.c_str()), 0);
+}
+
+TEST(ShardedLCSTest, FailedWorkerIsReportedTest) {
+    ASSERT_THROW(sharded_kernel("ABCABBA", "CBABACABBCA", 3, 2, "/tmp/lcs_sharded_missing/directory"),
+                 std::runtime_error);
+}
+
+}  // namespace
+}  // namespace kernel
+}  // namespace LCS
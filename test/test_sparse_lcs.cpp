@@ -0,0 +1,73 @@
+#include <string>
+#include <cstdint>
+#include <random>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "monge_matrix.h"
+#include "lcs_kernel.h"
+#include "sparse_lcs.h"
+#include "test_utils.h"
+
+namespace LCS {
+namespace kernel {
+namespace {
+
+using test::random_string;
+
+TEST(SparseLCSTest, SparseLCSIsDynamicProgrammingLCSTest) {
+    std::mt19937 generator(48);
+    for (std::string alphabet: {"AB", "ABCDEFGH", "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789"}) {
+        for (unsigned i = 0; i < 30; ++i) {
+            std::string a = random_string(generator, generator() % 40, alphabet);
+            std::string b = random_string(generator, generator() % 60, alphabet);
+            ASSERT_EQ(sparse_lcs(a, b), dp_lcs(a, b));
+        }
+    }
+    ASSERT_EQ(sparse_lcs("", "ABC"), 0u);
+    ASSERT_EQ(sparse_lcs("ABC", ""), 0u);
+}
+
+TEST(SparseLCSTest, SparseKernelIsRecursiveKernelTest) {
+    std::mt19937 generator(48);
+    for (std::string alphabet: {"AB", "ABCDEFGH", "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789"}) {
+        for (unsigned i = 0; i < 20; ++i) {
+            std::string a = random_string(generator, generator() % 30, alphabet);
+            std::string b = random_string(generator, generator() % 40, alphabet);
+            for (unsigned recursion_base: {1u, 5u, 16u}) {
+                ASSERT_EQ(SparseLCS::kernel(a, b, recursion_base).rows, RecursiveLCS::kernel(a, b).rows);
+            }
+        }
+    }
+}
+
+TEST(SparseLCSTest, SparseLCSAnswersSemiLocalQueriesTest) {
+    std::string a = "x1y2z3ABCq", b = "ABCr4s5t6ABu";
+    SparseLCS sparse(a, b);
+    IterativeLCS expected(a, b);
+    for (unsigned l = 0; l <= b.size(); ++l) {
+        for (unsigned r = l; r <= b.size(); ++r) {
+            ASSERT_EQ(sparse.lcs_whole_a(l, r), expected.lcs_whole_a(l, r));
+        }
+    }
+    for (unsigned l = 0; l <= a.size(); ++l) {
+        for (unsigned r = 0; r <= b.size(); ++r) {
+            ASSERT_EQ(sparse.lcs_suffix_a_prefix_b(l, r), expected.lcs_suffix_a_prefix_b(l, r));
+        }
+    }
+}
+
+TEST(SparseLCSTest, SparseTokensTest) {
+    std::mt19937 generator(48);
+    std::vector <std::uint32_t> a, b;
+    for (unsigned i = 0; i < 120; ++i) {
+        a.push_back(generator() % 1000 + (1u << 24));
+        b.push_back(generator() % 1000 + (1u << 24));
+    }
+    ASSERT_EQ(sparse_lcs<std::uint32_t>(a, b), dp_lcs<std::uint32_t>(a, b));
+    ASSERT_EQ(SparseLCS::kernel<std::uint32_t>(a, b).rows, RecursiveLCS::kernel<std::uint32_t>(a, b).rows);
+}
+
+}  // namespace
+}  // namespace kernel
+}  // namespace LCS
@@ -0,0 +1,22 @@
+#ifndef TEST_TEST_UTILS_H_
+#define TEST_TEST_UTILS_H_
+
+#include <random>
+#include <string>
+
+namespace LCS {
+namespace test {
+
+// Returns a string of size characters drawn uniformly from alphabet.
+inline std::string random_string(std::mt19937 &generator, unsigned size, const std::string &alphabet) {
+    std::string result;
+    for (unsigned i = 0; i < size; ++i) {
+        result += alphabet[generator() % alphabet.size()];
+    }
+    return result;
+}
+
+}  // namespace test
+}  // namespace LCS
+
+#endif  // TEST_TEST_UTILS_H_
@@ -4,6 +4,14 @@
 #include <string>
 #include <fstream>
 #include <sstream>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
 #include "lcs_kernel.h"
 #include "grammar_compressed.h"
@@ -156,6 +164,11 @@ void test_unix_compress(const std::string &p, const std::string &file_name, bool
     auto dp_time = time_dp(p, t, dbg);
     // std::cout << "STRING " << t << std::endl;
     if (dbg) {
+        LCS::gc::NormalizationReport report;
+        auto normalized = LCS::gc::normalize(compress_w, &report);
+        auto normalized_time = time_recursive(p, normalized, dbg);
+        std::cout << "Normalization leaves " << report.rules_after << " of " << report.rules_before << " rules" << std::endl;
+        std::cout << "Time for normalized lzw recursive kernel is " << normalized_time << "ms" << std::endl;
         std::cout << "Time for dynamic programming is " << dp_time << "ms" << std::endl;
         std::cout << "Time for lzw recursive kernel is " << lzw_time << "ms" << std::endl;
     }
@@ -218,7 +231,7 @@ void test_bad_graph(unsigned int pattern_size, const std::string &tlist, bool db
     for (unsigned int i = 0; i < repeats; ++i) {
         std::string t = tlist.substr(i * tlen, tlen);
         std::string p = generate_random_abc_string(pattern_size);
-        LCS::gc::GrammarCompressedStorage compress_w = LCS::gc::LZW(t); // TODO LZW2
+        LCS::gc::GrammarCompressedStorage compress_w = LCS::gc::LZW2(t);
         grammar_length = compress_w.final_rule + 3;
         auto lzw_time = time_recursive(p, compress_w, dbg);
         auto dp_time = time_dp(p, t, dbg);
@@ -260,7 +273,176 @@ void test_bad_graph_lz78(unsigned int pattern_size, const std::string &tlist, bo
     }
 }
 
+void test_query_engine(unsigned int pattern_size, const std::string &file_name, unsigned int repeats, bool dbg) {
+    LCS::gc::GrammarCompressedStorage compress_w = LCS::gc::get_compress_string(file_name);
+    std::vector <std::string> patterns;
+    for (unsigned int i = 0; i < repeats; ++i) {
+        patterns.push_back(generate_random_alpha_string(pattern_size));
+    }
+    time_point<Clock> start = Clock::now();
+    for (const auto &p: patterns) {
+        LCS::gc::GCKernel(p, compress_w);
+    }
+    time_point<Clock> middle = Clock::now();
+    LCS::gc::GCQueryEngine engine(compress_w);
+    time_point<Clock> preprocessed = Clock::now();
+    for (const auto &p: patterns) {
+        engine.query(p);
+    }
+    time_point<Clock> end = Clock::now();
+    double kernel_time = duration_cast<milliseconds>(middle - start).count();
+    double preprocessing_time = duration_cast<milliseconds>(preprocessed - middle).count();
+    double query_time = duration_cast<milliseconds>(end - preprocessed).count();
+    if (dbg) {
+        std::cout << "Query engine keeps " << engine.size() << " of " << compress_w.rules.size() << " rules" << std::endl;
+        std::cout << "Time for " << repeats << " recursive kernels is " << kernel_time << "ms" << std::endl;
+        std::cout << "Time for query engine preprocessing is " << preprocessing_time << "ms" << std::endl;
+        std::cout << "Time for " << repeats << " query engine queries is " << query_time << "ms" << std::endl;
+    }
+    // to-latex-format: pattern length, queries, kernel time, preprocessing time, query time
+    if (!dbg) {
+        std::cout << pattern_size << '&' << repeats << '&' << kernel_time << '&' << preprocessing_time << '&' <<
+        query_time << "\\\\" << std::endl;
+    }
+}
+
+void test_packed_kernels(unsigned int pattern_size, unsigned int text_size, unsigned int repeats, bool dbg) {
+    // RePair of a random text keeps many kernels alive at once, each waiting for the rules that use it.
+    LCS::gc::GCQueryEngine engine(LCS::gc::RePair(generate_random_abc_string(text_size)));
+    std::vector <std::string> patterns;
+    for (unsigned int i = 0; i < repeats; ++i) {
+        patterns.push_back(generate_random_abc_string(pattern_size));
+    }
+    double times[2];
+    std::size_t peak_bytes[2] = {0, 0};
+    for (int packing = 0; packing < 2; ++packing) {
+        engine.set_kernel_packing(packing);
+        time_point<Clock> start = Clock::now();
+        for (const auto &p: patterns) {
+            LCS::gc::KernelStats stats;
+            engine.query(p, stats);
+            peak_bytes[packing] = std::max(peak_bytes[packing], stats.peak_bytes);
+        }
+        times[packing] = duration_cast<milliseconds>(Clock::now() - start).count();
+    }
+    if (dbg) {
+        std::cout << "Time for " << repeats << " queries is " << times[0] << "ms, " << times[1] << "ms packed" << std::endl;
+        std::cout << "Peak kernel memory is " << peak_bytes[0] << " bytes, " << peak_bytes[1] << " bytes packed" << std::endl;
+    }
+    // to-latex-format: pattern length, text length, plain time, packed time, plain peak bytes, packed peak bytes
+    if (!dbg) {
+        std::cout << pattern_size << '&' << text_size << '&' << times[0] << '&' << times[1] << '&' <<
+        peak_bytes[0] << '&' << peak_bytes[1] << "\\\\" << std::endl;
+    }
+}
+
+// Splits text into words at spaces and numbers them, equal words by equal tokens.
+std::vector <std::uint32_t> tokenize(const std::string &text, std::unordered_map <std::string, std::uint32_t> &tokens) {
+    std::vector <std::uint32_t> result;
+    std::istringstream words(text);
+    std::string word;
+    while (words >> word) {
+        result.push_back(tokens.emplace(word, tokens.size()).first->second);
+    }
+    return result;
+}
+
+void test_word_level(unsigned int words, unsigned int vocabulary, bool dbg) {
+    std::vector <std::string> dictionary;
+    for (unsigned int i = 0; i < vocabulary; ++i) {
+        dictionary.push_back(generate_random_alpha_string(3 + rand() % 6));
+    }
+    std::string a, b;
+    for (unsigned int i = 0; i < words; ++i) {
+        a += dictionary[rand() % vocabulary] + ' ';
+        b += dictionary[rand() % vocabulary] + ' ';
+    }
+    std::unordered_map <std::string, std::uint32_t> tokens;
+    std::vector <std::uint32_t> a_tokens = tokenize(a, tokens), b_tokens = tokenize(b, tokens);
 
+    time_point<Clock> start = Clock::now();
+    LCS::kernel::RecursiveLCS::kernel(a, b);
+    double char_time = duration_cast<milliseconds>(Clock::now() - start).count();
+    start = Clock::now();
+    LCS::kernel::RecursiveLCS::kernel<std::uint32_t>(a_tokens, b_tokens);
+    double token_time = duration_cast<milliseconds>(Clock::now() - start).count();
+    if (dbg) {
+        std::cout << "Kernel of " << a.size() << " characters in " << char_time << "ms, of " <<
+        a_tokens.size() << " tokens in " << token_time << "ms" << std::endl;
+    }
+    // to-latex-format: words, characters, character time, token time
+    if (!dbg) {
+        std::cout << words << '&' << a.size() << '&' << char_time << '&' << token_time << "\\\\" << std::endl;
+    }
+}
+
+// Counts the cache misses of this process between start and stop with perf_event_open.
+// Where the counter is not available, as in many containers and virtual machines, stop returns -1.
+class CacheMisses {
+public:
+    CacheMisses() {
+        perf_event_attr attr{};
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = PERF_COUNT_HW_CACHE_MISSES;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.inherit = 1;  // count the worker threads as well
+        fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+    ~CacheMisses() {
+        if (fd != -1) {
+            close(fd);
+        }
+    }
+    void start() {
+        if (fd != -1) {
+            ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+    long long stop() {
+        long long count = -1;
+        if (fd != -1) {
+            ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+            if (read(fd, &count, sizeof(count)) != sizeof(count)) {
+                count = -1;
+            }
+        }
+        return count;
+    }
+private:
+    int fd;
+};
+
+void test_tiled_combing(unsigned int a_size, unsigned int b_size, unsigned int threads, bool dbg) {
+    std::string a = generate_random_abc_string(a_size), b = generate_random_abc_string(b_size);
+    CacheMisses misses;
+    // A recursion base above the summary length combs the whole braid row by row.
+    misses.start();
+    time_point<Clock> start = Clock::now();
+    LCS::kernel::RecursiveLCS::kernel(a, b, a_size + b_size + 1);
+    double row_time = duration_cast<milliseconds>(Clock::now() - start).count();
+    long long row_misses = misses.stop();
+    misses.start();
+    start = Clock::now();
+    LCS::kernel::IterativeLCS::kernel(a, b, threads);
+    double tiled_time = duration_cast<milliseconds>(Clock::now() - start).count();
+    long long tiled_misses = misses.stop();
+    double cells = (double)a_size * b_size;
+    if (dbg) {
+        std::cout << "Combing row by row takes " << row_time << "ms, " << cells / 1000 / row_time <<
+        " Mcells/s, " << row_misses << " cache misses" << std::endl;
+        std::cout << "Combing tiles on " << threads << " threads takes " << tiled_time << "ms, " <<
+        cells / 1000 / tiled_time << " Mcells/s, " << tiled_misses << " cache misses" << std::endl;
+    }
+    // to-latex-format: a length, b length, threads, row time, tiled time, row cache misses, tiled cache misses
+    if (!dbg) {
+        std::cout << a_size << '&' << b_size << '&' << threads << '&' << row_time << '&' << tiled_time << '&' <<
+        row_misses << '&' << tiled_misses << "\\\\" << std::endl;
+    }
+}
 
 int main() {
     // All time tests that have been run for this code.
@@ -327,6 +509,20 @@ int main() {
     // test_aa(generate_random_abc_string(30), 1ll * 536870000, 0);
     // test_aa(generate_random_abc_string(30), 1ll * 536800000 * 10, 0);
 
+    // test_query_engine(4, "../test_files/t8.Z", 100, 1);
+    // test_query_engine(64, "../test_files/t8.Z", 100, 1);
+
+    // test_packed_kernels(64, 20000, 5, 1);
+    // test_packed_kernels(512, 20000, 5, 1);
+
+    // test_word_level(100, 500, 1);
+    // test_word_level(200, 500, 1);
+
+    // test_tiled_combing(1024, 1 << 23, 1, 1);
+    // test_tiled_combing(4096, 1 << 23, 4, 1);
+    // test_tiled_combing(1024, 1 << 23, 4, 1);
+    // test_tiled_combing(256, 1 << 23, 4, 1);
+
     srand(time(0));
 
     // LZW & LZ78 generated runs